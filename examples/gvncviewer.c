@@ -32,11 +32,15 @@
 #endif
 
 static gchar **args = NULL;
+static gchar *stats_file = NULL;
 static const GOptionEntry options [] =
 {
 	{
 		G_OPTION_REMAINING, '\0', 0, G_OPTION_ARG_STRING_ARRAY, &args,
 		NULL, "[hostname][:display]" },
+	{
+		"stats-file", '\0', 0, G_OPTION_ARG_FILENAME, &stats_file,
+		"Save performance statistics to FILE every second, as JSON if it ends in .json, else Prometheus text", "FILE" },
 	{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, 0 }
 };
 
@@ -121,6 +125,23 @@ static void vnc_desktop_resize(GtkWidget *vncdisplay G_GNUC_UNUSED,
 	printf("Remote desktop size changed to %dx%d\n", width, height);
 }
 
+static gboolean save_stats(gpointer data G_GNUC_UNUSED)
+{
+	VncStats *stats = vnc_display_get_stats(VNC_DISPLAY(vnc));
+	VncStatsFormat format = g_str_has_suffix(stats_file, ".json") ?
+		VNC_STATS_FORMAT_JSON : VNC_STATS_FORMAT_PROMETHEUS;
+	GError *error = NULL;
+
+	if (!vnc_stats_save(stats, format, stats_file, &error)) {
+		fprintf(stderr, "Unable to save statistics to %s: %s\n",
+			stats_file, error->message);
+		g_error_free(error);
+	}
+	vnc_stats_free(stats);
+
+	return TRUE;
+}
+
 static void vnc_disconnected(GtkWidget *vncdisplay G_GNUC_UNUSED)
 {
 	if(connected)
@@ -687,8 +708,14 @@ int main(int argc, char **argv)
 			 G_CALLBACK(window_state_event), layout);
 #endif
 
+	if (stats_file)
+		g_timeout_add(1000, save_stats, NULL);
+
 	gtk_main();
 
+	if (stats_file)
+		save_stats(NULL);
+
 	return 0;
 }
 
@@ -42,6 +42,12 @@ typedef void vnc_base_framebuffer_rgb24_blt_func(VncBaseFramebufferPrivate *priv
 						 guint8 *src, int rowstride,
 						 guint16 x, guint16 y,
 						 guint16 width, guint16 height);
+typedef void vnc_base_framebuffer_build_lut_func(VncBaseFramebufferPrivate *priv);
+typedef void vnc_base_framebuffer_expand_func(guint8 *dst,
+					      const guint8 *indexes,
+					      int bits,
+					      const guint8 *palette,
+					      guint16 width);
 
 
 #define VNC_BASE_FRAMEBUFFER_GET_PRIVATE(obj)				\
@@ -58,6 +64,9 @@ struct _VncBaseFramebufferPrivate {
 
 	VncColorMap *colorMap;
 
+	/* One of VncBaseFramebufferKernels */
+	int kernels;
+
 	/* TRUE if the following derived data needs reinitializing */
 	gboolean reinitRenderFuncs;
 
@@ -67,6 +76,10 @@ struct _VncBaseFramebufferPrivate {
         int rls, gls, bls;
 	int alpha_mask;
 
+	/* Local pixel for each remote pixel, when the remote
+	 * format is 8 or 16 bpp, otherwise NULL */
+	guint8 *lut;
+
 	/* TRUE if localFormat == remoteFormat */
         gboolean perfect_match;
 
@@ -75,6 +88,8 @@ struct _VncBaseFramebufferPrivate {
         vnc_base_framebuffer_fill_func *fill;
         vnc_base_framebuffer_blt_func *blt;
         vnc_base_framebuffer_rgb24_blt_func *rgb24_blt;
+	/* Palette index expansion for 1, 2, 4 and 8 bit indexes */
+	vnc_base_framebuffer_expand_func *expand[4];
 };
 
 #define VNC_BASE_FRAMEBUFFER_AT(priv, x, y) \
@@ -97,6 +112,7 @@ enum {
 	PROP_LOCAL_FORMAT,
 	PROP_REMOTE_FORMAT,
 	PROP_COLOR_MAP,
+	PROP_KERNELS,
 };
 
 
@@ -137,6 +153,10 @@ static void vnc_base_framebuffer_get_property(GObject *object,
 		g_value_set_boxed(value, priv->colorMap);
 		break;
 
+	case PROP_KERNELS:
+		g_value_set_int(value, priv->kernels);
+		break;
+
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
 	}
@@ -192,6 +212,11 @@ static void vnc_base_framebuffer_set_property(GObject *object,
 		priv->reinitRenderFuncs = TRUE;
 		break;
 
+	case PROP_KERNELS:
+		priv->kernels = g_value_get_int(value);
+		priv->reinitRenderFuncs = TRUE;
+		break;
+
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         }
@@ -211,6 +236,7 @@ static void vnc_base_framebuffer_finalize(GObject *object)
 		vnc_pixel_format_free(priv->remoteFormat);
 	if (priv->colorMap)
 		vnc_color_map_free(priv->colorMap);
+	g_free(priv->lut);
 
 	G_OBJECT_CLASS(vnc_base_framebuffer_parent_class)->finalize (object);
 }
@@ -313,6 +339,20 @@ static void vnc_base_framebuffer_class_init(VncBaseFramebufferClass *klass)
 							   G_PARAM_STATIC_NICK |
 							   G_PARAM_STATIC_BLURB));
 
+	g_object_class_install_property(object_class,
+					PROP_KERNELS,
+					g_param_spec_int("kernels",
+							 "Conversion kernels",
+							 "Which pixel conversion kernels may be used",
+							 VNC_BASE_FRAMEBUFFER_KERNELS_FASTEST,
+							 VNC_BASE_FRAMEBUFFER_KERNELS_GENERIC,
+							 VNC_BASE_FRAMEBUFFER_KERNELS_FASTEST,
+							 G_PARAM_READABLE |
+							 G_PARAM_WRITABLE |
+							 G_PARAM_STATIC_NAME |
+							 G_PARAM_STATIC_NICK |
+							 G_PARAM_STATIC_BLURB));
+
 	g_type_class_add_private(klass, sizeof(VncBaseFramebufferPrivate));
 }
 
@@ -504,6 +544,37 @@ static guint32 vnc_base_framebuffer_swap_rfb_64(VncBaseFramebufferPrivate *priv,
 		return pixel;
 }
 
+/*
+ * Channel shift and width of the common layouts, red then green
+ * then blue, used by the fixed layout kernels
+ */
+#define VNC_BASE_FRAMEBUFFER_LAYOUT_rgb888(f) f(16, 8, 8, 8, 0, 8)
+#define VNC_BASE_FRAMEBUFFER_LAYOUT_bgr888(f) f(0, 8, 8, 8, 16, 8)
+#define VNC_BASE_FRAMEBUFFER_LAYOUT_rgb565(f) f(11, 5, 5, 6, 0, 5)
+#define VNC_BASE_FRAMEBUFFER_LAYOUT_rgb555(f) f(10, 5, 5, 5, 0, 5)
+#define VNC_BASE_FRAMEBUFFER_LAYOUT_bgr233(f) f(0, 3, 3, 3, 6, 2)
+
+#define VNC_BASE_FRAMEBUFFER_RED_SHIFT(rs, rb, gs, gb, bs, bb) rs
+#define VNC_BASE_FRAMEBUFFER_RED_BITS(rs, rb, gs, gb, bs, bb) rb
+#define VNC_BASE_FRAMEBUFFER_GREEN_SHIFT(rs, rb, gs, gb, bs, bb) gs
+#define VNC_BASE_FRAMEBUFFER_GREEN_BITS(rs, rb, gs, gb, bs, bb) gb
+#define VNC_BASE_FRAMEBUFFER_BLUE_SHIFT(rs, rb, gs, gb, bs, bb) bs
+#define VNC_BASE_FRAMEBUFFER_BLUE_BITS(rs, rb, gs, gb, bs, bb) bb
+#define VNC_BASE_FRAMEBUFFER_LAYOUT_DATA(rs, rb, gs, gb, bs, bb) { rs, gs, bs }, { rb, gb, bb }
+
+/* The two 32 bpp layouts come first, as the only remote ones */
+static const struct {
+	guint8 bits_per_pixel;
+	guint8 shift[3];
+	guint8 bits[3];
+} vnc_base_framebuffer_layouts[] = {
+	{ 32, VNC_BASE_FRAMEBUFFER_LAYOUT_rgb888(VNC_BASE_FRAMEBUFFER_LAYOUT_DATA) },
+	{ 32, VNC_BASE_FRAMEBUFFER_LAYOUT_bgr888(VNC_BASE_FRAMEBUFFER_LAYOUT_DATA) },
+	{ 16, VNC_BASE_FRAMEBUFFER_LAYOUT_rgb565(VNC_BASE_FRAMEBUFFER_LAYOUT_DATA) },
+	{ 16, VNC_BASE_FRAMEBUFFER_LAYOUT_rgb555(VNC_BASE_FRAMEBUFFER_LAYOUT_DATA) },
+	{ 8, VNC_BASE_FRAMEBUFFER_LAYOUT_bgr233(VNC_BASE_FRAMEBUFFER_LAYOUT_DATA) },
+};
+
 #define SRC 8
 #define DST 8
 #include "vncbaseframebufferblt.h"
@@ -659,6 +730,215 @@ static guint32 vnc_base_framebuffer_swap_rfb_64(VncBaseFramebufferPrivate *priv,
 #undef DST
 #undef COLORMAP
 
+
+#define SRC 32
+#define DST 32
+#define SRC_LAYOUT rgb888
+#define DST_LAYOUT rgb888
+#include "vncbaseframebufferblt.h"
+#undef SRC
+#undef DST
+#undef SRC_LAYOUT
+#undef DST_LAYOUT
+
+#define SRC 32
+#define DST 32
+#define SRC_LAYOUT rgb888
+#define DST_LAYOUT bgr888
+#include "vncbaseframebufferblt.h"
+#undef SRC
+#undef DST
+#undef SRC_LAYOUT
+#undef DST_LAYOUT
+
+#define SRC 32
+#define DST 16
+#define SRC_LAYOUT rgb888
+#define DST_LAYOUT rgb565
+#include "vncbaseframebufferblt.h"
+#undef SRC
+#undef DST
+#undef SRC_LAYOUT
+#undef DST_LAYOUT
+
+#define SRC 32
+#define DST 16
+#define SRC_LAYOUT rgb888
+#define DST_LAYOUT rgb555
+#include "vncbaseframebufferblt.h"
+#undef SRC
+#undef DST
+#undef SRC_LAYOUT
+#undef DST_LAYOUT
+
+#define SRC 32
+#define DST 8
+#define SRC_LAYOUT rgb888
+#define DST_LAYOUT bgr233
+#include "vncbaseframebufferblt.h"
+#undef SRC
+#undef DST
+#undef SRC_LAYOUT
+#undef DST_LAYOUT
+
+
+#define SRC 32
+#define DST 32
+#define SRC_LAYOUT bgr888
+#define DST_LAYOUT rgb888
+#include "vncbaseframebufferblt.h"
+#undef SRC
+#undef DST
+#undef SRC_LAYOUT
+#undef DST_LAYOUT
+
+#define SRC 32
+#define DST 32
+#define SRC_LAYOUT bgr888
+#define DST_LAYOUT bgr888
+#include "vncbaseframebufferblt.h"
+#undef SRC
+#undef DST
+#undef SRC_LAYOUT
+#undef DST_LAYOUT
+
+#define SRC 32
+#define DST 16
+#define SRC_LAYOUT bgr888
+#define DST_LAYOUT rgb565
+#include "vncbaseframebufferblt.h"
+#undef SRC
+#undef DST
+#undef SRC_LAYOUT
+#undef DST_LAYOUT
+
+#define SRC 32
+#define DST 16
+#define SRC_LAYOUT bgr888
+#define DST_LAYOUT rgb555
+#include "vncbaseframebufferblt.h"
+#undef SRC
+#undef DST
+#undef SRC_LAYOUT
+#undef DST_LAYOUT
+
+#define SRC 32
+#define DST 8
+#define SRC_LAYOUT bgr888
+#define DST_LAYOUT bgr233
+#include "vncbaseframebufferblt.h"
+#undef SRC
+#undef DST
+#undef SRC_LAYOUT
+#undef DST_LAYOUT
+
+
+#define SWAPPED
+#define SRC 32
+#define DST 32
+#define SRC_LAYOUT rgb888
+#define DST_LAYOUT rgb888
+#include "vncbaseframebufferblt.h"
+#undef SRC
+#undef DST
+#undef SRC_LAYOUT
+#undef DST_LAYOUT
+
+#define SRC 32
+#define DST 32
+#define SRC_LAYOUT rgb888
+#define DST_LAYOUT bgr888
+#include "vncbaseframebufferblt.h"
+#undef SRC
+#undef DST
+#undef SRC_LAYOUT
+#undef DST_LAYOUT
+
+#define SRC 32
+#define DST 16
+#define SRC_LAYOUT rgb888
+#define DST_LAYOUT rgb565
+#include "vncbaseframebufferblt.h"
+#undef SRC
+#undef DST
+#undef SRC_LAYOUT
+#undef DST_LAYOUT
+
+#define SRC 32
+#define DST 16
+#define SRC_LAYOUT rgb888
+#define DST_LAYOUT rgb555
+#include "vncbaseframebufferblt.h"
+#undef SRC
+#undef DST
+#undef SRC_LAYOUT
+#undef DST_LAYOUT
+
+#define SRC 32
+#define DST 8
+#define SRC_LAYOUT rgb888
+#define DST_LAYOUT bgr233
+#include "vncbaseframebufferblt.h"
+#undef SRC
+#undef DST
+#undef SRC_LAYOUT
+#undef DST_LAYOUT
+#undef SWAPPED
+
+
+#define SWAPPED
+#define SRC 32
+#define DST 32
+#define SRC_LAYOUT bgr888
+#define DST_LAYOUT rgb888
+#include "vncbaseframebufferblt.h"
+#undef SRC
+#undef DST
+#undef SRC_LAYOUT
+#undef DST_LAYOUT
+
+#define SRC 32
+#define DST 32
+#define SRC_LAYOUT bgr888
+#define DST_LAYOUT bgr888
+#include "vncbaseframebufferblt.h"
+#undef SRC
+#undef DST
+#undef SRC_LAYOUT
+#undef DST_LAYOUT
+
+#define SRC 32
+#define DST 16
+#define SRC_LAYOUT bgr888
+#define DST_LAYOUT rgb565
+#include "vncbaseframebufferblt.h"
+#undef SRC
+#undef DST
+#undef SRC_LAYOUT
+#undef DST_LAYOUT
+
+#define SRC 32
+#define DST 16
+#define SRC_LAYOUT bgr888
+#define DST_LAYOUT rgb555
+#include "vncbaseframebufferblt.h"
+#undef SRC
+#undef DST
+#undef SRC_LAYOUT
+#undef DST_LAYOUT
+
+#define SRC 32
+#define DST 8
+#define SRC_LAYOUT bgr888
+#define DST_LAYOUT bgr233
+#include "vncbaseframebufferblt.h"
+#undef SRC
+#undef DST
+#undef SRC_LAYOUT
+#undef DST_LAYOUT
+#undef SWAPPED
+
+
 static vnc_base_framebuffer_set_pixel_at_func *vnc_base_framebuffer_set_pixel_at_table[6][4] = {
         { (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_set_pixel_at_8x8,
           (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_set_pixel_at_8x16,
@@ -720,6 +1000,13 @@ static vnc_base_framebuffer_fill_func *vnc_base_framebuffer_fill_fast_table[4] =
 	(vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_fill_fast_64x64,
 };
 
+static vnc_base_framebuffer_expand_func *vnc_base_framebuffer_expand_table[4] = {
+	vnc_base_framebuffer_expand_8x8,
+	vnc_base_framebuffer_expand_16x16,
+	vnc_base_framebuffer_expand_32x32,
+	vnc_base_framebuffer_expand_64x64,
+};
+
 static vnc_base_framebuffer_blt_func *vnc_base_framebuffer_blt_table[6][4] = {
         {  vnc_base_framebuffer_blt_8x8,
 	   vnc_base_framebuffer_blt_8x16,
@@ -754,6 +1041,142 @@ static vnc_base_framebuffer_rgb24_blt_func *vnc_base_framebuffer_rgb24_blt_table
         (vnc_base_framebuffer_rgb24_blt_func *)vnc_base_framebuffer_rgb24_blt_32x64,
 };
 
+static vnc_base_framebuffer_build_lut_func *vnc_base_framebuffer_build_lut_table[4][4] = {
+        { vnc_base_framebuffer_build_lut_8x8,
+          vnc_base_framebuffer_build_lut_8x16,
+          vnc_base_framebuffer_build_lut_8x32,
+          vnc_base_framebuffer_build_lut_8x64 },
+        { vnc_base_framebuffer_build_lut_16x8,
+          vnc_base_framebuffer_build_lut_16x16,
+          vnc_base_framebuffer_build_lut_16x32,
+          vnc_base_framebuffer_build_lut_16x64 },
+        { vnc_base_framebuffer_build_lut_cmap8x8,
+          vnc_base_framebuffer_build_lut_cmap8x16,
+          vnc_base_framebuffer_build_lut_cmap8x32,
+          vnc_base_framebuffer_build_lut_cmap8x64 },
+        { vnc_base_framebuffer_build_lut_cmap16x8,
+          vnc_base_framebuffer_build_lut_cmap16x16,
+          vnc_base_framebuffer_build_lut_cmap16x32,
+          vnc_base_framebuffer_build_lut_cmap16x64 },
+};
+
+static vnc_base_framebuffer_set_pixel_at_func *vnc_base_framebuffer_lut_set_pixel_at_table[2][4] = {
+        { (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_lut_set_pixel_at_8x8,
+          (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_lut_set_pixel_at_8x16,
+          (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_lut_set_pixel_at_8x32,
+          (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_lut_set_pixel_at_8x64 },
+        { (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_lut_set_pixel_at_16x8,
+          (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_lut_set_pixel_at_16x16,
+          (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_lut_set_pixel_at_16x32,
+          (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_lut_set_pixel_at_16x64 },
+};
+
+static vnc_base_framebuffer_fill_func *vnc_base_framebuffer_lut_fill_table[2][4] = {
+        { (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_lut_fill_8x8,
+          (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_lut_fill_8x16,
+          (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_lut_fill_8x32,
+          (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_lut_fill_8x64 },
+        { (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_lut_fill_16x8,
+          (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_lut_fill_16x16,
+          (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_lut_fill_16x32,
+          (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_lut_fill_16x64 },
+};
+
+static vnc_base_framebuffer_blt_func *vnc_base_framebuffer_lut_blt_table[2][4] = {
+        { vnc_base_framebuffer_lut_blt_8x8,
+          vnc_base_framebuffer_lut_blt_8x16,
+          vnc_base_framebuffer_lut_blt_8x32,
+          vnc_base_framebuffer_lut_blt_8x64 },
+        { vnc_base_framebuffer_lut_blt_16x8,
+          vnc_base_framebuffer_lut_blt_16x16,
+          vnc_base_framebuffer_lut_blt_16x32,
+          vnc_base_framebuffer_lut_blt_16x64 },
+};
+
+static vnc_base_framebuffer_set_pixel_at_func *vnc_base_framebuffer_fixed_set_pixel_at_table[4][5] = {
+        { (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_set_pixel_at_rgb888xrgb888,
+          (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_set_pixel_at_rgb888xbgr888,
+          (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_set_pixel_at_rgb888xrgb565,
+          (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_set_pixel_at_rgb888xrgb555,
+          (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_set_pixel_at_rgb888xbgr233 },
+        { (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_set_pixel_at_bgr888xrgb888,
+          (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_set_pixel_at_bgr888xbgr888,
+          (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_set_pixel_at_bgr888xrgb565,
+          (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_set_pixel_at_bgr888xrgb555,
+          (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_set_pixel_at_bgr888xbgr233 },
+        { (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_set_pixel_at_rgb888swapxrgb888,
+          (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_set_pixel_at_rgb888swapxbgr888,
+          (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_set_pixel_at_rgb888swapxrgb565,
+          (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_set_pixel_at_rgb888swapxrgb555,
+          (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_set_pixel_at_rgb888swapxbgr233 },
+        { (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_set_pixel_at_bgr888swapxrgb888,
+          (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_set_pixel_at_bgr888swapxbgr888,
+          (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_set_pixel_at_bgr888swapxrgb565,
+          (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_set_pixel_at_bgr888swapxrgb555,
+          (vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_set_pixel_at_bgr888swapxbgr233 },
+};
+
+static vnc_base_framebuffer_fill_func *vnc_base_framebuffer_fixed_fill_table[4][5] = {
+        { (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_fill_rgb888xrgb888,
+          (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_fill_rgb888xbgr888,
+          (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_fill_rgb888xrgb565,
+          (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_fill_rgb888xrgb555,
+          (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_fill_rgb888xbgr233 },
+        { (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_fill_bgr888xrgb888,
+          (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_fill_bgr888xbgr888,
+          (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_fill_bgr888xrgb565,
+          (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_fill_bgr888xrgb555,
+          (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_fill_bgr888xbgr233 },
+        { (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_fill_rgb888swapxrgb888,
+          (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_fill_rgb888swapxbgr888,
+          (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_fill_rgb888swapxrgb565,
+          (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_fill_rgb888swapxrgb555,
+          (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_fill_rgb888swapxbgr233 },
+        { (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_fill_bgr888swapxrgb888,
+          (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_fill_bgr888swapxbgr888,
+          (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_fill_bgr888swapxrgb565,
+          (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_fill_bgr888swapxrgb555,
+          (vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_fill_bgr888swapxbgr233 },
+};
+
+static vnc_base_framebuffer_blt_func *vnc_base_framebuffer_fixed_blt_table[4][5] = {
+        { vnc_base_framebuffer_blt_rgb888xrgb888,
+          vnc_base_framebuffer_blt_rgb888xbgr888,
+          vnc_base_framebuffer_blt_rgb888xrgb565,
+          vnc_base_framebuffer_blt_rgb888xrgb555,
+          vnc_base_framebuffer_blt_rgb888xbgr233 },
+        { vnc_base_framebuffer_blt_bgr888xrgb888,
+          vnc_base_framebuffer_blt_bgr888xbgr888,
+          vnc_base_framebuffer_blt_bgr888xrgb565,
+          vnc_base_framebuffer_blt_bgr888xrgb555,
+          vnc_base_framebuffer_blt_bgr888xbgr233 },
+        { vnc_base_framebuffer_blt_rgb888swapxrgb888,
+          vnc_base_framebuffer_blt_rgb888swapxbgr888,
+          vnc_base_framebuffer_blt_rgb888swapxrgb565,
+          vnc_base_framebuffer_blt_rgb888swapxrgb555,
+          vnc_base_framebuffer_blt_rgb888swapxbgr233 },
+        { vnc_base_framebuffer_blt_bgr888swapxrgb888,
+          vnc_base_framebuffer_blt_bgr888swapxbgr888,
+          vnc_base_framebuffer_blt_bgr888swapxrgb565,
+          vnc_base_framebuffer_blt_bgr888swapxrgb555,
+          vnc_base_framebuffer_blt_bgr888swapxbgr233 },
+};
+
+static vnc_base_framebuffer_set_pixel_at_func *vnc_base_framebuffer_swap_set_pixel_at_table[2] = {
+	(vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_swap_set_pixel_at_16x16,
+	(vnc_base_framebuffer_set_pixel_at_func *)vnc_base_framebuffer_swap_set_pixel_at_32x32,
+};
+
+static vnc_base_framebuffer_fill_func *vnc_base_framebuffer_swap_fill_table[2] = {
+	(vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_swap_fill_16x16,
+	(vnc_base_framebuffer_fill_func *)vnc_base_framebuffer_swap_fill_32x32,
+};
+
+static vnc_base_framebuffer_blt_func *vnc_base_framebuffer_swap_blt_table[2] = {
+	vnc_base_framebuffer_swap_blt_16x16,
+	vnc_base_framebuffer_swap_blt_32x32,
+};
+
 
 /* a fast blit for the perfect match scenario */
 static void vnc_base_framebuffer_blt_fast(VncBaseFramebufferPrivate *priv,
@@ -770,12 +1193,39 @@ static void vnc_base_framebuffer_blt_fast(VncBaseFramebufferPrivate *priv,
         }
 }
 
+#include "vncbaseframebuffersimd.h"
+
+
+/* Index of the common layout matching fmt, or -1 */
+static int vnc_base_framebuffer_find_layout(const VncPixelFormat *fmt)
+{
+	guint16 max[3] = { fmt->red_max, fmt->green_max, fmt->blue_max };
+	guint8 shift[3] = { fmt->red_shift, fmt->green_shift, fmt->blue_shift };
+	int n, c;
+
+	for (n = 0; n < (int)G_N_ELEMENTS(vnc_base_framebuffer_layouts); n++) {
+		if (fmt->bits_per_pixel != vnc_base_framebuffer_layouts[n].bits_per_pixel)
+			continue;
+		for (c = 0; c < 3; c++) {
+			if (shift[c] != vnc_base_framebuffer_layouts[n].shift[c] ||
+			    max[c] != (1 << vnc_base_framebuffer_layouts[n].bits[c]) - 1)
+				break;
+		}
+		if (c == 3)
+			return n;
+	}
+
+	return -1;
+}
+
 
 static void vnc_base_framebuffer_reinit_render_funcs(VncBaseFramebuffer *fb)
 {
 	VncBaseFramebufferPrivate *priv = fb->priv;
 	int i, j, n;
 	int depth;
+	gboolean identical;
+	int src_layout, dst_layout;
 
 	if (!priv->reinitRenderFuncs)
 		return;
@@ -790,14 +1240,17 @@ static void vnc_base_framebuffer_reinit_render_funcs(VncBaseFramebuffer *fb)
 		priv->remoteFormat->byte_order = G_BYTE_ORDER;
 	}
 
-	if (priv->remoteFormat->true_color_flag &&
-	    priv->localFormat->bits_per_pixel == priv->remoteFormat->bits_per_pixel &&
-	    priv->localFormat->red_max == priv->remoteFormat->red_max &&
-	    priv->localFormat->green_max == priv->remoteFormat->green_max &&
-	    priv->localFormat->blue_max == priv->remoteFormat->blue_max &&
-	    priv->localFormat->red_shift == priv->remoteFormat->red_shift &&
-	    priv->localFormat->green_shift == priv->remoteFormat->green_shift &&
-	    priv->localFormat->blue_shift == priv->remoteFormat->blue_shift &&
+	/* The same pixels on both sides, bar perhaps the byte order */
+	identical = priv->remoteFormat->true_color_flag &&
+		priv->localFormat->bits_per_pixel == priv->remoteFormat->bits_per_pixel &&
+		priv->localFormat->red_max == priv->remoteFormat->red_max &&
+		priv->localFormat->green_max == priv->remoteFormat->green_max &&
+		priv->localFormat->blue_max == priv->remoteFormat->blue_max &&
+		priv->localFormat->red_shift == priv->remoteFormat->red_shift &&
+		priv->localFormat->green_shift == priv->remoteFormat->green_shift &&
+		priv->localFormat->blue_shift == priv->remoteFormat->blue_shift;
+
+	if (identical &&
 	    priv->localFormat->byte_order == G_BYTE_ORDER &&
 	    priv->remoteFormat->byte_order == G_BYTE_ORDER)
 		priv->perfect_match = TRUE;
@@ -863,19 +1316,85 @@ static void vnc_base_framebuffer_reinit_render_funcs(VncBaseFramebuffer *fb)
 		VNC_DEBUG("BPP i %d %d", priv->remoteFormat->bits_per_pixel, i);
 	}
 
-	priv->set_pixel_at = vnc_base_framebuffer_set_pixel_at_table[i - 1][j - 1];
-
-	if (priv->perfect_match)
+	/*
+	 * With 8 or 16 bpp remote pixels there are few enough of
+	 * them to convert each one once, here, and then just look
+	 * them up while drawing. A colour map has to have arrived
+	 * first, and we are called again whenever it changes.
+	 */
+	g_free(priv->lut);
+	priv->lut = NULL;
+	if (priv->kernels == VNC_BASE_FRAMEBUFFER_KERNELS_GENERIC) {
+		/* Including the copies perfect matches always had */
+		priv->set_pixel_at = vnc_base_framebuffer_set_pixel_at_table[i - 1][j - 1];
+		if (priv->perfect_match) {
+			priv->fill = vnc_base_framebuffer_fill_fast_table[i - 1];
+			priv->blt = vnc_base_framebuffer_blt_fast;
+		} else {
+			priv->fill = vnc_base_framebuffer_fill_table[i - 1][j - 1];
+			priv->blt = vnc_base_framebuffer_blt_table[i - 1][j - 1];
+		}
+	} else if (!identical &&
+	    (i == 1 || i == 2 || i == 5 || i == 6) &&
+	    (priv->remoteFormat->true_color_flag || priv->colorMap)) {
+		int k = (i == 1 || i == 5) ? 0 : 1;
+
+		priv->lut = g_malloc((k ? 65536 : 256) * (1 << (j - 1)));
+		vnc_base_framebuffer_build_lut_table[i < 5 ? k : k + 2][j - 1](priv);
+
+		priv->set_pixel_at = vnc_base_framebuffer_lut_set_pixel_at_table[k][j - 1];
+		priv->fill = vnc_base_framebuffer_lut_fill_table[k][j - 1];
+		if (!(priv->blt = vnc_base_framebuffer_simd_blt(priv)))
+			priv->blt = vnc_base_framebuffer_lut_blt_table[k][j - 1];
+	} else if (identical &&
+		   (i == 1 || priv->remoteFormat->byte_order == priv->localFormat->byte_order) &&
+		   (priv->perfect_match || !priv->alpha_mask)) {
+		/* Copying would leave out the alpha byte the generic
+		 * kernels set, which only perfect matches have always
+		 * done without */
+		priv->set_pixel_at = vnc_base_framebuffer_set_pixel_at_table[i - 1][j - 1];
 		priv->fill = vnc_base_framebuffer_fill_fast_table[i - 1];
-	else
-		priv->fill = vnc_base_framebuffer_fill_table[i - 1][j - 1];
-
-	if (priv->perfect_match)
 		priv->blt = vnc_base_framebuffer_blt_fast;
-	else
-		priv->blt = vnc_base_framebuffer_blt_table[i - 1][j - 1];
+	} else if (identical && (i == 2 || i == 3) &&
+		   priv->remoteFormat->byte_order != priv->localFormat->byte_order) {
+		priv->set_pixel_at = vnc_base_framebuffer_swap_set_pixel_at_table[i - 2];
+		priv->fill = vnc_base_framebuffer_swap_fill_table[i - 2];
+		priv->blt = vnc_base_framebuffer_swap_blt_table[i - 2];
+	} else {
+		/*
+		 * A 32 bpp server in either byte order drawing into one
+		 * of the common local layouts gets kernels with all the
+		 * shifts and swaps compiled in
+		 */
+		src_layout = dst_layout = -1;
+		if (priv->remoteFormat->true_color_flag &&
+		    (priv->localFormat->bits_per_pixel == 8 ||
+		     priv->localFormat->byte_order == G_BYTE_ORDER)) {
+			src_layout = vnc_base_framebuffer_find_layout(priv->remoteFormat);
+			dst_layout = vnc_base_framebuffer_find_layout(priv->localFormat);
+		}
+
+		if (src_layout >= 0 && src_layout < 2 && dst_layout >= 0) {
+			n = src_layout + (priv->remoteFormat->byte_order != G_BYTE_ORDER ? 2 : 0);
+			VNC_DEBUG("Using fixed layout kernels %d %d", n, dst_layout);
+			priv->set_pixel_at = vnc_base_framebuffer_fixed_set_pixel_at_table[n][dst_layout];
+			priv->fill = vnc_base_framebuffer_fixed_fill_table[n][dst_layout];
+			if (!(priv->blt = vnc_base_framebuffer_simd_blt(priv)))
+				priv->blt = vnc_base_framebuffer_fixed_blt_table[n][dst_layout];
+		} else {
+			priv->set_pixel_at = vnc_base_framebuffer_set_pixel_at_table[i - 1][j - 1];
+			priv->fill = vnc_base_framebuffer_fill_table[i - 1][j - 1];
+			if (!(priv->blt = vnc_base_framebuffer_simd_blt(priv)))
+				priv->blt = vnc_base_framebuffer_blt_table[i - 1][j - 1];
+		}
+	}
 
-	priv->rgb24_blt = vnc_base_framebuffer_rgb24_blt_table[i - 1];
+	priv->rgb24_blt = vnc_base_framebuffer_rgb24_blt_table[j - 1];
+
+	for (n = 0; n < 4; n++) {
+		if (!(priv->expand[n] = vnc_base_framebuffer_simd_expand(priv, 1 << n)))
+			priv->expand[n] = vnc_base_framebuffer_expand_table[j - 1];
+	}
 
 	priv->reinitRenderFuncs = FALSE;
 }
@@ -967,6 +1486,56 @@ static void vnc_base_framebuffer_rgb24_blt(VncFramebuffer *iface,
 }
 
 
+/*
+ * Converts the palette to local pixels once, by pointing the
+ * normal blt at it instead of the framebuffer, then expands
+ * the indexes straight into the framebuffer a row at a time
+ */
+static void vnc_base_framebuffer_blt_indexed(VncFramebuffer *iface,
+					     guint8 *palette,
+					     int palette_size,
+					     guint8 *indexes,
+					     int bits,
+					     int rowstride,
+					     guint16 x, guint16 y,
+					     guint16 width, guint16 height)
+{
+	VncBaseFramebuffer *fb = VNC_BASE_FRAMEBUFFER(iface);
+	VncBaseFramebufferPrivate *priv = fb->priv;
+	guint32 remote[256];
+	guint64 local[256];
+	int bpp = priv->remoteFormat->bits_per_pixel / 8;
+	int lbpp = priv->localFormat->bits_per_pixel / 8;
+	vnc_base_framebuffer_expand_func *expand;
+	guint8 *buffer, *dst;
+	int i;
+
+	vnc_base_framebuffer_reinit_render_funcs(fb);
+
+	palette_size = MIN(palette_size, 1 << bits);
+	for (i = 0; i < palette_size; i++)
+		memcpy((guint8 *)remote + (i * bpp), palette + (i * 4), bpp);
+
+	buffer = priv->buffer;
+	priv->buffer = (guint8 *)local;
+	priv->blt(priv, (guint8 *)remote, palette_size * bpp, 0, 0, palette_size, 1);
+	priv->buffer = buffer;
+
+	/* Indexes past the end of the palette are the server's
+	 * bug, but must not read uninitialized memory */
+	memset((guint8 *)local + (palette_size * lbpp), 0,
+	       ((1 << bits) - palette_size) * lbpp);
+
+	expand = priv->expand[g_bit_storage(bits) - 1];
+	dst = VNC_BASE_FRAMEBUFFER_AT(priv, x, y);
+	for (i = 0; i < height; i++) {
+		expand(dst, indexes, bits, (guint8 *)local, width);
+		dst += priv->rowstride;
+		indexes += rowstride;
+	}
+}
+
+
 static void vnc_base_framebuffer_set_color_map(VncFramebuffer *iface,
 					       VncColorMap *map)
 {
@@ -976,6 +1545,7 @@ static void vnc_base_framebuffer_set_color_map(VncFramebuffer *iface,
 	if (priv->colorMap)
 		vnc_color_map_free(priv->colorMap);
 	priv->colorMap = vnc_color_map_copy(map);
+	priv->reinitRenderFuncs = TRUE;
 }
 
 
@@ -998,6 +1568,7 @@ static void vnc_base_framebuffer_interface_init(gpointer g_iface,
     iface->blt = vnc_base_framebuffer_blt;
     iface->rgb24_blt = vnc_base_framebuffer_rgb24_blt;
     iface->set_color_map = vnc_base_framebuffer_set_color_map;
+    iface->blt_indexed = vnc_base_framebuffer_blt_indexed;
 }
 
 /*
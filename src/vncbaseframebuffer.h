@@ -62,6 +62,17 @@ struct _VncBaseFramebufferClass
 };
 
 
+/*
+ * Which conversion kernels the "kernels" property allows. The
+ * others are all meant to match the generic ones byte for byte,
+ * which limiting the choice allows to be checked.
+ */
+typedef enum {
+	VNC_BASE_FRAMEBUFFER_KERNELS_FASTEST,  /* The fastest this CPU can run */
+	VNC_BASE_FRAMEBUFFER_KERNELS_PORTABLE, /* No SIMD, but lookup tables and fixed layouts */
+	VNC_BASE_FRAMEBUFFER_KERNELS_GENERIC,  /* Just the generic conversions */
+} VncBaseFramebufferKernels;
+
 GType vnc_base_framebuffer_get_type(void) G_GNUC_CONST;
 
 VncBaseFramebuffer *vnc_base_framebuffer_new(guint8 *buffer,
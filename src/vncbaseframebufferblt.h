@@ -27,7 +27,11 @@
 
 #define SPLICE_I(a, b) a ## b
 #define SPLICE(a, b) SPLICE_I(a, b)
-#ifdef COLORMAP
+#if defined(SRC_LAYOUT) && defined(SWAPPED)
+#define SUFFIX() SPLICE(SRC_LAYOUT,SPLICE(swapx,DST_LAYOUT))
+#elif defined(SRC_LAYOUT)
+#define SUFFIX() SPLICE(SRC_LAYOUT,SPLICE(x,DST_LAYOUT))
+#elif defined(COLORMAP)
 #define SUFFIX() SPLICE(cmap,SPLICE(SRC,SPLICE(x,DST)))
 #else
 #define SUFFIX() SPLICE(SRC,SPLICE(x,DST))
@@ -40,13 +44,100 @@
 #define SET_PIXEL SPLICE(vnc_base_framebuffer_set_pixel_, SUFFIX())
 #define SET_PIXEL_AT SPLICE(vnc_base_framebuffer_set_pixel_at_, SUFFIX())
 #define FAST_FILL SPLICE(vnc_base_framebuffer_fill_fast_, SUFFIX())
+#define EXPAND SPLICE(vnc_base_framebuffer_expand_, SUFFIX())
 #define FILL SPLICE(vnc_base_framebuffer_fill_, SUFFIX())
 #define BLT SPLICE(vnc_base_framebuffer_blt_, SUFFIX())
 #define RGB24_BLT SPLICE(vnc_base_framebuffer_rgb24_blt_, SUFFIX())
+#define BUILD_LUT SPLICE(vnc_base_framebuffer_build_lut_, SUFFIX())
+#define LUT_SET_PIXEL_AT SPLICE(vnc_base_framebuffer_lut_set_pixel_at_, SUFFIX())
+#define LUT_FILL SPLICE(vnc_base_framebuffer_lut_fill_, SUFFIX())
+#define LUT_BLT SPLICE(vnc_base_framebuffer_lut_blt_, SUFFIX())
+#define SWAP_SET_PIXEL_AT SPLICE(vnc_base_framebuffer_swap_set_pixel_at_, SUFFIX())
+#define SWAP_FILL SPLICE(vnc_base_framebuffer_swap_fill_, SUFFIX())
+#define SWAP_BLT SPLICE(vnc_base_framebuffer_swap_blt_, SUFFIX())
+#define CONVERT SPLICE(vnc_base_framebuffer_convert_, SUFFIX())
+#define BSWAP(pixel) SPLICE(SPLICE(GUINT, SRC), _SWAP_LE_BE)(pixel)
 
 #define SWAP_RFB(priv, pixel) SPLICE(vnc_base_framebuffer_swap_rfb_, SRC)(priv, pixel)
 #define SWAP_IMG(priv, pixel) SPLICE(vnc_base_framebuffer_swap_img_, DST)(priv, pixel)
 #define COMPONENT(color, pixel) ((SWAP_RFB(priv, pixel) >> priv->remoteFormat->SPLICE(color, _shift) & priv->remoteFormat->SPLICE(color, _max)))
+
+#define SRC_FIELD(field) SPLICE(VNC_BASE_FRAMEBUFFER_LAYOUT_, SRC_LAYOUT)(SPLICE(VNC_BASE_FRAMEBUFFER_, field))
+#define DST_FIELD(field) SPLICE(VNC_BASE_FRAMEBUFFER_LAYOUT_, DST_LAYOUT)(SPLICE(VNC_BASE_FRAMEBUFFER_, field))
+#define FIXED_BITS(color) MIN(SRC_FIELD(SPLICE(color, _BITS)), DST_FIELD(SPLICE(color, _BITS)))
+#define FIXED_MASK(color) ((1 << FIXED_BITS(color)) - 1)
+#define FIXED_RS(color) (SRC_FIELD(SPLICE(color, _SHIFT)) + SRC_FIELD(SPLICE(color, _BITS)) - FIXED_BITS(color))
+#define FIXED_LS(color) (DST_FIELD(SPLICE(color, _SHIFT)) + DST_FIELD(SPLICE(color, _BITS)) - FIXED_BITS(color))
+
+#ifdef SRC_LAYOUT
+/*
+ * Kernels for one pair of common channel layouts, where every
+ * shift, mask and the remote byte order are known at compile
+ * time. The local format is always in host byte order. These
+ * work out the same pixels as SET_PIXEL would.
+ */
+static inline dst_pixel_t CONVERT(dst_pixel_t alpha, src_pixel_t sp)
+{
+#ifdef SWAPPED
+	sp = BSWAP(sp);
+#endif
+	return alpha
+		| ((sp >> FIXED_RS(RED)) & FIXED_MASK(RED)) << FIXED_LS(RED)
+		| ((sp >> FIXED_RS(GREEN)) & FIXED_MASK(GREEN)) << FIXED_LS(GREEN)
+		| ((sp >> FIXED_RS(BLUE)) & FIXED_MASK(BLUE)) << FIXED_LS(BLUE);
+}
+
+static void SET_PIXEL_AT(VncBaseFramebufferPrivate *priv,
+			 src_pixel_t *sp,
+			 guint16 x, guint16 y)
+{
+	dst_pixel_t *dp = (dst_pixel_t *)VNC_BASE_FRAMEBUFFER_AT(priv, x, y);
+
+	*dp = CONVERT(priv->alpha_mask, *sp);
+}
+
+static void FILL(VncBaseFramebufferPrivate *priv,
+		 src_pixel_t *sp,
+		 guint16 x, guint16 y,
+		 guint16 width, guint16 height)
+{
+	guint8 *dst = VNC_BASE_FRAMEBUFFER_AT(priv, x, y);
+	dst_pixel_t *dp = (dst_pixel_t *)dst;
+	dst_pixel_t pixel = CONVERT(priv->alpha_mask, *sp);
+	int i;
+
+	for (i = 0; i < width; i++)
+		dp[i] = pixel;
+	dst += priv->rowstride;
+
+	for (i = 1; i < height; i++) {
+		memcpy(dst, dst - priv->rowstride, width * sizeof(dst_pixel_t));
+		dst += priv->rowstride;
+	}
+}
+
+static void BLT(VncBaseFramebufferPrivate *priv,
+		guint8 *src, int rowstride,
+		guint16 x, guint16 y,
+		guint16 width, guint16 height)
+{
+	guint8 *dst = VNC_BASE_FRAMEBUFFER_AT(priv, x, y);
+	dst_pixel_t alpha = priv->alpha_mask;
+	int i;
+
+	for (i = 0; i < height; i++) {
+		dst_pixel_t *dp = (dst_pixel_t *)dst;
+		const src_pixel_t *sp = (const src_pixel_t *)src;
+		int j;
+
+		for (j = 0; j < width; j++)
+			dp[j] = CONVERT(alpha, sp[j]);
+
+		dst += priv->rowstride;
+		src += rowstride;
+	}
+}
+#else
 #include <stdio.h>
 #ifdef COLORMAP
 static void SET_PIXEL(VncBaseFramebufferPrivate *priv,
@@ -111,6 +202,91 @@ static void FAST_FILL(VncBaseFramebufferPrivate *priv,
 		dst += priv->rowstride;
 	}
 }
+
+#if SRC > 8 && SRC < 64
+/*
+ * Identical formats apart from the byte order, so
+ * every pixel is just byte swapped
+ */
+static void SWAP_SET_PIXEL_AT(VncBaseFramebufferPrivate *priv,
+			      src_pixel_t *sp,
+			      guint16 x, guint16 y)
+{
+	dst_pixel_t *dp = (dst_pixel_t *)VNC_BASE_FRAMEBUFFER_AT(priv, x, y);
+
+	*dp = BSWAP(*sp) | SWAP_IMG(priv, priv->alpha_mask);
+}
+
+static void SWAP_FILL(VncBaseFramebufferPrivate *priv,
+		      src_pixel_t *sp,
+		      guint16 x, guint16 y,
+		      guint16 width, guint16 height)
+{
+	guint8 *dst = VNC_BASE_FRAMEBUFFER_AT(priv, x, y);
+	dst_pixel_t *dp = (dst_pixel_t *)dst;
+	dst_pixel_t pixel = BSWAP(*sp) | SWAP_IMG(priv, priv->alpha_mask);
+	int i;
+
+	for (i = 0; i < width; i++)
+		dp[i] = pixel;
+	dst += priv->rowstride;
+
+	for (i = 1; i < height; i++) {
+		memcpy(dst, dst - priv->rowstride, width * sizeof(dst_pixel_t));
+		dst += priv->rowstride;
+	}
+}
+
+static void SWAP_BLT(VncBaseFramebufferPrivate *priv,
+		     guint8 *src, int rowstride,
+		     guint16 x, guint16 y,
+		     guint16 width, guint16 height)
+{
+	guint8 *dst = VNC_BASE_FRAMEBUFFER_AT(priv, x, y);
+	dst_pixel_t alpha = SWAP_IMG(priv, priv->alpha_mask);
+	int i;
+
+	for (i = 0; i < height; i++) {
+		dst_pixel_t *dp = (dst_pixel_t *)dst;
+		const src_pixel_t *sp = (const src_pixel_t *)src;
+		int j;
+
+		for (j = 0; j < width; j++)
+			dp[j] = BSWAP(sp[j]) | alpha;
+
+		dst += priv->rowstride;
+		src += rowstride;
+	}
+}
+#endif
+
+/*
+ * Expand one row of packed palette indexes, most significant
+ * bits first, through a palette already in the local format
+ */
+static void EXPAND(guint8 *dst, const guint8 *indexes, int bits,
+		   const guint8 *palette, guint16 width)
+{
+	dst_pixel_t *dp = (dst_pixel_t *)dst;
+	const dst_pixel_t *pal = (const dst_pixel_t *)palette;
+	int i;
+
+	if (bits == 8) {
+		for (i = 0; i < width; i++)
+			dp[i] = pal[indexes[i]];
+		return;
+	}
+
+	for (i = 0; i < width; indexes++) {
+		guint8 ind = *indexes;
+		int k;
+
+		for (k = 0; k < 8 && i < width; k += bits, i++) {
+			dp[i] = pal[ind >> (8 - bits)];
+			ind <<= bits;
+		}
+	}
+}
 #endif
 #endif
 
@@ -195,13 +371,101 @@ static void RGB24_BLT(VncBaseFramebufferPrivate *priv,
 }
 #endif
 
+#if SRC <= 16
+/*
+ * Work out the local pixel for every possible remote pixel up
+ * front, indexed by the remote pixel exactly as it is on the wire
+ */
+static void BUILD_LUT(VncBaseFramebufferPrivate *priv)
+{
+	dst_pixel_t *lut = (dst_pixel_t *)priv->lut;
+	guint32 sp;
+
+	for (sp = 0; sp < (1 << SRC); sp++)
+		SET_PIXEL(priv, lut + sp, SWAP_RFB(priv, sp));
+}
+
+#ifndef COLORMAP
+/* A table is a table, so these serve colour maps too */
+static void LUT_SET_PIXEL_AT(VncBaseFramebufferPrivate *priv,
+			     src_pixel_t *sp,
+			     guint16 x, guint16 y)
+{
+	dst_pixel_t *dp = (dst_pixel_t *)VNC_BASE_FRAMEBUFFER_AT(priv, x, y);
+
+	*dp = ((dst_pixel_t *)priv->lut)[*sp];
+}
+
+static void LUT_FILL(VncBaseFramebufferPrivate *priv,
+		     src_pixel_t *sp,
+		     guint16 x, guint16 y,
+		     guint16 width, guint16 height)
+{
+	guint8 *dst = VNC_BASE_FRAMEBUFFER_AT(priv, x, y);
+	dst_pixel_t *dp = (dst_pixel_t *)dst;
+	dst_pixel_t pixel = ((dst_pixel_t *)priv->lut)[*sp];
+	int i;
+
+	for (i = 0; i < width; i++)
+		dp[i] = pixel;
+	dst += priv->rowstride;
+
+	for (i = 1; i < height; i++) {
+		memcpy(dst, dst - priv->rowstride, width * sizeof(dst_pixel_t));
+		dst += priv->rowstride;
+	}
+}
+
+static void LUT_BLT(VncBaseFramebufferPrivate *priv,
+		    guint8 *src, int rowstride,
+		    guint16 x, guint16 y,
+		    guint16 width, guint16 height)
+{
+	guint8 *dst = VNC_BASE_FRAMEBUFFER_AT(priv, x, y);
+	const dst_pixel_t *lut = (const dst_pixel_t *)priv->lut;
+	int i;
+
+	for (i = 0; i < height; i++) {
+		dst_pixel_t *dp = (dst_pixel_t *)dst;
+		src_pixel_t *sp = (src_pixel_t *)src;
+		int j;
+
+		for (j = 0; j < width; j++)
+			dp[j] = lut[sp[j]];
+
+		dst += priv->rowstride;
+		src += rowstride;
+	}
+}
+#endif
+#endif
+
+#endif /* SRC_LAYOUT */
+
+#undef FIXED_LS
+#undef FIXED_RS
+#undef FIXED_MASK
+#undef FIXED_BITS
+#undef DST_FIELD
+#undef SRC_FIELD
+
 #undef COMPONENT
 #undef SWAP_IMG
 #undef SWAP_RGB
 
+#undef BSWAP
+#undef CONVERT
+#undef SWAP_BLT
+#undef SWAP_FILL
+#undef SWAP_SET_PIXEL_AT
+#undef LUT_BLT
+#undef LUT_FILL
+#undef LUT_SET_PIXEL_AT
+#undef BUILD_LUT
 #undef RGB24_BLT
 #undef BLT
 #undef FILL
+#undef EXPAND
 #undef FAST_FILL
 #undef SET_PIXEL_AT
 #undef SET_PIXEL
@@ -0,0 +1,695 @@
+/*
+ * GTK VNC Widget
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Vectorized versions of the 8, 16 and 32 bpp -> 32 bpp BLT loops
+ * from vncbaseframebufferblt.h, for true colour remote formats.
+ *
+ * They do exactly the same shift & mask per channel as SET_PIXEL,
+ * just several pixels at a time, and hand any leftover pixels at the
+ * end of a row to the scalar SET_PIXEL. This file is only to be
+ * included by vncbaseframebuffer.c, after the blt templates.
+ *
+ * Also here are vectorized EXPANDs of 1 bit palette indexes, and of
+ * 8 bit ones where there is a gather instruction, for 32 bpp.
+ */
+
+#if defined(HAVE_X86_SIMD) && defined(HAVE_IMMINTRIN_H) &&	\
+	(defined(__i386__) || defined(__x86_64__))
+#define VNC_BASE_FRAMEBUFFER_SIMD_X86
+#include <immintrin.h>
+#endif
+
+#if defined(HAVE_ARM_NEON_H) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define VNC_BASE_FRAMEBUFFER_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+
+#ifdef VNC_BASE_FRAMEBUFFER_SIMD_X86
+
+#define VNC_SSE2 __attribute__((target("sse2")))
+#define VNC_AVX2 __attribute__((target("avx2")))
+
+typedef struct {
+	__m128i rrs, grs, brs;
+	__m128i rls, gls, bls;
+	__m128i rm, gm, bm;
+	__m128i alpha;
+} VncBaseFramebufferSSE2Conv;
+
+static VNC_SSE2 void vnc_base_framebuffer_sse2_conv_init(VncBaseFramebufferPrivate *priv,
+							 VncBaseFramebufferSSE2Conv *conv)
+{
+	conv->rrs = _mm_cvtsi32_si128(priv->rrs);
+	conv->grs = _mm_cvtsi32_si128(priv->grs);
+	conv->brs = _mm_cvtsi32_si128(priv->brs);
+	conv->rls = _mm_cvtsi32_si128(priv->rls);
+	conv->gls = _mm_cvtsi32_si128(priv->gls);
+	conv->bls = _mm_cvtsi32_si128(priv->bls);
+	conv->rm = _mm_set1_epi32(priv->rm);
+	conv->gm = _mm_set1_epi32(priv->gm);
+	conv->bm = _mm_set1_epi32(priv->bm);
+	conv->alpha = _mm_set1_epi32(priv->alpha_mask);
+}
+
+static inline VNC_SSE2 __m128i vnc_base_framebuffer_sse2_bswap16(__m128i v)
+{
+	return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+static inline VNC_SSE2 __m128i vnc_base_framebuffer_sse2_bswap32(__m128i v)
+{
+	v = vnc_base_framebuffer_sse2_bswap16(v);
+	return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xb1), 0xb1);
+}
+
+/* 4 native endian remote pixels, zero extended to 32 bits -> 4 local pixels */
+static inline VNC_SSE2 __m128i vnc_base_framebuffer_sse2_convert(const VncBaseFramebufferSSE2Conv *conv,
+								 __m128i sp,
+								 gboolean swap_img)
+{
+	__m128i dp = conv->alpha;
+
+	dp = _mm_or_si128(dp, _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(sp, conv->rrs), conv->rm), conv->rls));
+	dp = _mm_or_si128(dp, _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(sp, conv->grs), conv->gm), conv->gls));
+	dp = _mm_or_si128(dp, _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(sp, conv->brs), conv->bm), conv->bls));
+
+	return swap_img ? vnc_base_framebuffer_sse2_bswap32(dp) : dp;
+}
+
+static VNC_SSE2 void vnc_base_framebuffer_blt_32x32_sse2(VncBaseFramebufferPrivate *priv,
+							 guint8 *src, int rowstride,
+							 guint16 x, guint16 y,
+							 guint16 width, guint16 height)
+{
+	guint8 *dst = VNC_BASE_FRAMEBUFFER_AT(priv, x, y);
+	gboolean swap_rfb = priv->remoteFormat->byte_order != G_BYTE_ORDER;
+	gboolean swap_img = priv->localFormat->byte_order != G_BYTE_ORDER;
+	VncBaseFramebufferSSE2Conv conv;
+	int i;
+
+	vnc_base_framebuffer_sse2_conv_init(priv, &conv);
+
+	for (i = 0; i < height; i++) {
+		guint32 *dp = (guint32 *)dst;
+		guint32 *sp = (guint32 *)src;
+		int j;
+
+		for (j = 0; j + 4 <= width; j += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(sp + j));
+
+			if (swap_rfb)
+				v = vnc_base_framebuffer_sse2_bswap32(v);
+			_mm_storeu_si128((__m128i *)(dp + j),
+					 vnc_base_framebuffer_sse2_convert(&conv, v, swap_img));
+		}
+		for (; j < width; j++)
+			vnc_base_framebuffer_set_pixel_32x32(priv, dp + j,
+							     vnc_base_framebuffer_swap_rfb_32(priv, sp[j]));
+
+		dst += priv->rowstride;
+		src += rowstride;
+	}
+}
+
+static VNC_SSE2 void vnc_base_framebuffer_blt_16x32_sse2(VncBaseFramebufferPrivate *priv,
+							 guint8 *src, int rowstride,
+							 guint16 x, guint16 y,
+							 guint16 width, guint16 height)
+{
+	guint8 *dst = VNC_BASE_FRAMEBUFFER_AT(priv, x, y);
+	gboolean swap_rfb = priv->remoteFormat->byte_order != G_BYTE_ORDER;
+	gboolean swap_img = priv->localFormat->byte_order != G_BYTE_ORDER;
+	__m128i zero = _mm_setzero_si128();
+	VncBaseFramebufferSSE2Conv conv;
+	int i;
+
+	vnc_base_framebuffer_sse2_conv_init(priv, &conv);
+
+	for (i = 0; i < height; i++) {
+		guint32 *dp = (guint32 *)dst;
+		guint16 *sp = (guint16 *)src;
+		int j;
+
+		for (j = 0; j + 8 <= width; j += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(sp + j));
+
+			if (swap_rfb)
+				v = vnc_base_framebuffer_sse2_bswap16(v);
+			_mm_storeu_si128((__m128i *)(dp + j),
+					 vnc_base_framebuffer_sse2_convert(&conv, _mm_unpacklo_epi16(v, zero), swap_img));
+			_mm_storeu_si128((__m128i *)(dp + j + 4),
+					 vnc_base_framebuffer_sse2_convert(&conv, _mm_unpackhi_epi16(v, zero), swap_img));
+		}
+		for (; j < width; j++)
+			vnc_base_framebuffer_set_pixel_16x32(priv, dp + j,
+							     vnc_base_framebuffer_swap_rfb_16(priv, sp[j]));
+
+		dst += priv->rowstride;
+		src += rowstride;
+	}
+}
+
+static VNC_SSE2 void vnc_base_framebuffer_blt_8x32_sse2(VncBaseFramebufferPrivate *priv,
+							guint8 *src, int rowstride,
+							guint16 x, guint16 y,
+							guint16 width, guint16 height)
+{
+	guint8 *dst = VNC_BASE_FRAMEBUFFER_AT(priv, x, y);
+	gboolean swap_img = priv->localFormat->byte_order != G_BYTE_ORDER;
+	__m128i zero = _mm_setzero_si128();
+	VncBaseFramebufferSSE2Conv conv;
+	int i;
+
+	vnc_base_framebuffer_sse2_conv_init(priv, &conv);
+
+	for (i = 0; i < height; i++) {
+		guint32 *dp = (guint32 *)dst;
+		guint8 *sp = src;
+		int j;
+
+		for (j = 0; j + 16 <= width; j += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(sp + j));
+			__m128i lo = _mm_unpacklo_epi8(v, zero);
+			__m128i hi = _mm_unpackhi_epi8(v, zero);
+
+			_mm_storeu_si128((__m128i *)(dp + j),
+					 vnc_base_framebuffer_sse2_convert(&conv, _mm_unpacklo_epi16(lo, zero), swap_img));
+			_mm_storeu_si128((__m128i *)(dp + j + 4),
+					 vnc_base_framebuffer_sse2_convert(&conv, _mm_unpackhi_epi16(lo, zero), swap_img));
+			_mm_storeu_si128((__m128i *)(dp + j + 8),
+					 vnc_base_framebuffer_sse2_convert(&conv, _mm_unpacklo_epi16(hi, zero), swap_img));
+			_mm_storeu_si128((__m128i *)(dp + j + 12),
+					 vnc_base_framebuffer_sse2_convert(&conv, _mm_unpackhi_epi16(hi, zero), swap_img));
+		}
+		for (; j < width; j++)
+			vnc_base_framebuffer_set_pixel_8x32(priv, dp + j, sp[j]);
+
+		dst += priv->rowstride;
+		src += rowstride;
+	}
+}
+
+static VNC_SSE2 void vnc_base_framebuffer_expand_1x32_sse2(guint8 *dst,
+							   const guint8 *indexes,
+							   int bits G_GNUC_UNUSED,
+							   const guint8 *palette,
+							   guint16 width)
+{
+	guint32 *dp = (guint32 *)dst;
+	const guint32 *pal = (const guint32 *)palette;
+	__m128i bg = _mm_set1_epi32(pal[0]);
+	__m128i fg = _mm_set1_epi32(pal[1]);
+	__m128i hi = _mm_setr_epi32(0x80, 0x40, 0x20, 0x10);
+	__m128i lo = _mm_setr_epi32(0x08, 0x04, 0x02, 0x01);
+	int i;
+
+	for (i = 0; i + 8 <= width; i += 8) {
+		__m128i v = _mm_set1_epi32(indexes[i / 8]);
+		__m128i m;
+
+		m = _mm_cmpeq_epi32(_mm_and_si128(v, hi), hi);
+		_mm_storeu_si128((__m128i *)(dp + i),
+				 _mm_or_si128(_mm_and_si128(m, fg), _mm_andnot_si128(m, bg)));
+		m = _mm_cmpeq_epi32(_mm_and_si128(v, lo), lo);
+		_mm_storeu_si128((__m128i *)(dp + i + 4),
+				 _mm_or_si128(_mm_and_si128(m, fg), _mm_andnot_si128(m, bg)));
+	}
+	for (; i < width; i++)
+		dp[i] = pal[(indexes[i / 8] >> (7 - (i % 8))) & 1];
+}
+
+
+typedef struct {
+	__m128i rrs, grs, brs;
+	__m128i rls, gls, bls;
+	__m256i rm, gm, bm;
+	__m256i alpha;
+	__m256i bswap32;
+} VncBaseFramebufferAVX2Conv;
+
+static VNC_AVX2 void vnc_base_framebuffer_avx2_conv_init(VncBaseFramebufferPrivate *priv,
+							 VncBaseFramebufferAVX2Conv *conv)
+{
+	conv->rrs = _mm_cvtsi32_si128(priv->rrs);
+	conv->grs = _mm_cvtsi32_si128(priv->grs);
+	conv->brs = _mm_cvtsi32_si128(priv->brs);
+	conv->rls = _mm_cvtsi32_si128(priv->rls);
+	conv->gls = _mm_cvtsi32_si128(priv->gls);
+	conv->bls = _mm_cvtsi32_si128(priv->bls);
+	conv->rm = _mm256_set1_epi32(priv->rm);
+	conv->gm = _mm256_set1_epi32(priv->gm);
+	conv->bm = _mm256_set1_epi32(priv->bm);
+	conv->alpha = _mm256_set1_epi32(priv->alpha_mask);
+	conv->bswap32 = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+					 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+}
+
+/* 8 native endian remote pixels, zero extended to 32 bits -> 8 local pixels */
+static inline VNC_AVX2 __m256i vnc_base_framebuffer_avx2_convert(const VncBaseFramebufferAVX2Conv *conv,
+								 __m256i sp,
+								 gboolean swap_img)
+{
+	__m256i dp = conv->alpha;
+
+	dp = _mm256_or_si256(dp, _mm256_sll_epi32(_mm256_and_si256(_mm256_srl_epi32(sp, conv->rrs), conv->rm), conv->rls));
+	dp = _mm256_or_si256(dp, _mm256_sll_epi32(_mm256_and_si256(_mm256_srl_epi32(sp, conv->grs), conv->gm), conv->gls));
+	dp = _mm256_or_si256(dp, _mm256_sll_epi32(_mm256_and_si256(_mm256_srl_epi32(sp, conv->brs), conv->bm), conv->bls));
+
+	return swap_img ? _mm256_shuffle_epi8(dp, conv->bswap32) : dp;
+}
+
+static VNC_AVX2 void vnc_base_framebuffer_blt_32x32_avx2(VncBaseFramebufferPrivate *priv,
+							 guint8 *src, int rowstride,
+							 guint16 x, guint16 y,
+							 guint16 width, guint16 height)
+{
+	guint8 *dst = VNC_BASE_FRAMEBUFFER_AT(priv, x, y);
+	gboolean swap_rfb = priv->remoteFormat->byte_order != G_BYTE_ORDER;
+	gboolean swap_img = priv->localFormat->byte_order != G_BYTE_ORDER;
+	VncBaseFramebufferAVX2Conv conv;
+	int i;
+
+	vnc_base_framebuffer_avx2_conv_init(priv, &conv);
+
+	for (i = 0; i < height; i++) {
+		guint32 *dp = (guint32 *)dst;
+		guint32 *sp = (guint32 *)src;
+		int j;
+
+		for (j = 0; j + 8 <= width; j += 8) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)(sp + j));
+
+			if (swap_rfb)
+				v = _mm256_shuffle_epi8(v, conv.bswap32);
+			_mm256_storeu_si256((__m256i *)(dp + j),
+					    vnc_base_framebuffer_avx2_convert(&conv, v, swap_img));
+		}
+		for (; j < width; j++)
+			vnc_base_framebuffer_set_pixel_32x32(priv, dp + j,
+							     vnc_base_framebuffer_swap_rfb_32(priv, sp[j]));
+
+		dst += priv->rowstride;
+		src += rowstride;
+	}
+}
+
+static VNC_AVX2 void vnc_base_framebuffer_blt_16x32_avx2(VncBaseFramebufferPrivate *priv,
+							 guint8 *src, int rowstride,
+							 guint16 x, guint16 y,
+							 guint16 width, guint16 height)
+{
+	guint8 *dst = VNC_BASE_FRAMEBUFFER_AT(priv, x, y);
+	gboolean swap_rfb = priv->remoteFormat->byte_order != G_BYTE_ORDER;
+	gboolean swap_img = priv->localFormat->byte_order != G_BYTE_ORDER;
+	VncBaseFramebufferAVX2Conv conv;
+	int i;
+
+	vnc_base_framebuffer_avx2_conv_init(priv, &conv);
+
+	for (i = 0; i < height; i++) {
+		guint32 *dp = (guint32 *)dst;
+		guint16 *sp = (guint16 *)src;
+		int j;
+
+		for (j = 0; j + 8 <= width; j += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(sp + j));
+
+			if (swap_rfb)
+				v = vnc_base_framebuffer_sse2_bswap16(v);
+			_mm256_storeu_si256((__m256i *)(dp + j),
+					    vnc_base_framebuffer_avx2_convert(&conv, _mm256_cvtepu16_epi32(v), swap_img));
+		}
+		for (; j < width; j++)
+			vnc_base_framebuffer_set_pixel_16x32(priv, dp + j,
+							     vnc_base_framebuffer_swap_rfb_16(priv, sp[j]));
+
+		dst += priv->rowstride;
+		src += rowstride;
+	}
+}
+
+static VNC_AVX2 void vnc_base_framebuffer_blt_8x32_avx2(VncBaseFramebufferPrivate *priv,
+							guint8 *src, int rowstride,
+							guint16 x, guint16 y,
+							guint16 width, guint16 height)
+{
+	guint8 *dst = VNC_BASE_FRAMEBUFFER_AT(priv, x, y);
+	gboolean swap_img = priv->localFormat->byte_order != G_BYTE_ORDER;
+	VncBaseFramebufferAVX2Conv conv;
+	int i;
+
+	vnc_base_framebuffer_avx2_conv_init(priv, &conv);
+
+	for (i = 0; i < height; i++) {
+		guint32 *dp = (guint32 *)dst;
+		guint8 *sp = src;
+		int j;
+
+		for (j = 0; j + 8 <= width; j += 8) {
+			__m128i v = _mm_loadl_epi64((const __m128i *)(sp + j));
+
+			_mm256_storeu_si256((__m256i *)(dp + j),
+					    vnc_base_framebuffer_avx2_convert(&conv, _mm256_cvtepu8_epi32(v), swap_img));
+		}
+		for (; j < width; j++)
+			vnc_base_framebuffer_set_pixel_8x32(priv, dp + j, sp[j]);
+
+		dst += priv->rowstride;
+		src += rowstride;
+	}
+}
+
+static VNC_AVX2 void vnc_base_framebuffer_expand_1x32_avx2(guint8 *dst,
+							   const guint8 *indexes,
+							   int bits G_GNUC_UNUSED,
+							   const guint8 *palette,
+							   guint16 width)
+{
+	guint32 *dp = (guint32 *)dst;
+	const guint32 *pal = (const guint32 *)palette;
+	__m256i bg = _mm256_set1_epi32(pal[0]);
+	__m256i fg = _mm256_set1_epi32(pal[1]);
+	__m256i bit = _mm256_setr_epi32(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+	int i;
+
+	for (i = 0; i + 8 <= width; i += 8) {
+		__m256i v = _mm256_set1_epi32(indexes[i / 8]);
+		__m256i m = _mm256_cmpeq_epi32(_mm256_and_si256(v, bit), bit);
+
+		_mm256_storeu_si256((__m256i *)(dp + i), _mm256_blendv_epi8(bg, fg, m));
+	}
+	for (; i < width; i++)
+		dp[i] = pal[(indexes[i / 8] >> (7 - (i % 8))) & 1];
+}
+
+static VNC_AVX2 void vnc_base_framebuffer_expand_8x32_avx2(guint8 *dst,
+							   const guint8 *indexes,
+							   int bits G_GNUC_UNUSED,
+							   const guint8 *palette,
+							   guint16 width)
+{
+	guint32 *dp = (guint32 *)dst;
+	const guint32 *pal = (const guint32 *)palette;
+	int i;
+
+	for (i = 0; i + 8 <= width; i += 8) {
+		__m256i ind = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(indexes + i)));
+
+		_mm256_storeu_si256((__m256i *)(dp + i),
+				    _mm256_i32gather_epi32((const int *)pal, ind, 4));
+	}
+	for (; i < width; i++)
+		dp[i] = pal[indexes[i]];
+}
+
+#undef VNC_AVX2
+#undef VNC_SSE2
+
+#endif /* VNC_BASE_FRAMEBUFFER_SIMD_X86 */
+
+
+#ifdef VNC_BASE_FRAMEBUFFER_SIMD_NEON
+
+typedef struct {
+	int32x4_t rrs, grs, brs; /* Negated, since NEON only shifts left */
+	int32x4_t rls, gls, bls;
+	uint32x4_t rm, gm, bm;
+	uint32x4_t alpha;
+} VncBaseFramebufferNEONConv;
+
+static void vnc_base_framebuffer_neon_conv_init(VncBaseFramebufferPrivate *priv,
+						VncBaseFramebufferNEONConv *conv)
+{
+	conv->rrs = vdupq_n_s32(-priv->rrs);
+	conv->grs = vdupq_n_s32(-priv->grs);
+	conv->brs = vdupq_n_s32(-priv->brs);
+	conv->rls = vdupq_n_s32(priv->rls);
+	conv->gls = vdupq_n_s32(priv->gls);
+	conv->bls = vdupq_n_s32(priv->bls);
+	conv->rm = vdupq_n_u32(priv->rm);
+	conv->gm = vdupq_n_u32(priv->gm);
+	conv->bm = vdupq_n_u32(priv->bm);
+	conv->alpha = vdupq_n_u32(priv->alpha_mask);
+}
+
+/* 4 native endian remote pixels, zero extended to 32 bits -> 4 local pixels */
+static inline uint32x4_t vnc_base_framebuffer_neon_convert(const VncBaseFramebufferNEONConv *conv,
+							   uint32x4_t sp,
+							   gboolean swap_img)
+{
+	uint32x4_t dp = conv->alpha;
+
+	dp = vorrq_u32(dp, vshlq_u32(vandq_u32(vshlq_u32(sp, conv->rrs), conv->rm), conv->rls));
+	dp = vorrq_u32(dp, vshlq_u32(vandq_u32(vshlq_u32(sp, conv->grs), conv->gm), conv->gls));
+	dp = vorrq_u32(dp, vshlq_u32(vandq_u32(vshlq_u32(sp, conv->brs), conv->bm), conv->bls));
+
+	return swap_img ? vreinterpretq_u32_u8(vrev32q_u8(vreinterpretq_u8_u32(dp))) : dp;
+}
+
+static void vnc_base_framebuffer_blt_32x32_neon(VncBaseFramebufferPrivate *priv,
+						guint8 *src, int rowstride,
+						guint16 x, guint16 y,
+						guint16 width, guint16 height)
+{
+	guint8 *dst = VNC_BASE_FRAMEBUFFER_AT(priv, x, y);
+	gboolean swap_rfb = priv->remoteFormat->byte_order != G_BYTE_ORDER;
+	gboolean swap_img = priv->localFormat->byte_order != G_BYTE_ORDER;
+	VncBaseFramebufferNEONConv conv;
+	int i;
+
+	vnc_base_framebuffer_neon_conv_init(priv, &conv);
+
+	for (i = 0; i < height; i++) {
+		guint32 *dp = (guint32 *)dst;
+		guint32 *sp = (guint32 *)src;
+		int j;
+
+		for (j = 0; j + 4 <= width; j += 4) {
+			uint32x4_t v = vreinterpretq_u32_u8(vld1q_u8((const guint8 *)(sp + j)));
+
+			if (swap_rfb)
+				v = vreinterpretq_u32_u8(vrev32q_u8(vreinterpretq_u8_u32(v)));
+			vst1q_u8((guint8 *)(dp + j),
+				 vreinterpretq_u8_u32(vnc_base_framebuffer_neon_convert(&conv, v, swap_img)));
+		}
+		for (; j < width; j++)
+			vnc_base_framebuffer_set_pixel_32x32(priv, dp + j,
+							     vnc_base_framebuffer_swap_rfb_32(priv, sp[j]));
+
+		dst += priv->rowstride;
+		src += rowstride;
+	}
+}
+
+static void vnc_base_framebuffer_blt_16x32_neon(VncBaseFramebufferPrivate *priv,
+						guint8 *src, int rowstride,
+						guint16 x, guint16 y,
+						guint16 width, guint16 height)
+{
+	guint8 *dst = VNC_BASE_FRAMEBUFFER_AT(priv, x, y);
+	gboolean swap_rfb = priv->remoteFormat->byte_order != G_BYTE_ORDER;
+	gboolean swap_img = priv->localFormat->byte_order != G_BYTE_ORDER;
+	VncBaseFramebufferNEONConv conv;
+	int i;
+
+	vnc_base_framebuffer_neon_conv_init(priv, &conv);
+
+	for (i = 0; i < height; i++) {
+		guint32 *dp = (guint32 *)dst;
+		guint16 *sp = (guint16 *)src;
+		int j;
+
+		for (j = 0; j + 8 <= width; j += 8) {
+			uint16x8_t v = vreinterpretq_u16_u8(vld1q_u8((const guint8 *)(sp + j)));
+
+			if (swap_rfb)
+				v = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(v)));
+			vst1q_u8((guint8 *)(dp + j),
+				 vreinterpretq_u8_u32(vnc_base_framebuffer_neon_convert(&conv, vmovl_u16(vget_low_u16(v)), swap_img)));
+			vst1q_u8((guint8 *)(dp + j + 4),
+				 vreinterpretq_u8_u32(vnc_base_framebuffer_neon_convert(&conv, vmovl_u16(vget_high_u16(v)), swap_img)));
+		}
+		for (; j < width; j++)
+			vnc_base_framebuffer_set_pixel_16x32(priv, dp + j,
+							     vnc_base_framebuffer_swap_rfb_16(priv, sp[j]));
+
+		dst += priv->rowstride;
+		src += rowstride;
+	}
+}
+
+static void vnc_base_framebuffer_blt_8x32_neon(VncBaseFramebufferPrivate *priv,
+					       guint8 *src, int rowstride,
+					       guint16 x, guint16 y,
+					       guint16 width, guint16 height)
+{
+	guint8 *dst = VNC_BASE_FRAMEBUFFER_AT(priv, x, y);
+	gboolean swap_img = priv->localFormat->byte_order != G_BYTE_ORDER;
+	VncBaseFramebufferNEONConv conv;
+	int i;
+
+	vnc_base_framebuffer_neon_conv_init(priv, &conv);
+
+	for (i = 0; i < height; i++) {
+		guint32 *dp = (guint32 *)dst;
+		guint8 *sp = src;
+		int j;
+
+		for (j = 0; j + 8 <= width; j += 8) {
+			uint16x8_t v = vmovl_u8(vld1_u8(sp + j));
+
+			vst1q_u8((guint8 *)(dp + j),
+				 vreinterpretq_u8_u32(vnc_base_framebuffer_neon_convert(&conv, vmovl_u16(vget_low_u16(v)), swap_img)));
+			vst1q_u8((guint8 *)(dp + j + 4),
+				 vreinterpretq_u8_u32(vnc_base_framebuffer_neon_convert(&conv, vmovl_u16(vget_high_u16(v)), swap_img)));
+		}
+		for (; j < width; j++)
+			vnc_base_framebuffer_set_pixel_8x32(priv, dp + j, sp[j]);
+
+		dst += priv->rowstride;
+		src += rowstride;
+	}
+}
+
+static void vnc_base_framebuffer_expand_1x32_neon(guint8 *dst,
+						  const guint8 *indexes,
+						  int bits G_GNUC_UNUSED,
+						  const guint8 *palette,
+						  guint16 width)
+{
+	guint32 *dp = (guint32 *)dst;
+	const guint32 *pal = (const guint32 *)palette;
+	static const guint32 hibits[4] = { 0x80, 0x40, 0x20, 0x10 };
+	static const guint32 lobits[4] = { 0x08, 0x04, 0x02, 0x01 };
+	uint32x4_t bg = vdupq_n_u32(pal[0]);
+	uint32x4_t fg = vdupq_n_u32(pal[1]);
+	uint32x4_t hi = vld1q_u32(hibits);
+	uint32x4_t lo = vld1q_u32(lobits);
+	int i;
+
+	for (i = 0; i + 8 <= width; i += 8) {
+		uint32x4_t v = vdupq_n_u32(indexes[i / 8]);
+
+		vst1q_u32(dp + i, vbslq_u32(vtstq_u32(v, hi), fg, bg));
+		vst1q_u32(dp + i + 4, vbslq_u32(vtstq_u32(v, lo), fg, bg));
+	}
+	for (; i < width; i++)
+		dp[i] = pal[(indexes[i / 8] >> (7 - (i % 8))) & 1];
+}
+
+#endif /* VNC_BASE_FRAMEBUFFER_SIMD_NEON */
+
+
+/*
+ * Returns the fastest vectorized BLT for the current format pair that
+ * this CPU can run, or NULL to stay with the portable one.
+ */
+static vnc_base_framebuffer_blt_func *vnc_base_framebuffer_simd_blt(VncBaseFramebufferPrivate *priv)
+{
+	int srcbpp = priv->remoteFormat->bits_per_pixel;
+
+	if (priv->kernels != VNC_BASE_FRAMEBUFFER_KERNELS_FASTEST ||
+	    !priv->remoteFormat->true_color_flag ||
+	    priv->localFormat->bits_per_pixel != 32 ||
+	    (srcbpp != 8 && srcbpp != 16 && srcbpp != 32))
+		return NULL;
+
+	/* Vector shifts saturate where C shifts are undefined, so stay
+	 * with the scalar code for any bogus formats */
+	if (priv->rrs > 31 || priv->grs > 31 || priv->brs > 31 ||
+	    priv->rls > 31 || priv->gls > 31 || priv->bls > 31)
+		return NULL;
+
+#ifdef VNC_BASE_FRAMEBUFFER_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		VNC_DEBUG("Using AVX2 %dx32 blt", srcbpp);
+		switch (srcbpp) {
+		case 8: return vnc_base_framebuffer_blt_8x32_avx2;
+		case 16: return vnc_base_framebuffer_blt_16x32_avx2;
+		case 32: return vnc_base_framebuffer_blt_32x32_avx2;
+		}
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		VNC_DEBUG("Using SSE2 %dx32 blt", srcbpp);
+		switch (srcbpp) {
+		case 8: return vnc_base_framebuffer_blt_8x32_sse2;
+		case 16: return vnc_base_framebuffer_blt_16x32_sse2;
+		case 32: return vnc_base_framebuffer_blt_32x32_sse2;
+		}
+	}
+#endif
+
+#ifdef VNC_BASE_FRAMEBUFFER_SIMD_NEON
+	VNC_DEBUG("Using NEON %dx32 blt", srcbpp);
+	switch (srcbpp) {
+	case 8: return vnc_base_framebuffer_blt_8x32_neon;
+	case 16: return vnc_base_framebuffer_blt_16x32_neon;
+	case 32: return vnc_base_framebuffer_blt_32x32_neon;
+	}
+#endif
+
+	return NULL;
+}
+
+
+/*
+ * Returns the fastest vectorized EXPAND of packed palette
+ * indexes of the given size, or NULL for the portable one.
+ * 'bits' goes unused when built without SIMD support.
+ */
+static vnc_base_framebuffer_expand_func *vnc_base_framebuffer_simd_expand(VncBaseFramebufferPrivate *priv,
+									  int bits G_GNUC_UNUSED)
+{
+	if (priv->kernels != VNC_BASE_FRAMEBUFFER_KERNELS_FASTEST ||
+	    priv->localFormat->bits_per_pixel != 32)
+		return NULL;
+
+#ifdef VNC_BASE_FRAMEBUFFER_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		if (bits == 1)
+			return vnc_base_framebuffer_expand_1x32_avx2;
+		if (bits == 8)
+			return vnc_base_framebuffer_expand_8x32_avx2;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		if (bits == 1)
+			return vnc_base_framebuffer_expand_1x32_sse2;
+	}
+#endif
+
+#ifdef VNC_BASE_FRAMEBUFFER_SIMD_NEON
+	if (bits == 1)
+		return vnc_base_framebuffer_expand_1x32_neon;
+#endif
+
+	return NULL;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
@@ -63,15 +63,37 @@ struct wait_queue
 };
 
 
-typedef void vnc_connection_rich_cursor_blt_func(VncConnection *conn, guint8 *, guint8 *,
-						  guint8 *, int, guint16, guint16);
+/* Number of encodings considered by adaptive selection */
+#define VNC_CONNECTION_AUTO_ENCODINGS 4
+
+/* Estimated cost of one encoding on this connection */
+struct vnc_encoding_cost
+{
+	gboolean measured;
+	double ratio;   /* encoded bytes per byte of raw pixel data */
+	double decode;  /* client decode time, in microseconds per pixel */
 
-typedef void vnc_connection_tight_compute_predicted_func(VncConnection *conn, guint8 *,
-							  guint8 *, guint8 *,
-							  guint8 *);
+	/* When measurements were last folded in, in microseconds */
+	gint64 sampled;
 
-typedef void vnc_connection_tight_sum_pixel_func(VncConnection *conn, guint8 *, guint8 *);
+	/* Totals accumulated since the last evaluation */
+	guint64 pixels;
+	guint64 bytes;
+	gint64 decode_time;
+};
+
+
+typedef void vnc_connection_rich_cursor_blt_func(VncConnection *conn, guint8 *, guint8 *,
+						  guint8 *, int, guint16, guint16);
+typedef void vnc_connection_tpixel_expand_func(const gint8 *pos, guint8 *dst,
+					       const guint8 *src, int n);
+typedef void vnc_connection_gradient_predict_func(const guint16 *max,
+						  const guint16 *prev,
+						  guint16 *cur,
+						  const guint16 *diff,
+						  int n);
 static void vnc_connection_close(VncConnection *conn);
+static void vnc_connection_enable_continuous_updates(VncConnection *conn, gboolean enable);
 
 /*
  * A special GSource impl which allows us to wait on a certain
@@ -134,11 +156,45 @@ struct _VncConnectionPrivate
 	unsigned int saslDecodedOffset;
 #endif
 
-	char read_buffer[4096];
+	guint buffer_size;
+
+	/* Live counters, only touched by the coroutine, and the
+	 * copy published for other threads to read */
+	VncStats stats;
+	VncStats stats_snapshot;
+	GMutex *stats_lock; /* NULL if threads were not initialized */
+	gint64 update_request_time;
+	/* Inflate time on the coroutine, for charging to encodings */
+	guint64 inflate_time;
+
+	char *read_buffer;
+	size_t read_buffer_capacity;
 	size_t read_offset;
 	size_t read_size;
 
-	char write_buffer[4096];
+	/* FBS recording of the server stream. Read buffer contents
+	 * are written out once consumed, so synthesized messages can
+	 * be spliced in at message boundaries */
+	FILE *record_file;
+	gboolean recording;
+	gint64 record_start;
+	gint64 record_time;
+	size_t record_offset;
+	VncPixelFormat record_fmt;
+
+	/* Replay of an FBS recording in place of a socket */
+	char *replay_filename;
+	FILE *replay_file;
+	gboolean replay_realtime;
+	gint64 replay_start;
+	guint8 *replay_block;
+	size_t replay_block_size;
+	size_t replay_block_capacity;
+	size_t replay_offset;
+	guint32 replay_timestamp;
+
+	char *write_buffer;
+	size_t write_buffer_capacity;
 	size_t write_offset;
 
 	VncFramebuffer *fb;
@@ -149,8 +205,11 @@ struct _VncConnectionPrivate
 	gboolean sharedFlag;
 
 	vnc_connection_rich_cursor_blt_func *rich_cursor_blt;
-	vnc_connection_tight_compute_predicted_func *tight_compute_predicted;
-	vnc_connection_tight_sum_pixel_func *tight_sum_pixel;
+
+	/* Tight decoder kernels for this CPU, picked once at init
+	 * since the threaded workers call them for every row */
+	vnc_connection_tpixel_expand_func *tpixel_expand;
+	vnc_connection_gradient_predict_func *gradient_predict;
 
 	int wait_interruptable;
 	struct wait_queue wait;
@@ -159,19 +218,62 @@ struct _VncConnectionPrivate
 	int xmit_buffer_capacity;
 	int xmit_buffer_size;
 
+	guint8 *scratch;
+	size_t scratch_size;
+	size_t scratch_used;
+	size_t scratch_spilled;
+	GSList *scratch_spill;
+
 	z_stream *strm;
 	z_stream streams[5];
 
+	gboolean threaded_decode;
+	GThreadPool *tight_pools[5];
+	GQueue *tight_jobs;
+	size_t tight_bytes;
+
+	/* Damage accumulated over the current FramebufferUpdate */
+	GArray *damage;
+
+	size_t uncompressed_offset;
 	size_t uncompressed_length;
 	guint8 uncompressed_buffer[4096];
 
-	size_t compressed_length;
-	guint8 *compressed_buffer;
-
-	guint8 zrle_pi;
-	int zrle_pi_bits;
+	size_t compressed_remaining;
 
 	gboolean has_ext_key_event;
+	/* LastRect was in the encodings we last sent */
+	gboolean want_last_rect;
+
+	/* ContinuousUpdates: requested by the client, announced
+	 * by the server, and where our last Enable stands, one of
+	 * VNC_CONNECTION_CONTINUOUS_* */
+	gboolean want_continuous_updates;
+	gboolean has_continuous_updates;
+	int continuous_updates;
+
+	/* Fence: pixel format to switch to once the server
+	 * acknowledges our sync fence */
+	gboolean has_fence;
+	gboolean has_pending_fmt;
+	VncPixelFormat pending_fmt;
+	gint64 rtt_fence_sent;
+	guint rtt;
+
+	/* The client's encodings, and adaptive selection state */
+	gint32 *encodings;
+	int n_encodings;
+	gboolean auto_encoding;
+	int auto_current;
+	int auto_probe;
+	gint64 auto_last_probe;
+	struct vnc_encoding_cost auto_costs[VNC_CONNECTION_AUTO_ENCODINGS];
+	double auto_bandwidth;
+	guint64 auto_window_bytes;
+	gint64 auto_window_wait;
+	gint64 auto_last_eval;
+	gint64 auto_last_switch;
+	char *encoding_choice;
 
 	struct {
 		gboolean incremental;
@@ -204,13 +306,84 @@ enum {
 	VNC_INITIALIZED,
 	VNC_DISCONNECTED,
 
+	VNC_FRAMEBUFFER_UPDATE_REGION,
+	VNC_FRAMEBUFFER_UPDATE_COMPLETE,
+
 	VNC_LAST_SIGNAL,
+
+	/* Property notifications, dispatched from the
+	 * coroutine the same way as the signals above */
+	VNC_ENCODING_CHOICE_NOTIFY,
 };
 
 static guint signals[VNC_LAST_SIGNAL] = { 0, 0, 0, 0,
 					  0, 0, 0, 0,
 					  0, 0, 0, 0,
-					  0, 0, 0 };
+					  0, 0, 0, 0,
+					  0 };
+
+/* Flags for the Fence message */
+#define VNC_CONNECTION_FENCE_BLOCK_BEFORE (1 << 0)
+#define VNC_CONNECTION_FENCE_BLOCK_AFTER  (1 << 1)
+#define VNC_CONNECTION_FENCE_SYNC_NEXT    (1 << 2)
+#define VNC_CONNECTION_FENCE_REQUEST      (1U << 31)
+
+/* We process messages strictly in order, so support the
+ * blocking flags for free, but not SyncNext */
+#define VNC_CONNECTION_FENCE_SUPPORTED \
+	(VNC_CONNECTION_FENCE_BLOCK_BEFORE | VNC_CONNECTION_FENCE_BLOCK_AFTER)
+
+/* States of ContinuousUpdates. Disabling them is acknowledged
+ * by the server with an EndOfContinuousUpdates */
+enum {
+	VNC_CONNECTION_CONTINUOUS_OFF,
+	VNC_CONNECTION_CONTINUOUS_ON,
+	VNC_CONNECTION_CONTINUOUS_STOPPING,
+};
+
+/* Payloads identifying which of our fences is being answered */
+#define VNC_CONNECTION_FENCE_PIXEL_FORMAT 'P'
+#define VNC_CONNECTION_FENCE_LATENCY 'L'
+
+/*
+ * Encodings adaptive selection chooses between, with priors
+ * used until they've been measured on this connection
+ */
+static const struct {
+	gint32 encoding;
+	const char *name;
+	double ratio;
+	double decode;
+} vnc_connection_auto_encodings[VNC_CONNECTION_AUTO_ENCODINGS] = {
+	{ VNC_CONNECTION_ENCODING_RAW, "raw", 1.0, 0.002 },
+	{ VNC_CONNECTION_ENCODING_HEXTILE, "hextile", 0.5, 0.006 },
+	{ VNC_CONNECTION_ENCODING_ZRLE, "zrle", 0.15, 0.02 },
+	{ VNC_CONNECTION_ENCODING_TIGHT, "tight", 0.1, 0.03 },
+};
+
+/* How often to re-evaluate the choice, and the minimum time
+ * between switches, in microseconds */
+#define VNC_CONNECTION_AUTO_INTERVAL (2 * G_USEC_PER_SEC)
+#define VNC_CONNECTION_AUTO_HOLDOFF (10 * G_USEC_PER_SEC)
+
+/* Only switch for a worthwhile estimated saving */
+#define VNC_CONNECTION_AUTO_HYSTERESIS 0.75
+
+/* How often to spend an interval sampling an encoding other
+ * than the preferred one, whose cost would otherwise never be
+ * re-measured, in microseconds */
+#define VNC_CONNECTION_AUTO_PROBE_INTERVAL (60 * G_USEC_PER_SEC)
+
+/* Ignore windows too small to give meaningful measurements */
+#define VNC_CONNECTION_AUTO_MIN_BYTES (64 * 1024)
+#define VNC_CONNECTION_AUTO_MIN_PIXELS (64 * 64)
+
+/* Bounds for the adaptively sized read/write buffers */
+#define VNC_CONNECTION_BUFFER_MIN 4096
+#define VNC_CONNECTION_BUFFER_MAX (4 * 1024 * 1024)
+
+/* Largest scratch arena kept around between updates */
+#define VNC_CONNECTION_SCRATCH_MAX (16 * 1024 * 1024)
 
 #define nibhi(a) (((a) >> 4) & 0x0F)
 #define niblo(a) ((a) & 0x0F)
@@ -341,6 +514,11 @@ static gboolean g_condition_wait(g_condition_wait_func func, gpointer data)
 enum {
 	PROP_0,
 	PROP_FRAMEBUFFER,
+	PROP_BUFFER_SIZE,
+	PROP_THREADED_DECODE,
+	PROP_AUTO_ENCODING,
+	PROP_ENCODING_CHOICE,
+	PROP_STATS,
 };
 
 
@@ -357,6 +535,26 @@ static void vnc_connection_get_property(GObject *object,
 		g_value_set_object(value, priv->fb);
 		break;
 
+	case PROP_BUFFER_SIZE:
+		g_value_set_uint(value, priv->buffer_size);
+		break;
+
+	case PROP_THREADED_DECODE:
+		g_value_set_boolean(value, priv->threaded_decode);
+		break;
+
+	case PROP_AUTO_ENCODING:
+		g_value_set_boolean(value, priv->auto_encoding);
+		break;
+
+	case PROP_ENCODING_CHOICE:
+		g_value_set_string(value, priv->encoding_choice);
+		break;
+
+	case PROP_STATS:
+		g_value_take_boxed(value, vnc_connection_get_stats(conn));
+		break;
+
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
 	}
@@ -374,6 +572,18 @@ static void vnc_connection_set_property(GObject *object,
 		vnc_connection_set_framebuffer(conn, g_value_get_object(value));
 		break;
 
+	case PROP_BUFFER_SIZE:
+		vnc_connection_set_buffer_size(conn, g_value_get_uint(value));
+		break;
+
+	case PROP_THREADED_DECODE:
+		vnc_connection_set_threaded_decode(conn, g_value_get_boolean(value));
+		break;
+
+	case PROP_AUTO_ENCODING:
+		vnc_connection_set_auto_encoding(conn, g_value_get_boolean(value));
+		break;
+
         default:
             G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         }
@@ -400,6 +610,10 @@ struct signal_data
 			int width;
 			int height;
 		} size;
+		struct {
+			const VncConnectionRect *rects;
+			guint nrects;
+		} region;
 		VncPixelFormat *pixelFormat;
 		const char *authReason;
 		unsigned int authUnsupported;
@@ -451,6 +665,14 @@ static gboolean do_vnc_connection_emit_main_context(gpointer opaque)
 			      data->params.area.height);
 		break;
 
+	case VNC_FRAMEBUFFER_UPDATE_REGION:
+		g_signal_emit(G_OBJECT(data->conn),
+			      signals[data->signum],
+			      0,
+			      data->params.region.rects,
+			      data->params.region.nrects);
+		break;
+
 	case VNC_DESKTOP_RESIZE:
 		g_signal_emit(G_OBJECT(data->conn),
 			      signals[data->signum],
@@ -505,10 +727,15 @@ static gboolean do_vnc_connection_emit_main_context(gpointer opaque)
 	case VNC_CONNECTED:
 	case VNC_INITIALIZED:
 	case VNC_DISCONNECTED:
+	case VNC_FRAMEBUFFER_UPDATE_COMPLETE:
 		g_signal_emit(G_OBJECT(data->conn),
 			      signals[data->signum],
 			      0);
 		break;
+
+	case VNC_ENCODING_CHOICE_NOTIFY:
+		g_object_notify(G_OBJECT(data->conn), "encoding-choice");
+		break;
 	}
 
 	coroutine_yieldto(data->caller, NULL);
@@ -526,6 +753,8 @@ static void vnc_connection_emit_main_context(VncConnection *conn,
 
 	g_idle_add(do_vnc_connection_emit_main_context, data);
 
+	conn->priv->stats.coroutine_switches++;
+
 	/* This switches to the system coroutine context, lets
 	 * the idle function run to dispatch the signal, and
 	 * finally returns once complete. ie this is synchronous
@@ -536,62 +765,217 @@ static void vnc_connection_emit_main_context(VncConnection *conn,
 }
 
 
+/*
+ * Allocate temporary storage for decoding the current
+ * FramebufferUpdate message. The memory remains valid
+ * until vnc_connection_scratch_reset() is called at the
+ * start of the next update, so must never be freed.
+ *
+ * Requests are carved out of a single block; anything
+ * which does not fit is allocated separately, and the
+ * block grown to cover it at the next reset, so steady
+ * state decoding does no heap allocation at all
+ */
+static gpointer vnc_connection_scratch_alloc(VncConnection *conn, size_t size)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	gpointer ret;
+
+	/* Keep everything suitably aligned for pixel data */
+	size = (size + 7) & ~7;
+
+	if ((priv->scratch_size - priv->scratch_used) < size) {
+		ret = g_malloc(size);
+		priv->scratch_spill = g_slist_prepend(priv->scratch_spill, ret);
+		priv->scratch_spilled += size;
+		return ret;
+	}
+
+	ret = priv->scratch + priv->scratch_used;
+	priv->scratch_used += size;
+	return ret;
+}
+
+static void vnc_connection_scratch_reset(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	if (priv->scratch_spill) {
+		size_t want = priv->scratch_used + priv->scratch_spilled;
+
+		g_slist_foreach(priv->scratch_spill, (GFunc)g_free, NULL);
+		g_slist_free(priv->scratch_spill);
+		priv->scratch_spill = NULL;
+		priv->scratch_spilled = 0;
+
+		if (want > VNC_CONNECTION_SCRATCH_MAX)
+			want = VNC_CONNECTION_SCRATCH_MAX;
+		if (want > priv->scratch_size) {
+			VNC_DEBUG("Growing scratch arena from %" G_GSIZE_FORMAT " to %" G_GSIZE_FORMAT,
+				  priv->scratch_size, want);
+			g_free(priv->scratch);
+			priv->scratch = g_malloc(want);
+			priv->scratch_size = want;
+		}
+	}
+
+	priv->scratch_used = 0;
+}
+
 static gboolean vnc_connection_use_compression(VncConnection *conn)
 {
 	VncConnectionPrivate *priv = conn->priv;
 
-	return priv->compressed_buffer != NULL;
+	return priv->strm != NULL;
 }
 
-static int vnc_connection_zread(VncConnection *conn, void *buffer, size_t size)
+/* IO functions */
+
+
+/* Microseconds for measuring intervals, immune to clock changes
+ * where GLib is new enough */
+static gint64 vnc_connection_now(void)
+{
+#if GLIB_CHECK_VERSION(2, 28, 0)
+	return g_get_monotonic_time();
+#else
+	GTimeVal now;
+
+	g_get_current_time(&now);
+
+	return ((gint64)now.tv_sec * G_USEC_PER_SEC) + now.tv_usec;
+#endif
+}
+
+#define VNC_CONNECTION_FBS_MAGIC "FBS 001.000\n"
+
+static gboolean g_timeout_wait_helper(gpointer data)
+{
+	struct coroutine *to = data;
+	GIOCondition cond = 0;
+	coroutine_yieldto(to, &cond);
+	return FALSE;
+}
+
+/*
+ * Sleep the coroutine for 'ms', returning FALSE if woken
+ * early via g_io_wakeup on 'wait'
+ */
+static gboolean g_timeout_wait_interruptable(struct wait_queue *wait, guint ms)
+{
+	gpointer ret;
+	guint id;
+
+	wait->context = coroutine_self();
+	id = g_timeout_add(ms, g_timeout_wait_helper, wait->context);
+	wait->waiting = TRUE;
+	ret = coroutine_yield(NULL);
+	wait->waiting = FALSE;
+
+	if (ret == NULL) {
+		g_source_remove(id);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static gboolean vnc_connection_open_replay_internal(VncConnection *conn)
 {
 	VncConnectionPrivate *priv = conn->priv;
-	char *ptr = buffer;
-	size_t offset = 0;
+	char magic[12];
 
-	while (offset < size) {
-		/* if data is available in the uncompressed buffer, then
-		 * copy */
-		if (priv->uncompressed_length) {
-			size_t len = MIN(priv->uncompressed_length,
-					 size - offset);
+	VNC_DEBUG("Replaying %s", priv->replay_filename);
 
-			memcpy(ptr + offset,
-			       priv->uncompressed_buffer,
-			       len);
+	if (!(priv->replay_file = fopen(priv->replay_filename, "rb"))) {
+		VNC_DEBUG("Unable to open %s: %s", priv->replay_filename, g_strerror(errno));
+		return FALSE;
+	}
 
-			priv->uncompressed_length -= len;
-			if (priv->uncompressed_length)
-				memmove(priv->uncompressed_buffer,
-					priv->uncompressed_buffer + len,
-					priv->uncompressed_length);
-			offset += len;
-		} else {
-			int err;
+	if (fread(magic, sizeof(magic), 1, priv->replay_file) != 1 ||
+	    memcmp(magic, VNC_CONNECTION_FBS_MAGIC, sizeof(magic)) != 0) {
+		VNC_DEBUG("%s is not an FBS recording", priv->replay_filename);
+		fclose(priv->replay_file);
+		priv->replay_file = NULL;
+		return FALSE;
+	}
+
+	priv->replay_start = vnc_connection_now();
+	priv->replay_block_size = priv->replay_offset = 0;
+	return TRUE;
+}
 
-			priv->strm->next_in = priv->compressed_buffer;
-			priv->strm->avail_in = priv->compressed_length;
-			priv->strm->next_out = priv->uncompressed_buffer;
-			priv->strm->avail_out = sizeof(priv->uncompressed_buffer);
+/* Load the next non-empty block of the recording */
+static gboolean vnc_connection_replay_next_block(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	guint32 length, timestamp;
+	size_t want;
 
-			/* inflate as much as possible */
-			err = inflate(priv->strm, Z_SYNC_FLUSH);
-			if (err != Z_OK) {
-				errno = EIO;
-				return -1;
-			}
+	do {
+		if (fread(&length, 4, 1, priv->replay_file) != 1) {
+			VNC_DEBUG("End of recording");
+			return FALSE;
+		}
+		length = GUINT32_FROM_BE(length);
+		want = length + ((4 - (length % 4)) % 4);
 
-			priv->uncompressed_length = (guint8 *)priv->strm->next_out - priv->uncompressed_buffer;
-			priv->compressed_length -= (guint8 *)priv->strm->next_in - priv->compressed_buffer;
-			priv->compressed_buffer = priv->strm->next_in;
+		if (want > priv->replay_block_capacity) {
+			priv->replay_block = g_realloc(priv->replay_block, want);
+			priv->replay_block_capacity = want;
 		}
-	}
 
-	return offset;
+		if ((want && fread(priv->replay_block, want, 1, priv->replay_file) != 1) ||
+		    fread(&timestamp, 4, 1, priv->replay_file) != 1) {
+			VNC_DEBUG("Recording is truncated");
+			return FALSE;
+		}
+	} while (!length);
+
+	priv->replay_block_size = length;
+	priv->replay_offset = 0;
+	priv->replay_timestamp = GUINT32_FROM_BE(timestamp);
+	return TRUE;
 }
 
-/* IO functions */
+/*
+ * The replay counterpart of reading from the socket. In real
+ * time mode each block is held back until its recorded time
+ * since the start has elapsed
+ */
+static int vnc_connection_read_replay(VncConnection *conn, void *data, size_t len)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	size_t tmp;
+
+	if (priv->replay_offset == priv->replay_block_size &&
+	    !vnc_connection_replay_next_block(conn)) {
+		priv->has_error = TRUE;
+		return -EPIPE;
+	}
+
+	while (priv->replay_realtime && priv->replay_offset == 0) {
+		gint64 delay = priv->replay_start +
+			((gint64)priv->replay_timestamp * 1000) - vnc_connection_now();
+
+		if (delay <= 0)
+			break;
+
+		priv->stats.coroutine_switches++;
+		if (!g_timeout_wait_interruptable(&priv->wait, (delay + 999) / 1000)) {
+			if (priv->has_error)
+				return -EINVAL;
+			if (priv->wait_interruptable)
+				return -EAGAIN;
+		}
+	}
+
+	tmp = MIN(len, priv->replay_block_size - priv->replay_offset);
+	memcpy(data, priv->replay_block + priv->replay_offset, tmp);
+	priv->replay_offset += tmp;
+	priv->stats.wire_bytes_read += tmp;
 
+	return tmp;
+}
 
 /*
  * Read at least 1 more byte of data straight off the wire
@@ -607,6 +991,10 @@ static int vnc_connection_read_wire(VncConnection *conn, void *data, size_t len)
 
 	if (priv->has_error) return -EINVAL;
 
+	if (priv->replay_file)
+		return vnc_connection_read_replay(conn, data, len);
+
+	priv->stats.read_syscalls++;
 	if (priv->tls_session) {
 		ret = gnutls_read(priv->tls_session, data, len);
 		if (ret < 0) {
@@ -628,11 +1016,14 @@ static int vnc_connection_read_wire(VncConnection *conn, void *data, size_t len)
 				VNC_DEBUG("Read error %s", error->message);
 			}
 			ret = -1;
+		} else {
+			priv->stats.wire_bytes_read += ret;
 		}
 	}
 
 	if (ret == -1) {
 		if (blocking) {
+			priv->stats.coroutine_switches++;
 			if (priv->wait_interruptable) {
 				if (!g_io_wait_interruptable(&priv->wait,
 							     priv->sock, G_IO_IN)) {
@@ -640,7 +1031,9 @@ static int vnc_connection_read_wire(VncConnection *conn, void *data, size_t len)
 					return -EAGAIN;
 				}
 			} else {
+				gint64 start = vnc_connection_now();
 				g_io_wait(priv->sock, G_IO_IN);
+				priv->stats.read_wait_time += vnc_connection_now() - start;
 			}
 			goto reread;
 		} else {
@@ -693,8 +1086,8 @@ static int vnc_connection_read_sasl(VncConnection *conn)
 	}
 
 	want = priv->saslDecodedLength - priv->saslDecodedOffset;
-	if (want > sizeof(priv->read_buffer))
-		want = sizeof(priv->read_buffer);
+	if (want > priv->read_buffer_capacity)
+		want = priv->read_buffer_capacity;
 
 	memcpy(priv->read_buffer,
 	       priv->saslDecoded + priv->saslDecodedOffset,
@@ -718,8 +1111,39 @@ static int vnc_connection_read_plain(VncConnection *conn)
 {
 	VncConnectionPrivate *priv = conn->priv;
 
-	//VNC_DEBUG("Read plain %d", sizeof(priv->read_buffer));
-	return vnc_connection_read_wire(conn, priv->read_buffer, sizeof(priv->read_buffer));
+	//VNC_DEBUG("Read plain %d", priv->read_buffer_capacity);
+	return vnc_connection_read_wire(conn, priv->read_buffer, priv->read_buffer_capacity);
+}
+
+/*
+ * Size the read buffer ahead of refilling it. With no fixed
+ * size set, the buffer doubles each time the previous read
+ * filled it completely, since that means the kernel had more
+ * data queued than we could accept, ie the bandwidth-delay
+ * product exceeds the buffer size.
+ *
+ * Must only be called when the read buffer is empty
+ */
+static void vnc_connection_read_buffer_resize(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	size_t want = priv->read_buffer_capacity;
+
+	if (priv->buffer_size)
+		want = priv->buffer_size;
+	else if (want < VNC_CONNECTION_BUFFER_MIN)
+		want = VNC_CONNECTION_BUFFER_MIN;
+	else if (priv->read_size == priv->read_buffer_capacity &&
+		 want < VNC_CONNECTION_BUFFER_MAX)
+		want *= 2;
+
+	if (want != priv->read_buffer_capacity) {
+		VNC_DEBUG("Resizing read buffer from %" G_GSIZE_FORMAT " to %" G_GSIZE_FORMAT,
+			  priv->read_buffer_capacity, want);
+		g_free(priv->read_buffer);
+		priv->read_buffer = g_malloc(want);
+		priv->read_buffer_capacity = want;
+	}
 }
 
 /*
@@ -727,108 +1151,554 @@ static int vnc_connection_read_plain(VncConnection *conn)
  */
 static int vnc_connection_read_buf(VncConnection *conn)
 {
-#if HAVE_SASL
 	VncConnectionPrivate *priv = conn->priv;
+	int ret;
 
+#if HAVE_SASL
 	//VNC_DEBUG("Start read %d", priv->has_error);
 	if (priv->saslconn)
-		return vnc_connection_read_sasl(conn);
+		ret = vnc_connection_read_sasl(conn);
 	else
 #endif
-		return vnc_connection_read_plain(conn);
+		ret = vnc_connection_read_plain(conn);
+
+	if (ret > 0)
+		priv->stats.bytes_read += ret;
+	return ret;
 }
 
+static void vnc_connection_record_end(VncConnection *conn);
+
 /*
- * Fill the 'data' buffer up with exactly 'len' bytes worth of data
- *
- * Must only be called from the VNC coroutine
+ * Append one FBS block: the data length, the data padded to
+ * a multiple of 4 bytes, then milliseconds since the start
  */
-static int vnc_connection_read(VncConnection *conn, void *data, size_t len)
+static void vnc_connection_record_block(VncConnection *conn,
+					const void *data, size_t len,
+					gint64 when)
 {
 	VncConnectionPrivate *priv = conn->priv;
-	char *ptr = data;
-	size_t offset = 0;
+	static const guint8 pad[3];
+	guint32 length = GUINT32_TO_BE(len);
+	guint32 timestamp = GUINT32_TO_BE((guint32)((when - priv->record_start) / 1000));
 
-	if (priv->has_error) return -EINVAL;
+	if (!len)
+		return;
 
-	while (offset < len) {
-		size_t tmp;
+	if (fwrite(&length, 4, 1, priv->record_file) != 1 ||
+	    fwrite(data, len, 1, priv->record_file) != 1 ||
+	    fwrite(pad, 1, (4 - (len % 4)) % 4, priv->record_file) != (4 - (len % 4)) % 4 ||
+	    fwrite(&timestamp, 4, 1, priv->record_file) != 1) {
+		VNC_DEBUG("Failed to write recording, stopping: %s", g_strerror(errno));
+		vnc_connection_record_end(conn);
+	}
+}
 
-		/* compressed data is buffered independently of the read buffer
-		 * so we must by-pass it */
-		if (vnc_connection_use_compression(conn)) {
-			int ret = vnc_connection_zread(conn, ptr + offset, len);
-			if (ret == -1) {
-				VNC_DEBUG("Closing the connection: vnc_connection_read() - zread() failed");
-				priv->has_error = TRUE;
-				return -errno;
-			}
-			offset += ret;
-			continue;
-		} else if (priv->read_offset == priv->read_size) {
-			int ret = vnc_connection_read_buf(conn);
+/* Write out the read buffer contents consumed so far */
+static void vnc_connection_record_flush(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
 
-			if (ret < 0)
-				return ret;
-			priv->read_offset = 0;
-			priv->read_size = ret;
-		}
+	if (!priv->recording || priv->record_offset >= priv->read_offset)
+		return;
 
-		tmp = MIN(priv->read_size - priv->read_offset, len - offset);
+	vnc_connection_record_block(conn,
+				    priv->read_buffer + priv->record_offset,
+				    priv->read_offset - priv->record_offset,
+				    priv->record_time);
+	priv->record_offset = priv->read_offset;
+}
 
-		memcpy(ptr + offset, priv->read_buffer + priv->read_offset, tmp);
+static void vnc_connection_record_put_pixel_format(guint8 *buf,
+						   const VncPixelFormat *fmt)
+{
+	guint16 max[3] = {
+		GUINT16_TO_BE(fmt->red_max),
+		GUINT16_TO_BE(fmt->green_max),
+		GUINT16_TO_BE(fmt->blue_max),
+	};
 
-		priv->read_offset += tmp;
-		offset += tmp;
+	buf[0] = fmt->bits_per_pixel;
+	buf[1] = fmt->depth;
+	buf[2] = fmt->byte_order == G_BIG_ENDIAN ? 1 : 0;
+	buf[3] = fmt->true_color_flag;
+	memcpy(buf + 4, max, 6);
+	buf[10] = fmt->red_shift;
+	buf[11] = fmt->green_shift;
+	buf[12] = fmt->blue_shift;
+	memset(buf + 13, 0, 3);
+}
+
+/*
+ * Called once ServerInit has been read. The handshake is
+ * replaced by an RFB 3.3 greeting with no authentication, so
+ * the recording replays without the server or credentials
+ */
+static void vnc_connection_record_begin(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	size_t n_name = strlen(priv->name);
+	size_t len = 12 + 4 + 4 + 16 + 4 + n_name;
+	guint8 *data;
+	guint32 u32;
+	guint16 u16;
+
+	if (!priv->record_file || priv->recording)
+		return;
+
+	data = g_malloc(len);
+	memcpy(data, "RFB 003.003\n", 12);
+	u32 = GUINT32_TO_BE(VNC_CONNECTION_AUTH_NONE);
+	memcpy(data + 12, &u32, 4);
+	u16 = GUINT16_TO_BE(priv->width);
+	memcpy(data + 16, &u16, 2);
+	u16 = GUINT16_TO_BE(priv->height);
+	memcpy(data + 18, &u16, 2);
+	vnc_connection_record_put_pixel_format(data + 20, &priv->fmt);
+	u32 = GUINT32_TO_BE(n_name);
+	memcpy(data + 36, &u32, 4);
+	memcpy(data + 40, priv->name, n_name);
+
+	VNC_DEBUG("Starting recording");
+	priv->recording = TRUE;
+	priv->record_start = priv->record_time = vnc_connection_now();
+	priv->record_offset = priv->read_offset;
+	priv->record_fmt = priv->fmt;
+
+	if (fwrite(VNC_CONNECTION_FBS_MAGIC, 12, 1, priv->record_file) != 1) {
+		VNC_DEBUG("Failed to write recording, stopping: %s", g_strerror(errno));
+		vnc_connection_record_end(conn);
+	} else {
+		vnc_connection_record_block(conn, data, len, priv->record_start);
 	}
 
-	return 0;
+	g_free(data);
 }
 
 /*
- * Write all 'data' of length 'datalen' bytes out to
- * the wire
+ * The server stream only says when the pixel format changes if
+ * the server sends WMVi, so otherwise inject one when the client
+ * switches format. Must be called at a message boundary
  */
-static void vnc_connection_flush_wire(VncConnection *conn,
-				      const void *data,
-				      size_t datalen)
+static void vnc_connection_record_pixel_format(VncConnection *conn)
 {
 	VncConnectionPrivate *priv = conn->priv;
-	const char *ptr = data;
-	size_t offset = 0;
-	//VNC_DEBUG("Flush write %p %d", data, datalen);
-	while (offset < datalen) {
-		int ret;
-		gboolean blocking = FALSE;
+	guint8 data[4 + 12 + 16] = { 0 };
+	guint16 u16;
+	guint32 u32;
 
-		if (priv->has_error) return;
+	if (!priv->recording ||
+	    vnc_pixel_format_match(&priv->record_fmt, &priv->fmt))
+		return;
 
-		if (priv->tls_session) {
-			ret = gnutls_write(priv->tls_session,
-					   ptr+offset,
-					   datalen-offset);
-			if (ret < 0) {
-				if (ret == GNUTLS_E_AGAIN)
-					blocking = TRUE;
-				ret = -1;
-			}
-		} else {
-			GError *error = NULL;
-			ret = g_socket_send(priv->sock,
-					    ptr+offset,
-					    datalen-offset,
-					    NULL, &error);
-			if (ret < 0) {
-				if (error) {
+	vnc_connection_record_flush(conn);
+
+	/* A FramebufferUpdate holding a single WMVi rect */
+	u16 = GUINT16_TO_BE(1);
+	memcpy(data + 2, &u16, 2);
+	u16 = GUINT16_TO_BE(priv->width);
+	memcpy(data + 8, &u16, 2);
+	u16 = GUINT16_TO_BE(priv->height);
+	memcpy(data + 10, &u16, 2);
+	u32 = GUINT32_TO_BE(VNC_CONNECTION_ENCODING_WMVi);
+	memcpy(data + 12, &u32, 4);
+	vnc_connection_record_put_pixel_format(data + 16, &priv->fmt);
+
+	VNC_DEBUG("Recording pixel format change");
+	vnc_connection_record_block(conn, data, sizeof(data), vnc_connection_now());
+	priv->record_fmt = priv->fmt;
+}
+
+static void vnc_connection_record_end(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	if (!priv->record_file)
+		return;
+
+	vnc_connection_record_flush(conn);
+
+	VNC_DEBUG("Finished recording");
+	fclose(priv->record_file);
+	priv->record_file = NULL;
+	priv->recording = FALSE;
+}
+
+/*
+ * Replace the fully consumed read buffer contents with at
+ * least 1 more byte of data
+ */
+static int vnc_connection_read_refill(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	int ret;
+
+	vnc_connection_record_flush(conn);
+	vnc_connection_read_buffer_resize(conn);
+
+	ret = vnc_connection_read_buf(conn);
+	if (ret < 0)
+		return ret;
+
+	priv->read_offset = 0;
+	priv->read_size = ret;
+	priv->record_offset = 0;
+	if (priv->recording)
+		priv->record_time = vnc_connection_now();
+
+	return ret;
+}
+
+/*
+ * Reads at least this large are inflated straight into the
+ * caller's buffer rather than staged in uncompressed_buffer
+ */
+#define VNC_CONNECTION_ZREAD_DIRECT 256
+
+/*
+ * Inflate some more of the current compressed payload into
+ * 'buffer'. Compressed data is fed to zlib straight out of
+ * the read buffer as it arrives off the wire, so decoding
+ * starts long before a large payload has been received.
+ *
+ * Returns the number of bytes produced, or -1 on error
+ */
+static int vnc_connection_zinflate(VncConnection *conn, guint8 *buffer, size_t size)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	for (;;) {
+		guint8 *start = (guint8 *)priv->read_buffer + priv->read_offset;
+		gint64 inflate_start;
+		size_t consumed;
+		int err;
+
+		priv->strm->next_in = start;
+		priv->strm->avail_in = MIN(priv->read_size - priv->read_offset,
+					   priv->compressed_remaining);
+		priv->strm->next_out = buffer;
+		priv->strm->avail_out = size;
+
+		/* inflate as much as possible */
+		inflate_start = vnc_connection_now();
+		err = inflate(priv->strm, Z_SYNC_FLUSH);
+		priv->inflate_time += vnc_connection_now() - inflate_start;
+
+		consumed = priv->strm->next_in - start;
+		priv->read_offset += consumed;
+		priv->compressed_remaining -= consumed;
+		priv->stats.compressed_bytes += consumed;
+		priv->stats.decompressed_bytes += priv->strm->next_out - buffer;
+
+		if (err == Z_OK)
+			return priv->strm->next_out - buffer;
+
+		/* zlib needs more input than has arrived so far */
+		if (err == Z_BUF_ERROR &&
+		    priv->compressed_remaining &&
+		    priv->read_offset == priv->read_size) {
+			int ret = vnc_connection_read_refill(conn);
+			if (ret < 0) {
+				errno = -ret;
+				return -1;
+			}
+			continue;
+		}
+
+		errno = EIO;
+		return -1;
+	}
+}
+
+static int vnc_connection_zread(VncConnection *conn, void *buffer, size_t size)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	guint8 *ptr = buffer;
+	size_t offset = 0;
+
+	while (offset < size) {
+		/* if data is available in the uncompressed buffer, then
+		 * copy */
+		if (priv->uncompressed_offset < priv->uncompressed_length) {
+			size_t len = MIN(priv->uncompressed_length - priv->uncompressed_offset,
+					 size - offset);
+
+			memcpy(ptr + offset,
+			       priv->uncompressed_buffer + priv->uncompressed_offset,
+			       len);
+
+			priv->uncompressed_offset += len;
+			offset += len;
+		} else if ((size - offset) >= VNC_CONNECTION_ZREAD_DIRECT) {
+			int ret = vnc_connection_zinflate(conn, ptr + offset, size - offset);
+			if (ret < 0)
+				return -1;
+			offset += ret;
+		} else {
+			int ret = vnc_connection_zinflate(conn, priv->uncompressed_buffer,
+							  sizeof(priv->uncompressed_buffer));
+			if (ret < 0)
+				return -1;
+			priv->uncompressed_offset = 0;
+			priv->uncompressed_length = ret;
+		}
+	}
+
+	return offset;
+}
+
+/*
+ * Setup subsequent calls to vnc_connection_read*() to inflate
+ * the next 'length' bytes off the wire using 'strm'
+ */
+static void vnc_connection_zstart(VncConnection *conn, z_stream *strm, size_t length)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	priv->strm = strm;
+	priv->compressed_remaining = length;
+	priv->uncompressed_offset = priv->uncompressed_length = 0;
+}
+
+/*
+ * Finish with the current compressed payload. Any of it the
+ * decoder didn't need, typically the trailing sync flush marker,
+ * must still go through zlib to keep the stream state in step
+ * with the server
+ */
+static void vnc_connection_zfinish(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	while (!priv->has_error && priv->compressed_remaining) {
+		if (vnc_connection_zinflate(conn, priv->uncompressed_buffer,
+					    sizeof(priv->uncompressed_buffer)) < 0) {
+			VNC_DEBUG("Closing the connection: vnc_connection_zfinish() - inflate failed");
+			priv->has_error = TRUE;
+		}
+	}
+
+	priv->strm = NULL;
+	priv->compressed_remaining = 0;
+	priv->uncompressed_offset = priv->uncompressed_length = 0;
+}
+
+/*
+ * Fill the 'data' buffer up with exactly 'len' bytes worth of data
+ *
+ * Must only be called from the VNC coroutine
+ */
+static int vnc_connection_read(VncConnection *conn, void *data, size_t len)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	char *ptr = data;
+	size_t offset = 0;
+
+	if (priv->has_error) return -EINVAL;
+
+	while (offset < len) {
+		size_t tmp;
+
+		/* compressed data is buffered independently of the read buffer
+		 * so we must by-pass it */
+		if (vnc_connection_use_compression(conn)) {
+			int ret = vnc_connection_zread(conn, ptr + offset, len - offset);
+			if (ret == -1) {
+				VNC_DEBUG("Closing the connection: vnc_connection_read() - zread() failed");
+				priv->has_error = TRUE;
+				return -errno;
+			}
+			offset += ret;
+			continue;
+		} else if (priv->read_offset == priv->read_size) {
+			int ret = vnc_connection_read_refill(conn);
+			if (ret < 0)
+				return ret;
+		}
+
+		tmp = MIN(priv->read_size - priv->read_offset, len - offset);
+
+		memcpy(ptr + offset, priv->read_buffer + priv->read_offset, tmp);
+
+		priv->read_offset += tmp;
+		offset += tmp;
+	}
+
+	return 0;
+}
+
+/*
+ * Fill each of the 'vectors' up with exactly their 'size'
+ * worth of data. The vectors are updated in place as they
+ * are filled.
+ *
+ * Anything already sitting in the read buffer is consumed
+ * first. For plain TCP connections, bulk reads then go
+ * straight off the wire into the caller's buffers, avoiding
+ * the copy through the read buffer. TLS, SASL and compressed
+ * data must be decoded first, so use the normal path
+ *
+ * Must only be called from the VNC coroutine
+ */
+static int vnc_connection_readv(VncConnection *conn,
+				GInputVector *vectors,
+				int nvectors)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	gsize want = 0;
+	int i;
+
+	if (priv->has_error) return -EINVAL;
+
+	while (nvectors && priv->read_offset < priv->read_size) {
+		size_t tmp = MIN(priv->read_size - priv->read_offset,
+				 vectors->size);
+
+		memcpy(vectors->buffer, priv->read_buffer + priv->read_offset, tmp);
+		priv->read_offset += tmp;
+		vectors->buffer = (guint8 *)vectors->buffer + tmp;
+		vectors->size -= tmp;
+		if (vectors->size == 0) {
+			vectors++;
+			nvectors--;
+		}
+	}
+
+	for (i = 0 ; i < nvectors ; i++)
+		want += vectors[i].size;
+
+	/* Small reads are cheaper to satisfy via the read buffer.
+	 * The cutoff is fixed, rather than the buffer's capacity,
+	 * as that grows on busy links to cover most reads */
+	if (priv->tls_session ||
+	    priv->replay_file ||
+#if HAVE_SASL
+	    priv->saslconn ||
+#endif
+	    vnc_connection_use_compression(conn) ||
+	    want < VNC_CONNECTION_BUFFER_MIN) {
+		for (i = 0 ; i < nvectors ; i++) {
+			int ret = vnc_connection_read(conn, vectors[i].buffer, vectors[i].size);
+			if (ret < 0)
+				return ret;
+		}
+		return 0;
+	}
+
+	/* Direct reads bypass the read buffer, so must be recorded
+	 * in order after what it held */
+	vnc_connection_record_flush(conn);
+
+	while (nvectors) {
+		GError *error = NULL;
+		gint flags = 0;
+		gssize ret;
+		gint64 now;
+
+		priv->stats.read_syscalls++;
+		ret = g_socket_receive_message(priv->sock, NULL,
+					       vectors, nvectors,
+					       NULL, NULL, &flags,
+					       NULL, &error);
+		if (ret < 0) {
+			if (error && error->code == G_IO_ERROR_WOULD_BLOCK) {
+				gint64 start = vnc_connection_now();
+				g_error_free(error);
+				priv->stats.coroutine_switches++;
+				g_io_wait(priv->sock, G_IO_IN);
+				priv->stats.read_wait_time += vnc_connection_now() - start;
+				continue;
+			}
+			if (error) {
+				VNC_DEBUG("Read error %s", error->message);
+				g_error_free(error);
+			}
+			priv->has_error = TRUE;
+			return -EIO;
+		}
+		if (ret == 0) {
+			VNC_DEBUG("Closing the connection: vnc_connection_readv() - ret=0");
+			priv->has_error = TRUE;
+			return -EPIPE;
+		}
+		priv->stats.wire_bytes_read += ret;
+		priv->stats.bytes_read += ret;
+
+		now = priv->recording ? vnc_connection_now() : 0;
+		while (ret) {
+			if (priv->recording)
+				vnc_connection_record_block(conn, vectors->buffer,
+							    MIN((gsize)ret, vectors->size), now);
+
+			if ((gsize)ret >= vectors->size) {
+				ret -= vectors->size;
+				vectors->size = 0;
+				vectors++;
+				nvectors--;
+			} else {
+				vectors->buffer = (guint8 *)vectors->buffer + ret;
+				vectors->size -= ret;
+				ret = 0;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Write all 'data' of length 'datalen' bytes out to
+ * the wire
+ */
+static void vnc_connection_flush_wire(VncConnection *conn,
+				      const void *data,
+				      size_t datalen)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	const char *ptr = data;
+	size_t offset = 0;
+
+	/* There is nobody to send anything to during replay */
+	if (priv->replay_file)
+		return;
+
+	//VNC_DEBUG("Flush write %p %d", data, datalen);
+	while (offset < datalen) {
+		int ret;
+		gboolean blocking = FALSE;
+
+		if (priv->has_error) return;
+
+		priv->stats.write_syscalls++;
+		if (priv->tls_session) {
+			ret = gnutls_write(priv->tls_session,
+					   ptr+offset,
+					   datalen-offset);
+			if (ret < 0) {
+				if (ret == GNUTLS_E_AGAIN)
+					blocking = TRUE;
+				ret = -1;
+			}
+		} else {
+			GError *error = NULL;
+			ret = g_socket_send(priv->sock,
+					    ptr+offset,
+					    datalen-offset,
+					    NULL, &error);
+			if (ret < 0) {
+				if (error) {
 					if (error->code == G_IO_ERROR_WOULD_BLOCK)
 						blocking = TRUE;
 					g_error_free(error);
 				}
 				ret = -1;
+			} else {
+				priv->stats.wire_bytes_written += ret;
 			}
 		}
 		if (ret == -1) {
 			if (blocking) {
+				priv->stats.coroutine_switches++;
 				g_io_wait(priv->sock, G_IO_OUT);
 			} else {
 				VNC_DEBUG("Closing the connection: vnc_connection_flush %d", errno);
@@ -901,6 +1771,7 @@ static void vnc_connection_flush(VncConnection *conn)
 	else
 #endif
 		vnc_connection_flush_plain(conn);
+	priv->stats.bytes_written += priv->write_offset;
 	priv->write_offset = 0;
 }
 
@@ -917,11 +1788,27 @@ static void vnc_connection_write(VncConnection *conn, const void *data, size_t l
 	while (offset < len) {
 		ssize_t tmp;
 
-		if (priv->write_offset == sizeof(priv->write_buffer)) {
-			vnc_connection_flush(conn);
+		/* With no fixed size set, grow the buffer rather
+		 * than splitting large messages across syscalls */
+		if (priv->write_offset == priv->write_buffer_capacity) {
+			size_t want = priv->buffer_size;
+
+			if (!want) {
+				want = MAX(priv->write_buffer_capacity * 2,
+					   VNC_CONNECTION_BUFFER_MIN);
+				if (want > VNC_CONNECTION_BUFFER_MAX)
+					want = priv->write_buffer_capacity;
+			}
+
+			if (want > priv->write_buffer_capacity) {
+				priv->write_buffer = g_realloc(priv->write_buffer, want);
+				priv->write_buffer_capacity = want;
+			} else {
+				vnc_connection_flush(conn);
+			}
 		}
 
-		tmp = MIN(sizeof(priv->write_buffer), len - offset);
+		tmp = MIN(priv->write_buffer_capacity - priv->write_offset, len - offset);
 
 		memcpy(priv->write_buffer+priv->write_offset, ptr + offset, tmp);
 
@@ -950,6 +1837,7 @@ static ssize_t vnc_connection_tls_push(gnutls_transport_ptr_t transport,
 		}
 		return -1;
 	}
+	priv->stats.wire_bytes_written += ret;
 	return ret;
 }
 
@@ -973,6 +1861,7 @@ static ssize_t vnc_connection_tls_pull(gnutls_transport_ptr_t transport,
 		}
 		return -1;
 	}
+	priv->stats.wire_bytes_read += ret;
 	return ret;
 }
 
@@ -1445,6 +2334,13 @@ gboolean vnc_connection_set_pixel_format(VncConnection *conn,
 	VncConnectionPrivate *priv = conn->priv;
 	guint8 pad[3] = {0};
 
+	/* The recorded stream stays in whatever format it was
+	 * recorded in, which WMVi updates in it will announce */
+	if (priv->replay_filename) {
+		VNC_DEBUG("Ignoring pixel format change during replay");
+		return !vnc_connection_has_error(conn);
+	}
+
 	vnc_connection_buffered_write_u8(conn, 0);
 	vnc_connection_buffered_write(conn, pad, 3);
 
@@ -1462,19 +2358,55 @@ gboolean vnc_connection_set_pixel_format(VncConnection *conn,
 	vnc_connection_buffered_write_u8(conn, fmt->blue_shift);
 
 	vnc_connection_buffered_write(conn, pad, 3);
-	vnc_connection_buffered_flush(conn);
 
-	memcpy(&priv->fmt, fmt, sizeof(*fmt));
+	if (priv->has_fence) {
+		guint8 data = VNC_CONNECTION_FENCE_PIXEL_FORMAT;
+
+		/* Updates already in flight are still encoded in the old
+		 * format, so only switch once the server answers a fence
+		 * sent after the SetPixelFormat */
+		VNC_DEBUG("Deferring pixel format change until fence response");
+		memcpy(&priv->pending_fmt, fmt, sizeof(*fmt));
+		priv->has_pending_fmt = TRUE;
+
+		vnc_connection_buffered_write_u8(conn, 248);
+		vnc_connection_buffered_write(conn, pad, 3);
+		vnc_connection_buffered_write_u32(conn,
+						  VNC_CONNECTION_FENCE_BLOCK_BEFORE |
+						  VNC_CONNECTION_FENCE_REQUEST);
+		vnc_connection_buffered_write_u8(conn, 1);
+		vnc_connection_buffered_write(conn, &data, 1);
+	} else {
+		memcpy(&priv->fmt, fmt, sizeof(*fmt));
+	}
+
+	vnc_connection_buffered_flush(conn);
 
 	return !vnc_connection_has_error(conn);
 }
 
 
-gboolean vnc_connection_set_encodings(VncConnection *conn, int n_encoding, gint32 *encoding)
+static int vnc_connection_auto_index(gint32 encoding)
+{
+	int i;
+
+	for (i = 0; i < VNC_CONNECTION_AUTO_ENCODINGS; i++)
+		if (vnc_connection_auto_encodings[i].encoding == encoding)
+			return i;
+
+	return -1;
+}
+
+/*
+ * Send the client's encodings, moving the one picked by
+ * adaptive selection to the front of the list
+ */
+static void vnc_connection_write_encodings(VncConnection *conn)
 {
 	VncConnectionPrivate *priv = conn->priv;
 	guint8 pad[1] = {0};
 	int i, skip_zrle=0;
+	gint32 first = 0;
 
 	/*
 	 * RealVNC server is broken for ZRLE in some pixel formats.
@@ -1488,39 +2420,88 @@ gboolean vnc_connection_set_encodings(VncConnection *conn, int n_encoding, gint3
 	 *
 	 * So we kill off ZRLE encoding for problematic pixel formats
 	 */
-	for (i = 0; i < n_encoding; i++)
+	for (i = 0; i < priv->n_encodings; i++)
 		if (priv->fmt.depth == 32 &&
 		    (priv->fmt.red_max > 255 ||
 		     priv->fmt.blue_max > 255 ||
 		     priv->fmt.green_max > 255) &&
-		    encoding[i] == VNC_CONNECTION_ENCODING_ZRLE) {
+		    priv->encodings[i] == VNC_CONNECTION_ENCODING_ZRLE) {
 			VNC_DEBUG("Dropping ZRLE encoding for broken pixel format");
 			skip_zrle++;
 		}
 
-	priv->has_ext_key_event = FALSE;
+	if (priv->auto_encoding && priv->auto_probe != -1)
+		first = vnc_connection_auto_encodings[priv->auto_probe].encoding;
+	else if (priv->auto_encoding && priv->auto_current != -1)
+		first = vnc_connection_auto_encodings[priv->auto_current].encoding;
+	if (skip_zrle && first == VNC_CONNECTION_ENCODING_ZRLE)
+		first = 0;
+
 	vnc_connection_buffered_write_u8(conn, 2);
 	vnc_connection_buffered_write(conn, pad, 1);
-	vnc_connection_buffered_write_u16(conn, n_encoding - skip_zrle);
-	for (i = 0; i < n_encoding; i++) {
-		if (skip_zrle && encoding[i] == VNC_CONNECTION_ENCODING_ZRLE)
+	vnc_connection_buffered_write_u16(conn, priv->n_encodings - skip_zrle);
+	if (first)
+		vnc_connection_buffered_write_s32(conn, first);
+	for (i = 0; i < priv->n_encodings; i++) {
+		if (skip_zrle && priv->encodings[i] == VNC_CONNECTION_ENCODING_ZRLE)
+			continue;
+		if (first && priv->encodings[i] == first)
 			continue;
-		vnc_connection_buffered_write_s32(conn, encoding[i]);
+		vnc_connection_buffered_write_s32(conn, priv->encodings[i]);
 	}
 	vnc_connection_buffered_flush(conn);
-	return !vnc_connection_has_error(conn);
 }
 
-
-gboolean vnc_connection_framebuffer_update_request(VncConnection *conn,
-						   gboolean incremental,
-						   guint16 x, guint16 y,
-						   guint16 width, guint16 height)
+gboolean vnc_connection_set_encodings(VncConnection *conn, int n_encoding, gint32 *encoding)
 {
 	VncConnectionPrivate *priv = conn->priv;
+	int i;
 
-	VNC_DEBUG("Requesting framebuffer update at %d,%d size %dx%d, incremental %d",
-		  x, y, width, height, (int)incremental);
+	g_free(priv->encodings);
+	priv->encodings = g_new(gint32, n_encoding);
+	memcpy(priv->encodings, encoding, sizeof(gint32) * n_encoding);
+	priv->n_encodings = n_encoding;
+
+	priv->has_ext_key_event = FALSE;
+	priv->want_continuous_updates = FALSE;
+	priv->want_last_rect = FALSE;
+	priv->auto_current = -1;
+	for (i = 0; i < n_encoding; i++) {
+		if (encoding[i] == VNC_CONNECTION_ENCODING_CONTINUOUS_UPDATES)
+			priv->want_continuous_updates = TRUE;
+		if (encoding[i] == VNC_CONNECTION_ENCODING_LAST_RECT)
+			priv->want_last_rect = TRUE;
+		/* Adaptive selection starts from the client's preference */
+		if (priv->auto_current == -1)
+			priv->auto_current = vnc_connection_auto_index(encoding[i]);
+	}
+
+	vnc_connection_write_encodings(conn);
+
+	/* Follow the change of mind, unless still waiting on
+	 * the server to acknowledge an earlier one */
+	if (priv->has_continuous_updates) {
+		if (priv->want_continuous_updates &&
+		    priv->continuous_updates == VNC_CONNECTION_CONTINUOUS_OFF)
+			vnc_connection_enable_continuous_updates(conn, TRUE);
+		else if (!priv->want_continuous_updates &&
+			 priv->continuous_updates == VNC_CONNECTION_CONTINUOUS_ON)
+			vnc_connection_enable_continuous_updates(conn, FALSE);
+	}
+
+	return !vnc_connection_has_error(conn);
+}
+
+
+gboolean vnc_connection_framebuffer_update_request(VncConnection *conn,
+						   gboolean incremental,
+						   guint16 x, guint16 y,
+						   guint16 width, guint16 height)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	VNC_DEBUG("Requesting framebuffer update at %d,%d size %dx%d, incremental %d",
+		  x, y, width, height, (int)incremental);
 
 	priv->lastUpdateRequest.incremental = incremental;
 	priv->lastUpdateRequest.x = x;
@@ -1528,6 +2509,14 @@ gboolean vnc_connection_framebuffer_update_request(VncConnection *conn,
 	priv->lastUpdateRequest.width = width;
 	priv->lastUpdateRequest.height = height;
 
+	/* The server pushes changes unprompted, so there is no
+	 * point asking for them */
+	if (incremental && priv->continuous_updates == VNC_CONNECTION_CONTINUOUS_ON)
+		return !vnc_connection_has_error(conn);
+
+	if (!priv->update_request_time)
+		priv->update_request_time = vnc_connection_now();
+
 	vnc_connection_buffered_write_u8(conn, 3);
 	vnc_connection_buffered_write_u8(conn, incremental ? 1 : 0);
 	vnc_connection_buffered_write_u16(conn, x);
@@ -1722,18 +2711,6 @@ static vnc_connection_rich_cursor_blt_func *vnc_connection_rich_cursor_blt_table
 	vnc_connection_rich_cursor_blt_32x32,
 };
 
-static vnc_connection_tight_compute_predicted_func *vnc_connection_tight_compute_predicted_table[3] = {
-	(vnc_connection_tight_compute_predicted_func *)vnc_connection_tight_compute_predicted_8x8,
-	(vnc_connection_tight_compute_predicted_func *)vnc_connection_tight_compute_predicted_16x16,
-	(vnc_connection_tight_compute_predicted_func *)vnc_connection_tight_compute_predicted_32x32,
-};
-
-static vnc_connection_tight_sum_pixel_func *vnc_connection_tight_sum_pixel_table[3] = {
-	(vnc_connection_tight_sum_pixel_func *)vnc_connection_tight_sum_pixel_8x8,
-	(vnc_connection_tight_sum_pixel_func *)vnc_connection_tight_sum_pixel_16x16,
-	(vnc_connection_tight_sum_pixel_func *)vnc_connection_tight_sum_pixel_32x32,
-};
-
 
 static void vnc_connection_raw_update(VncConnection *conn,
 				      guint16 x, guint16 y,
@@ -1747,27 +2724,45 @@ static void vnc_connection_raw_update(VncConnection *conn,
 	   into the client framebuffer
 	*/
 	if (vnc_framebuffer_perfect_format_match(priv->fb)) {
+		GInputVector vectors[64];
 		int i;
 		int rowstride = vnc_framebuffer_get_rowstride(priv->fb);
+		int linesize = width * (priv->fmt.bits_per_pixel/8);
 		guint8 *dst = vnc_framebuffer_get_buffer(priv->fb);
 
 		dst += (y * rowstride) + (x * (priv->fmt.bits_per_pixel/8));
 
-		for (i = 0; i < height; i++) {
-			vnc_connection_read(conn, dst,
-					    width * (priv->fmt.bits_per_pixel/8));
-			dst += rowstride;
+		/* Receive a batch of rows at a time straight into the
+		 * framebuffer, merging rows which are contiguous */
+		for (i = 0; i < height; ) {
+			int nvectors = 0;
+
+			while (i < height && nvectors < (int)G_N_ELEMENTS(vectors)) {
+				if (nvectors &&
+				    (guint8 *)vectors[nvectors-1].buffer +
+				    vectors[nvectors-1].size == dst) {
+					vectors[nvectors-1].size += linesize;
+				} else {
+					vectors[nvectors].buffer = dst;
+					vectors[nvectors].size = linesize;
+					nvectors++;
+				}
+				dst += rowstride;
+				i++;
+			}
+
+			if (vnc_connection_readv(conn, vectors, nvectors) < 0)
+				return;
 		}
 	} else {
 		guint8 *dst;
 		int i;
 
-		dst = g_malloc(width * (priv->fmt.bits_per_pixel / 8));
+		dst = vnc_connection_scratch_alloc(conn, width * (priv->fmt.bits_per_pixel / 8));
 		for (i = 0; i < height; i++) {
 			vnc_connection_read(conn, dst, width * (priv->fmt.bits_per_pixel / 8));
 			vnc_framebuffer_blt(priv->fb, dst, 0, x, y + i, width, 1);
 		}
-		g_free(dst);
 	}
 }
 
@@ -1885,13 +2880,14 @@ static void vnc_connection_rre_update(VncConnection *conn,
 }
 
 /* CPIXELs are optimized slightly.  32-bit pixel values are packed into 24-bit
- * values. */
-static void vnc_connection_read_cpixel(VncConnection *conn, guint8 *pixel)
+ * values. Returns the number of bytes in a CPIXEL on the wire, and the offset
+ * within the full pixel at which those bytes belong */
+static int vnc_connection_cpixel_size(VncConnection *conn, int *offset)
 {
 	VncConnectionPrivate *priv = conn->priv;
 	int bpp = vnc_connection_pixel_size(conn);
 
-	memset(pixel, 0, bpp);
+	*offset = 0;
 
 	if (bpp == 4 && priv->fmt.true_color_flag) {
 		int fitsInMSB = ((priv->fmt.red_shift > 7) &&
@@ -1911,50 +2907,52 @@ static void vnc_connection_read_cpixel(VncConnection *conn, guint8 *pixel)
 			bpp = 3;
 			if (priv->fmt.depth == 24 &&
 			    priv->fmt.byte_order == G_BIG_ENDIAN)
-				pixel++;
+				*offset = 1;
 		}
 	}
 
-	vnc_connection_read(conn, pixel, bpp);
+	return bpp;
 }
 
-static void vnc_connection_zrle_update_tile_blit(VncConnection *conn,
-						 guint16 x, guint16 y,
-						 guint16 width, guint16 height)
+static void vnc_connection_read_cpixel(VncConnection *conn, guint8 *pixel)
 {
-	VncConnectionPrivate *priv = conn->priv;
-	guint8 blit_data[4 * 64 * 64];
-	int i, bpp;
+	int offset;
+	int bpp = vnc_connection_cpixel_size(conn, &offset);
 
-	bpp = vnc_connection_pixel_size(conn);
-
-	for (i = 0; i < width * height; i++)
-		vnc_connection_read_cpixel(conn, blit_data + (i * bpp));
+	memset(pixel, 0, vnc_connection_pixel_size(conn));
 
-	vnc_framebuffer_blt(priv->fb, blit_data, width * bpp, x, y, width, height);
+	vnc_connection_read(conn, pixel + offset, bpp);
 }
 
-static guint8 vnc_connection_read_zrle_pi(VncConnection *conn, int palette_size)
+static void vnc_connection_zrle_update_tile_blit(VncConnection *conn,
+						 guint16 x, guint16 y,
+						 guint16 width, guint16 height)
 {
 	VncConnectionPrivate *priv = conn->priv;
-	guint8 pi = 0;
+	guint8 blit_data[4 * 64 * 64];
+	int i, bpp, cbpp, offset;
 
-	if (priv->zrle_pi_bits == 0) {
-		priv->zrle_pi = vnc_connection_read_u8(conn);
-		priv->zrle_pi_bits = 8;
-	}
-	if ( palette_size == 2) {
-		pi = (priv->zrle_pi >> (priv->zrle_pi_bits - 1)) & 1;
-		priv->zrle_pi_bits -= 1;
-	} else if ((palette_size == 3) || (palette_size == 4)) {
-		pi = (priv->zrle_pi >> (priv->zrle_pi_bits - 2)) & 3;
-		priv->zrle_pi_bits -= 2;
-	} else if ((palette_size >=5) && (palette_size <=16)){
-		pi = (priv->zrle_pi >> (priv->zrle_pi_bits - 4)) & 15;
-		priv->zrle_pi_bits -= 4;
+	bpp = vnc_connection_pixel_size(conn);
+	cbpp = vnc_connection_cpixel_size(conn, &offset);
+
+	/* Pull the whole tile in with one read, so it can be
+	 * inflated straight into the staging area */
+	vnc_connection_read(conn, blit_data, width * height * cbpp);
+
+	/* Expand packed CPIXELs in place, working backwards
+	 * so nothing is overwritten before it is moved */
+	if (cbpp != bpp) {
+		for (i = (width * height) - 1; i >= 0; i--) {
+			guint8 *src = blit_data + (i * cbpp);
+			guint8 *dst = blit_data + (i * bpp);
+			guint8 tmp[4] = { 0, 0, 0, 0 };
+
+			memcpy(tmp + offset, src, cbpp);
+			memcpy(dst, tmp, bpp);
+		}
 	}
 
-	return pi;
+	vnc_framebuffer_blt(priv->fb, blit_data, width * bpp, x, y, width, height);
 }
 
 static void vnc_connection_zrle_update_tile_palette(VncConnection *conn,
@@ -1964,22 +2962,26 @@ static void vnc_connection_zrle_update_tile_palette(VncConnection *conn,
 {
 	VncConnectionPrivate *priv = conn->priv;
 	guint8 palette[128][4];
-	int i, j;
+	guint8 indexes[32 * 64];
+	int i, bits, rowbytes;
 
 	for (i = 0; i < palette_size; i++)
 		vnc_connection_read_cpixel(conn, palette[i]);
 
-	for (j = 0; j < height; j++) {
-		/* discard any padding bits */
-		priv->zrle_pi_bits = 0;
+	if (palette_size == 2)
+		bits = 1;
+	else if (palette_size <= 4)
+		bits = 2;
+	else
+		bits = 4;
 
-		for (i = 0; i < width; i++) {
-			int ind = vnc_connection_read_zrle_pi(conn, palette_size);
+	/* Each row of packed indexes is padded to a whole byte */
+	rowbytes = ((width * bits) + 7) / 8;
+	vnc_connection_read(conn, indexes, rowbytes * height);
 
-			vnc_framebuffer_set_pixel_at(priv->fb, palette[ind & 0x7F],
-						     x + i, y + j);
-		}
-	}
+	vnc_framebuffer_blt_indexed(priv->fb, palette[0], palette_size,
+				    indexes, bits, rowbytes,
+				    x, y, width, height);
 }
 
 static int vnc_connection_read_zrle_rl(VncConnection *conn)
@@ -2000,19 +3002,23 @@ static void vnc_connection_zrle_update_tile_rle(VncConnection *conn,
 						guint16 width, guint16 height)
 {
 	VncConnectionPrivate *priv = conn->priv;
-	int i, j, rl = 0;
+	guint8 blit_data[4 * 64 * 64];
+	int i, bpp, rl = 0;
 	guint8 pixel[4];
 
-	for (j = 0; j < height; j++) {
-		for (i = 0; i < width; i++) {
-			if (rl == 0) {
-				vnc_connection_read_cpixel(conn, pixel);
-				rl = vnc_connection_read_zrle_rl(conn);
-			}
-			vnc_framebuffer_set_pixel_at(priv->fb, pixel, x + i, y + j);
-			rl -= 1;
+	/* Runs wrap from one row to the next, so expand them
+	 * into the whole tile and draw it in one go */
+	bpp = vnc_connection_pixel_size(conn);
+	for (i = 0; i < (width * height); i++) {
+		if (rl == 0) {
+			vnc_connection_read_cpixel(conn, pixel);
+			rl = vnc_connection_read_zrle_rl(conn);
 		}
+		memcpy(blit_data + (i * bpp), pixel, bpp);
+		rl -= 1;
 	}
+
+	vnc_framebuffer_blt(priv->fb, blit_data, width * bpp, x, y, width, height);
 }
 
 static void vnc_connection_zrle_update_tile_prle(VncConnection *conn,
@@ -2021,28 +3027,31 @@ static void vnc_connection_zrle_update_tile_prle(VncConnection *conn,
 						 guint16 width, guint16 height)
 {
 	VncConnectionPrivate *priv = conn->priv;
-	int i, j, rl = 0;
+	int i, rl = 0;
 	guint8 palette[128][4];
+	guint8 indexes[64 * 64];
 	guint8 pi = 0;
 
 	for (i = 0; i < palette_size; i++)
 		vnc_connection_read_cpixel(conn, palette[i]);
 
-	for (j = 0; j < height; j++) {
-		for (i = 0; i < width; i++) {
-			if (rl == 0) {
-				pi = vnc_connection_read_u8(conn);
-				if (pi & 0x80) {
-					rl = vnc_connection_read_zrle_rl(conn);
-					pi &= 0x7F;
-				} else
-					rl = 1;
-			}
-
-			vnc_framebuffer_set_pixel_at(priv->fb, palette[pi], x + i, y + j);
-			rl -= 1;
+	for (i = 0; i < (width * height); i++) {
+		if (rl == 0) {
+			pi = vnc_connection_read_u8(conn);
+			if (pi & 0x80) {
+				rl = vnc_connection_read_zrle_rl(conn);
+				pi &= 0x7F;
+			} else
+				rl = 1;
 		}
+
+		indexes[i] = pi;
+		rl -= 1;
 	}
+
+	vnc_framebuffer_blt_indexed(priv->fb, palette[0], palette_size,
+				    indexes, 8, width,
+				    x, y, width, height);
 }
 
 static void vnc_connection_zrle_update_tile(VncConnection *conn, guint16 x, guint16 y,
@@ -2083,21 +3092,13 @@ static void vnc_connection_zrle_update(VncConnection *conn,
 {
 	VncConnectionPrivate *priv = conn->priv;
 	guint32 length;
-	guint32 offset;
 	guint16 i, j;
-	guint8 *zlib_data;
 
 	length = vnc_connection_read_u32(conn);
-	zlib_data = g_malloc(length);
-	vnc_connection_read(conn, zlib_data, length);
 
-	/* setup subsequent calls to vnc_connection_read*() to use the compressed data */
-	priv->uncompressed_length = 0;
-	priv->compressed_length = length;
-	priv->compressed_buffer = zlib_data;
-	priv->strm = &priv->streams[0];
+	/* tiles are decoded as the compressed data arrives */
+	vnc_connection_zstart(conn, &priv->streams[0], length);
 
-	offset = 0;
 	for (j = 0; j < height; j += 64) {
 		for (i = 0; i < width; i += 64) {
 			guint16 w, h;
@@ -2108,12 +3109,7 @@ static void vnc_connection_zrle_update(VncConnection *conn,
 		}
 	}
 
-	priv->strm = NULL;
-	priv->uncompressed_length = 0;
-	priv->compressed_length = 0;
-	priv->compressed_buffer = NULL;
-
-	g_free(zlib_data);
+	vnc_connection_zfinish(conn);
 }
 
 static guint32 vnc_connection_read_cint(VncConnection *conn)
@@ -2146,6 +3142,226 @@ static int vnc_connection_tpixel_size(VncConnection *conn)
 	return priv->fmt.bits_per_pixel / 8;
 }
 
+/*
+ * Depth 24 tpixels are sent as just the R, G and B bytes. When each
+ * channel shift is a whole number of bytes, expanding them to a full
+ * pixel is only a byte shuffle, so work out where each byte of the
+ * pixel comes from, or -1 for zero.
+ */
+static gboolean vnc_connection_tpixel_layout(const VncPixelFormat *fmt, gint8 *pos)
+{
+	int shifts[3] = { fmt->red_shift, fmt->green_shift, fmt->blue_shift };
+	int c, m;
+
+	for (m = 0; m < 4; m++)
+		pos[m] = -1;
+
+	for (c = 0; c < 3; c++) {
+		guint32 val;
+		guint8 bytes[4];
+
+		if (shifts[c] % 8 || shifts[c] > 24)
+			return FALSE;
+
+		val = 0xffU << shifts[c];
+		if (fmt->byte_order != G_BYTE_ORDER)
+			val = GUINT32_SWAP_LE_BE(val);
+		memcpy(bytes, &val, 4);
+
+		for (m = 0; m < 4; m++) {
+			if (!bytes[m])
+				continue;
+			if (pos[m] != -1)
+				return FALSE;
+			pos[m] = c;
+		}
+	}
+
+	return TRUE;
+}
+
+static void vnc_connection_tpixel_expand_bytes(const gint8 *pos,
+					       guint8 *dst,
+					       const guint8 *src,
+					       int n)
+{
+	int i, m;
+
+	for (i = 0; i < n; i++) {
+		for (m = 0; m < 4; m++)
+			dst[m] = pos[m] < 0 ? 0 : src[pos[m]];
+		dst += 4;
+		src += 3;
+	}
+}
+
+#include "vncconnectionsimd.h"
+
+/*
+ * Expands n packed depth 24 tpixels to full remote pixels, for
+ * layouts vnc_connection_tpixel_layout() can't express as bytes
+ */
+static void vnc_connection_tpixel_expand(const VncPixelFormat *fmt,
+					 guint8 *dst,
+					 const guint8 *src,
+					 int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		guint32 val = (src[0] << fmt->red_shift)
+			| (src[1] << fmt->green_shift)
+			| (src[2] << fmt->blue_shift);
+
+		if (fmt->byte_order != G_BYTE_ORDER)
+			val = GUINT32_SWAP_LE_BE(val);
+		memcpy(dst, &val, 4);
+		dst += 4;
+		src += 3;
+	}
+}
+
+/*
+ * The Tight gradient filter works on rows of unpacked components,
+ * four 16-bit lanes per pixel with the last always zero, so the
+ * predictor never has to unpack and repack its neighbours.
+ */
+static void vnc_connection_tpixel_unpack(const VncPixelFormat *fmt,
+					 guint16 *dst,
+					 const guint8 *src,
+					 int n)
+{
+	gboolean swap = fmt->byte_order != G_BYTE_ORDER;
+	guint16 pix16;
+	guint32 pix;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (fmt->depth == 24) {
+			dst[0] = src[0] & fmt->red_max;
+			dst[1] = src[1] & fmt->green_max;
+			dst[2] = src[2] & fmt->blue_max;
+			dst[3] = 0;
+			dst += 4;
+			src += 3;
+			continue;
+		}
+
+		switch (fmt->bits_per_pixel) {
+		case 8:
+			pix = src[0];
+			break;
+		case 16:
+			memcpy(&pix16, src, 2);
+			pix = swap ? GUINT16_SWAP_LE_BE(pix16) : pix16;
+			break;
+		default:
+			memcpy(&pix, src, 4);
+			if (swap)
+				pix = GUINT32_SWAP_LE_BE(pix);
+			break;
+		}
+
+		dst[0] = (pix >> fmt->red_shift) & fmt->red_max;
+		dst[1] = (pix >> fmt->green_shift) & fmt->green_max;
+		dst[2] = (pix >> fmt->blue_shift) & fmt->blue_max;
+		dst[3] = 0;
+		dst += 4;
+		src += fmt->bits_per_pixel / 8;
+	}
+}
+
+static void vnc_connection_tpixel_pack(const VncPixelFormat *fmt,
+				       guint8 *dst,
+				       const guint16 *src,
+				       int n)
+{
+	gboolean swap = fmt->byte_order != G_BYTE_ORDER;
+	int bpp = fmt->bits_per_pixel / 8;
+	gint8 pos[4];
+	guint16 pix16;
+	guint32 pix;
+	int i, m;
+
+	/* Byte aligned 32-bit layouts need no shifting at all */
+	if (bpp == 4 && vnc_connection_tpixel_layout(fmt, pos)) {
+		for (i = 0; i < n; i++) {
+			for (m = 0; m < 4; m++)
+				dst[m] = pos[m] < 0 ? 0 : src[pos[m]];
+			dst += 4;
+			src += 4;
+		}
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		pix = (src[0] << fmt->red_shift) |
+			(src[1] << fmt->green_shift) |
+			(src[2] << fmt->blue_shift);
+
+		switch (bpp) {
+		case 1:
+			dst[0] = pix;
+			break;
+		case 2:
+			pix16 = pix;
+			if (swap)
+				pix16 = GUINT16_SWAP_LE_BE(pix16);
+			memcpy(dst, &pix16, 2);
+			break;
+		default:
+			if (swap)
+				pix = GUINT32_SWAP_LE_BE(pix);
+			memcpy(dst, &pix, 4);
+			break;
+		}
+		dst += bpp;
+		src += 4;
+	}
+}
+
+static void vnc_connection_gradient_predict(const guint16 *max,
+					    const guint16 *prev,
+					    guint16 *cur,
+					    const guint16 *diff,
+					    int n)
+{
+	int i, c;
+
+	for (i = 0; i < n; i++) {
+		for (c = 0; c < 3; c++) {
+			int predicted = cur[(i * 4) + c]
+				+ prev[((i + 1) * 4) + c]
+				- prev[(i * 4) + c];
+
+			predicted = CLAMP(predicted, 0, max[c]);
+			cur[((i + 1) * 4) + c] = (predicted + diff[(i * 4) + c]) & max[c];
+		}
+	}
+}
+
+/*
+ * Decodes one row of the Tight gradient filter. prev and cur hold
+ * (width + 1) pixels of components, the first of which must stay
+ * zero so the left hand edge predicts from nothing. diff is scratch
+ * space for width pixels. On return cur holds the new row.
+ */
+static void vnc_connection_gradient_row(const VncPixelFormat *fmt,
+					vnc_connection_gradient_predict_func *predict,
+					const guint16 *prev,
+					guint16 *cur,
+					guint16 *diff,
+					guint8 *dst,
+					const guint8 *src,
+					int width)
+{
+	guint16 max[3] = { fmt->red_max, fmt->green_max, fmt->blue_max };
+
+	vnc_connection_tpixel_unpack(fmt, diff, src, width);
+	predict(max, prev, cur, diff, width);
+	vnc_connection_tpixel_pack(fmt, dst, cur + 4, width);
+}
+
 static void vnc_connection_read_tpixel(VncConnection *conn, guint8 *pixel)
 {
 	VncConnectionPrivate *priv = conn->priv;
@@ -2168,127 +3384,186 @@ static void vnc_connection_read_tpixel(VncConnection *conn, guint8 *pixel)
 		vnc_connection_read_pixel(conn, pixel);
 }
 
-static void vnc_connection_tight_update_copy(VncConnection *conn,
-					     guint16 x, guint16 y,
-					     guint16 width, guint16 height)
+/*
+ * The state of a Tight basic rect's filter. The copy and gradient
+ * filters decode a row at a time into remote pixels, while palette
+ * indexes go straight to vnc_framebuffer_blt_indexed. Both the
+ * inline and the threaded decoders go through these.
+ */
+struct vnc_tight_filter
 {
-	VncConnectionPrivate *priv = conn->priv;
-	guint8 pixel[4];
-	int i, j;
+	VncPixelFormat fmt;
+	guint16 width;
 
-	for (j = 0; j < height; j++) {
-		for (i = 0; i < width; i++) {
-			vnc_connection_read_tpixel(conn, pixel);
-			vnc_framebuffer_set_pixel_at(priv->fb, pixel, x + i, y + j);
-		}
-	}
-}
+	guint8 id;
+	int palette_size;
+	guint8 palette[256][4];
 
-static int vnc_connection_tight_get_pi(VncConnection *conn, guint8 *ra,
-				       int i, guint8 palette_size)
-{
-	if (palette_size == 2) {
-		if ((i % 8) == 0)
-			*ra = vnc_connection_read_u8(conn);
-		return (*ra >> (7 - (i % 8))) & 1;
-	}
+	/* Kernels for this rect's format. expand is NULL when the
+	 * components aren't whole bytes, pos says where they go */
+	vnc_connection_tpixel_expand_func *expand;
+	gint8 pos[4];
+	vnc_connection_gradient_predict_func *predict;
 
-	return vnc_connection_read_u8(conn);
-}
+	/* Bytes of filter input per row */
+	int rowbytes;
 
-static void vnc_connection_tight_update_palette(VncConnection *conn,
-						int palette_size, guint8 *palette,
-						guint16 x, guint16 y,
-						guint16 width, guint16 height)
-{
-	VncConnectionPrivate *priv = conn->priv;
-	int i, j;
+	/* Gradient filter components of the previous and current
+	 * rows, and space for a row of differences */
+	guint16 *prev, *cur, *diff;
+};
 
-	for (j = 0; j < height; j++) {
-		guint8 ra = 0;
+/* Number of guint16 the gradient filter keeps for a row */
+#define VNC_TIGHT_FILTER_ROWS(width) ((((width) + 1) * 4 * 2) + ((width) * 4))
 
-		for (i = 0; i < width; i++) {
-			guint8 ind;
+static gboolean vnc_connection_tight_read_filter(VncConnection *conn,
+						 guint8 ccontrol,
+						 guint16 width,
+						 struct vnc_tight_filter *filter)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	int i;
 
-			ind = vnc_connection_tight_get_pi(conn, &ra, i, palette_size);
-			vnc_framebuffer_set_pixel_at(priv->fb, &palette[ind * 4], x + i, y + j);
-		}
+	filter->fmt = priv->fmt;
+	filter->width = width;
+	filter->id = 0;
+	filter->palette_size = 0;
+
+	filter->expand = NULL;
+	if (priv->fmt.depth == 24 &&
+	    vnc_connection_tpixel_layout(&priv->fmt, filter->pos))
+		filter->expand = priv->tpixel_expand;
+
+	/* The vector predictors work in signed 16-bit lanes */
+	filter->predict = priv->gradient_predict;
+	if (priv->fmt.red_max >= 0x4000 ||
+	    priv->fmt.green_max >= 0x4000 ||
+	    priv->fmt.blue_max >= 0x4000)
+		filter->predict = vnc_connection_gradient_predict;
+
+	if (ccontrol & 0x04)
+		filter->id = vnc_connection_read_u8(conn);
+
+	switch (filter->id) {
+	case 0: /* copy */
+	case 2: /* gradient */
+		filter->rowbytes = width * vnc_connection_tpixel_size(conn);
+		break;
+	case 1: /* palette */
+		filter->palette_size = vnc_connection_read_u8(conn);
+		filter->palette_size += 1;
+		for (i = 0; i < filter->palette_size; i++)
+			vnc_connection_read_tpixel(conn, filter->palette[i]);
+
+		/* Two colour palettes pack 8 indexes per byte, padding
+		 * each row to a whole byte */
+		if (filter->palette_size == 2)
+			filter->rowbytes = (width + 7) / 8;
+		else
+			filter->rowbytes = width;
+		break;
+	default: /* error */
+		VNC_DEBUG("Closing the connection: vnc_connection_tight_read_filter() - filter_id unknown");
+		priv->has_error = TRUE;
+		return FALSE;
 	}
+
+	return !vnc_connection_has_error(conn);
 }
 
-static void vnc_connection_tight_compute_predicted(VncConnection *conn, guint8 *ppixel,
-						   guint8 *lp, guint8 *cp,
-						   guint8 *llp)
+/* rows must hold VNC_TIGHT_FILTER_ROWS(width) for the gradient filter */
+static void vnc_tight_filter_start(struct vnc_tight_filter *filter, guint16 *rows)
 {
-	VncConnectionPrivate *priv = conn->priv;
+	filter->prev = rows;
+	filter->cur = rows + ((filter->width + 1) * 4);
+	filter->diff = filter->cur + ((filter->width + 1) * 4);
 
-	priv->tight_compute_predicted(conn, ppixel, lp, cp, llp);
+	/* Both rows start with a zero pixel so the left hand
+	 * edge reads as zero, and the first row sees zero above */
+	memset(rows, 0, (filter->width + 1) * 4 * 2 * sizeof(guint16));
 }
 
-static void vnc_connection_tight_sum_pixel(VncConnection *conn,
-					   guint8 *lhs, guint8 *rhs)
-{
-	VncConnectionPrivate *priv = conn->priv;
+/*
+ * Decodes one row of copy or gradient filter input to remote
+ * pixels. The copy filter allows dst to be src.
+ */
+static void vnc_tight_filter_row(struct vnc_tight_filter *filter,
+				 guint8 *dst, const guint8 *src)
+{
+	guint16 *tmp;
+
+	if (filter->id == 0) {
+		if (filter->expand)
+			filter->expand(filter->pos, dst, src, filter->width);
+		else if (filter->fmt.depth == 24)
+			vnc_connection_tpixel_expand(&filter->fmt, dst, src, filter->width);
+		else if (dst != src)
+			memcpy(dst, src, filter->rowbytes);
+		return;
+	}
+
+	vnc_connection_gradient_row(&filter->fmt, filter->predict,
+				    filter->prev, filter->cur, filter->diff,
+				    dst, src, filter->width);
 
-	priv->tight_sum_pixel(conn, lhs, rhs);
+	tmp = filter->prev;
+	filter->prev = filter->cur;
+	filter->cur = tmp;
 }
 
-static void vnc_connection_tight_update_gradient(VncConnection *conn,
-						 guint16 x, guint16 y,
-						 guint16 width, guint16 height)
+/* Palette indexes are read this many bytes at a time at most */
+#define VNC_CONNECTION_TIGHT_BAND_BYTES 65536
+
+/*
+ * Decode a basic rect's filter input as it is read, inflating
+ * it on the way if the caller has started a zlib stream
+ */
+static void vnc_connection_tight_update_basic(VncConnection *conn,
+					      struct vnc_tight_filter *filter,
+					      guint16 x, guint16 y,
+					      guint16 width, guint16 height)
 {
-	int i, j;
-	guint8 zero_pixel[4];
-	guint8 *last_row, *row;
-	int bpp;
 	VncConnectionPrivate *priv = conn->priv;
+	guint8 *row, *packed;
+	int j, bpp;
 
-	bpp = vnc_connection_pixel_size(conn);
-	last_row = g_malloc(width * bpp);
-	row = g_malloc(width * bpp);
-
-	memset(last_row, 0, width * bpp);
-	memset(zero_pixel, 0, 4);
+	if (filter->id == 1) {
+		int band = MAX(1, VNC_CONNECTION_TIGHT_BAND_BYTES / filter->rowbytes);
+		guint8 *indexes;
 
-	for (j = 0; j < height; j++) {
-		guint8 *tmp_row;
-		guint8 *llp, *lp;
-
-		/* use zero pixels for the edge cases */
-		llp = zero_pixel;
-		lp = zero_pixel;
+		band = MIN(band, height);
+		indexes = vnc_connection_scratch_alloc(conn, band * filter->rowbytes);
 
-		for (i = 0; i < width; i++) {
-			guint8 predicted_pixel[4];
+		for (j = 0; j < height; j += band) {
+			int n = MIN(band, height - j);
 
-			/* compute predicted pixel value */
-			vnc_connection_tight_compute_predicted(conn, predicted_pixel,
-							       lp, last_row + i * bpp,
-							       llp);
-
-			/* read the difference pixel from the wire */
-			vnc_connection_read_tpixel(conn, row + i * bpp);
+			vnc_connection_read(conn, indexes, n * filter->rowbytes);
+			vnc_framebuffer_blt_indexed(priv->fb, (guint8 *)filter->palette,
+						    filter->palette_size, indexes,
+						    filter->palette_size == 2 ? 1 : 8,
+						    filter->rowbytes,
+						    x, y + j, width, n);
+		}
+		return;
+	}
 
-			/* sum the predicted pixel and the difference to get
-			 * the original pixel value */
-			vnc_connection_tight_sum_pixel(conn, row + i * bpp,
-						       predicted_pixel);
+	bpp = vnc_connection_pixel_size(conn);
+	row = vnc_connection_scratch_alloc(conn, width * bpp);
+	if (filter->rowbytes == width * bpp)
+		packed = row;
+	else
+		packed = vnc_connection_scratch_alloc(conn, filter->rowbytes);
 
-			llp = last_row + i * bpp;
-			lp = row + i * bpp;
-		}
+	if (filter->id == 2)
+		vnc_tight_filter_start(filter,
+				       vnc_connection_scratch_alloc(conn, VNC_TIGHT_FILTER_ROWS(width) *
+								    sizeof(guint16)));
 
-		/* write out row of pixel data */
+	for (j = 0; j < height; j++) {
+		vnc_connection_read(conn, packed, filter->rowbytes);
+		vnc_tight_filter_row(filter, row, packed);
 		vnc_framebuffer_blt(priv->fb, row, width * bpp, x, y + j, width, 1);
-
-		/* swap last row and current row */
-		tmp_row = last_row;
-		last_row = row;
-		row = tmp_row;
 	}
-
-	g_free(row);
-	g_free(last_row);
 }
 
 
@@ -2321,117 +3596,108 @@ static void vnc_connection_tight_update_jpeg(VncConnection *conn, guint16 x, gui
 	g_object_unref(p);
 }
 
-static void vnc_connection_tight_update(VncConnection *conn,
-					guint16 x, guint16 y,
-					guint16 width, guint16 height)
+/*
+ * Try to grow 'r' to cover the area x,y,width,height as well,
+ * which is only possible if the union is still a rectangle
+ */
+static gboolean vnc_connection_rect_merge(VncConnectionRect *r,
+					  int x, int y, int width, int height)
 {
-	VncConnectionPrivate *priv = conn->priv;
-	guint8 ccontrol;
-	guint8 pixel[4];
-	int i;
+	if (x >= r->x && y >= r->y &&
+	    (x + width) <= (r->x + r->width) &&
+	    (y + height) <= (r->y + r->height))
+		return TRUE;
 
-	ccontrol = vnc_connection_read_u8(conn);
+	/* Horizontally adjacent, spanning the same rows */
+	if (y == r->y && height == r->height &&
+	    x <= (r->x + r->width) && (x + width) >= r->x) {
+		int right = MAX(x + width, r->x + r->width);
+		r->x = MIN(x, r->x);
+		r->width = right - r->x;
+		return TRUE;
+	}
 
-	for (i = 0; i < 4; i++) {
-		if (ccontrol & (1 << i)) {
-			inflateEnd(&priv->streams[i + 1]);
-			inflateInit(&priv->streams[i + 1]);
-		}
+	/* Vertically adjacent, spanning the same columns */
+	if (x == r->x && width == r->width &&
+	    y <= (r->y + r->height) && (y + height) >= r->y) {
+		int bottom = MAX(y + height, r->y + r->height);
+		r->y = MIN(y, r->y);
+		r->height = bottom - r->y;
+		return TRUE;
 	}
 
-	ccontrol >>= 4;
-	ccontrol &= 0x0F;
+	return FALSE;
+}
 
-	if (ccontrol <= 7) {
-		/* basic */
-		guint8 filter_id = 0;
-		guint32 data_size, zlib_length;
-		guint8 *zlib_data = NULL;
-		guint8 palette[256][4];
-		int palette_size = 0;
-
-		if (ccontrol & 0x04)
-			filter_id = vnc_connection_read_u8(conn);
-
-		priv->strm = &priv->streams[(ccontrol & 0x03) + 1];
-
-		if (filter_id == 1) {
-			palette_size = vnc_connection_read_u8(conn);
-			palette_size += 1;
-			for (i = 0; i < palette_size; i++)
-				vnc_connection_read_tpixel(conn, palette[i]);
-		}
+static void vnc_connection_update(VncConnection *conn, int x, int y, int width, int height)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	VncConnectionRect rect;
 
-		if (filter_id == 1) {
-			if (palette_size == 2)
-				data_size = ((width + 7) / 8) * height;
-			else
-				data_size = width * height;
-		} else
-			data_size = width * height * vnc_connection_tpixel_size(conn);
+	if (priv->has_error)
+		return;
 
-		if (data_size >= 12) {
-			zlib_length = vnc_connection_read_cint(conn);
-			zlib_data = g_malloc(zlib_length);
+	VNC_DEBUG("Notify update area (%dx%d) at location %d,%d", width, height, x, y);
 
-			vnc_connection_read(conn, zlib_data, zlib_length);
+	/* Per-rect notification costs a main loop iteration each,
+	 * so is only done for clients still listening for it */
+	if (VNC_CONNECTION_GET_CLASS(conn)->vnc_framebuffer_update ||
+	    g_signal_has_handler_pending(conn, signals[VNC_FRAMEBUFFER_UPDATE], 0, FALSE)) {
+		struct signal_data sigdata;
 
-			priv->uncompressed_length = 0;
-			priv->compressed_length = zlib_length;
-			priv->compressed_buffer = zlib_data;
-		}
+		sigdata.params.area.x = x;
+		sigdata.params.area.y = y;
+		sigdata.params.area.width = width;
+		sigdata.params.area.height = height;
+		vnc_connection_emit_main_context(conn, VNC_FRAMEBUFFER_UPDATE, &sigdata);
+	}
 
-		switch (filter_id) {
-		case 0: /* copy */
-			vnc_connection_tight_update_copy(conn, x, y, width, height);
-			break;
-		case 1: /* palette */
-			vnc_connection_tight_update_palette(conn, palette_size,
-							    (guint8 *)palette,
-							    x, y, width, height);
-			break;
-		case 2: /* gradient */
-			vnc_connection_tight_update_gradient(conn, x, y, width, height);
-			break;
-		default: /* error */
-			VNC_DEBUG("Closing the connection: vnc_connection_tight_update() - filter_id unknown");
-			priv->has_error = TRUE;
-			break;
-		}
+	if (!priv->damage)
+		priv->damage = g_array_new(FALSE, FALSE, sizeof(VncConnectionRect));
 
-		if (data_size >= 12) {
-			priv->uncompressed_length = 0;
-			priv->compressed_length = 0;
-			priv->compressed_buffer = NULL;
+	/* Servers typically send rects in scanline order, so
+	 * neighbours are usually adjacent in the array too */
+	if (priv->damage->len &&
+	    vnc_connection_rect_merge(&g_array_index(priv->damage, VncConnectionRect,
+						     priv->damage->len - 1),
+				      x, y, width, height))
+		return;
 
-			g_free(zlib_data);
-		}
+	rect.x = x;
+	rect.y = y;
+	rect.width = width;
+	rect.height = height;
+	g_array_append_val(priv->damage, rect);
+}
 
-		priv->strm = NULL;
-	} else if (ccontrol == 8) {
-		/* fill */
-		/* FIXME check each width; endianness */
-		vnc_connection_read_tpixel(conn, pixel);
-		vnc_framebuffer_fill(priv->fb, pixel, x, y, width, height);
-	} else if (ccontrol == 9) {
-		/* jpeg */
-		guint32 length;
-		guint8 *jpeg_data;
+/*
+ * Deliver all damage accumulated since the last flush
+ * in a single signal emission
+ */
+static void vnc_connection_update_flush(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	struct signal_data sigdata;
 
-		length = vnc_connection_read_cint(conn);
-		jpeg_data = g_malloc(length);
-		vnc_connection_read(conn, jpeg_data, length);
-		vnc_connection_tight_update_jpeg(conn, x, y, width, height,
-						 jpeg_data, length);
-		g_free(jpeg_data);
-	} else {
-		/* error */
-		VNC_DEBUG("Closing the connection: vnc_connection_tight_update() - ccontrol unknown");
-		priv->has_error = TRUE;
+	if (!priv->damage || !priv->damage->len)
+		return;
+
+	if (!priv->has_error) {
+		VNC_DEBUG("Notify update region of %u rects", priv->damage->len);
+
+		sigdata.params.region.rects = (const VncConnectionRect *)priv->damage->data;
+		sigdata.params.region.nrects = priv->damage->len;
+		vnc_connection_emit_main_context(conn, VNC_FRAMEBUFFER_UPDATE_REGION, &sigdata);
 	}
+
+	g_array_set_size(priv->damage, 0);
 }
 
-static void vnc_connection_update(VncConnection *conn, int x, int y, int width, int height)
+/*
+ * Tell clients a whole FramebufferUpdate has been processed,
+ * so they know when to request the next one
+ */
+static void vnc_connection_update_complete(VncConnection *conn)
 {
 	VncConnectionPrivate *priv = conn->priv;
 	struct signal_data sigdata;
@@ -2439,15 +3705,470 @@ static void vnc_connection_update(VncConnection *conn, int x, int y, int width,
 	if (priv->has_error)
 		return;
 
-	VNC_DEBUG("Notify update area (%dx%d) at location %d,%d", width, height, x, y);
+	vnc_connection_emit_main_context(conn, VNC_FRAMEBUFFER_UPDATE_COMPLETE, &sigdata);
+}
+
 
-	sigdata.params.area.x = x;
-	sigdata.params.area.y = y;
-	sigdata.params.area.width = width;
-	sigdata.params.area.height = height;
-	vnc_connection_emit_main_context(conn, VNC_FRAMEBUFFER_UPDATE, &sigdata);
+/*
+ * Threaded Tight decoding.
+ *
+ * The coroutine reads each rect's payload off the wire and
+ * queues it as a job. Jobs using zlib stream N run on a pool
+ * with a single thread dedicated to that stream, so each
+ * stream's data is inflated in order, while JPEG and raw
+ * rects, which have no dependencies, share a general pool.
+ *
+ * Workers run the same filters as the inline decoder, see
+ * struct vnc_tight_filter.
+ *
+ * Completed jobs are blitted to the framebuffer and signalled
+ * by the coroutine strictly in protocol order. Workers only
+ * ever touch their own job and the z_stream it names.
+ */
+
+/* Bounds on the rects, and the memory they hold, decoded
+ * ahead of the blitter. Rects too big to buffer are decoded
+ * inline, as their data arrives */
+#define VNC_CONNECTION_TIGHT_JOBS_MAX 64
+#define VNC_CONNECTION_TIGHT_BYTES_MAX (16 * 1024 * 1024)
+#define VNC_CONNECTION_TIGHT_JOB_BYTES_MAX (4 * 1024 * 1024)
+
+#define VNC_TIGHT_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+enum {
+	VNC_TIGHT_JOB_RESET,
+	VNC_TIGHT_JOB_BASIC,
+	VNC_TIGHT_JOB_FILL,
+	VNC_TIGHT_JOB_JPEG,
+};
+
+struct vnc_tight_job
+{
+	int type;
+	volatile gint done;
+	gboolean failed;
+
+	guint16 x, y, width, height;
+
+	/* The zlib stream for the payload, or NULL if uncompressed */
+	z_stream *strm;
+	gint64 inflate_time;
+
+	/* Filter of a basic rect, or just the pixel of a fill */
+	struct vnc_tight_filter filter;
+
+	/* One allocation holding all of the below, of 'bytes' size */
+	guint8 *buffer;
+	size_t bytes;
+
+	guint8 *payload;
+	size_t payload_length;
+
+	/* Filter input, and its decoded output in remote pixel format */
+	guint8 *data;
+	size_t data_size;
+	guint8 *pixels;
+	guint16 *rows;
+
+	GdkPixbuf *pixbuf;
+};
+
+static gboolean vnc_tight_job_inflate(struct vnc_tight_job *job)
+{
+	guint8 discard[64];
+	gint64 start = vnc_connection_now();
+
+	job->strm->next_in = job->payload;
+	job->strm->avail_in = job->payload_length;
+	job->strm->next_out = job->data;
+	job->strm->avail_out = job->data_size;
+
+	while (job->strm->avail_out) {
+		if (inflate(job->strm, Z_SYNC_FLUSH) != Z_OK)
+			return FALSE;
+	}
+
+	/* Keep the stream in step by consuming trailing input,
+	 * typically the sync flush marker */
+	while (job->strm->avail_in) {
+		job->strm->next_out = discard;
+		job->strm->avail_out = sizeof(discard);
+		if (inflate(job->strm, Z_SYNC_FLUSH) != Z_OK)
+			return FALSE;
+	}
+
+	job->inflate_time = vnc_connection_now() - start;
+	return TRUE;
+}
+
+/* Palette rects are left as indexes for the coroutine to blit */
+static void vnc_tight_job_filter(struct vnc_tight_job *job)
+{
+	int bpp = job->filter.fmt.bits_per_pixel / 8;
+	int j;
+
+	if (job->filter.id == 2)
+		vnc_tight_filter_start(&job->filter, job->rows);
+
+	for (j = 0; j < job->height; j++)
+		vnc_tight_filter_row(&job->filter,
+				     job->pixels + (j * job->width * bpp),
+				     job->data + (j * job->filter.rowbytes));
+}
+
+static void vnc_tight_job_jpeg(struct vnc_tight_job *job)
+{
+	GdkPixbufLoader *loader = gdk_pixbuf_loader_new();
+
+	if (!gdk_pixbuf_loader_write(loader, job->payload, job->payload_length, NULL) ||
+	    !gdk_pixbuf_loader_close(loader, NULL)) {
+		job->failed = TRUE;
+	} else {
+		job->pixbuf = g_object_ref(gdk_pixbuf_loader_get_pixbuf(loader));
+	}
+
+	g_object_unref(loader);
+}
+
+static void vnc_tight_job_run(gpointer data, gpointer user_data G_GNUC_UNUSED)
+{
+	struct vnc_tight_job *job = data;
+
+	switch (job->type) {
+	case VNC_TIGHT_JOB_RESET:
+		inflateEnd(job->strm);
+		inflateInit(job->strm);
+		break;
+
+	case VNC_TIGHT_JOB_BASIC:
+		if (job->strm && !vnc_tight_job_inflate(job)) {
+			job->failed = TRUE;
+			break;
+		}
+
+		if (job->filter.id != 1)
+			vnc_tight_job_filter(job);
+		break;
+
+	case VNC_TIGHT_JOB_JPEG:
+		vnc_tight_job_jpeg(job);
+		break;
+	}
+
+	g_atomic_int_set(&job->done, 1);
+
+	/* Make the main loop re-check the coroutine's wait condition */
+	g_main_context_wakeup(NULL);
 }
 
+static gboolean vnc_connection_tight_job_done(gpointer data)
+{
+	struct vnc_tight_job *job = data;
+
+	return g_atomic_int_get(&job->done);
+}
+
+static void vnc_connection_tight_job_free(struct vnc_tight_job *job)
+{
+	if (job->pixbuf)
+		g_object_unref(job->pixbuf);
+	g_free(job->buffer);
+	g_free(job);
+}
+
+/*
+ * Wait for the oldest queued job, then apply its result
+ */
+static void vnc_connection_tight_complete(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	struct vnc_tight_job *job = g_queue_pop_head(priv->tight_jobs);
+
+	priv->tight_bytes -= job->bytes;
+	if (!g_atomic_int_get(&job->done))
+		priv->stats.coroutine_switches++;
+	g_condition_wait(vnc_connection_tight_job_done, job);
+
+	if (job->type == VNC_TIGHT_JOB_BASIC && job->strm) {
+		VncStatsEncoding *enc = vnc_stats_get_encoding(&priv->stats,
+							       VNC_CONNECTION_ENCODING_TIGHT);
+
+		priv->stats.compressed_bytes += job->payload_length;
+		priv->stats.decompressed_bytes += job->data_size;
+		priv->stats.inflate_time += job->inflate_time;
+		if (enc)
+			enc->inflate_time += job->inflate_time;
+	}
+
+	if (job->failed) {
+		VNC_DEBUG("Closing the connection: vnc_connection_tight_complete() - decode failed");
+		priv->has_error = TRUE;
+	} else if (!priv->has_error) {
+		switch (job->type) {
+		case VNC_TIGHT_JOB_BASIC:
+			if (job->filter.id == 1)
+				vnc_framebuffer_blt_indexed(priv->fb, (guint8 *)job->filter.palette,
+							    job->filter.palette_size, job->data,
+							    job->filter.palette_size == 2 ? 1 : 8,
+							    job->filter.rowbytes,
+							    job->x, job->y, job->width, job->height);
+			else
+				vnc_framebuffer_blt(priv->fb, job->pixels,
+						    job->width * (job->filter.fmt.bits_per_pixel / 8),
+						    job->x, job->y, job->width, job->height);
+			break;
+		case VNC_TIGHT_JOB_FILL:
+			vnc_framebuffer_fill(priv->fb, job->filter.palette[0],
+					     job->x, job->y, job->width, job->height);
+			break;
+		case VNC_TIGHT_JOB_JPEG:
+			vnc_framebuffer_rgb24_blt(priv->fb,
+						  gdk_pixbuf_get_pixels(job->pixbuf),
+						  gdk_pixbuf_get_rowstride(job->pixbuf),
+						  job->x, job->y, job->width, job->height);
+			break;
+		}
+
+		if (job->type != VNC_TIGHT_JOB_RESET)
+			vnc_connection_update(conn, job->x, job->y, job->width, job->height);
+	}
+
+	vnc_connection_tight_job_free(job);
+}
+
+/*
+ * Complete all outstanding jobs. Must be called before anything
+ * else touches the framebuffer or the zlib streams
+ */
+static void vnc_connection_tight_flush(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	while (priv->tight_jobs && !g_queue_is_empty(priv->tight_jobs))
+		vnc_connection_tight_complete(conn);
+}
+
+static void vnc_connection_tight_queue(VncConnection *conn,
+				       struct vnc_tight_job *job,
+				       int pool)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	if (!priv->tight_jobs)
+		priv->tight_jobs = g_queue_new();
+
+	/* Don't let decoding run unbounded ahead of blitting */
+	while (!g_queue_is_empty(priv->tight_jobs) &&
+	       (g_queue_get_length(priv->tight_jobs) >= VNC_CONNECTION_TIGHT_JOBS_MAX ||
+		priv->tight_bytes + job->bytes > VNC_CONNECTION_TIGHT_BYTES_MAX))
+		vnc_connection_tight_complete(conn);
+
+	g_queue_push_tail(priv->tight_jobs, job);
+	priv->tight_bytes += job->bytes;
+
+	if (job->type == VNC_TIGHT_JOB_FILL) {
+		job->done = 1;
+		return;
+	}
+
+	if (!priv->tight_pools[pool])
+		priv->tight_pools[pool] = g_thread_pool_new(vnc_tight_job_run, NULL,
+							    pool == 0 ? 4 : 1,
+							    FALSE, NULL);
+	g_thread_pool_push(priv->tight_pools[pool], job, NULL);
+}
+
+static struct vnc_tight_job *vnc_connection_tight_job_new(VncConnection *conn,
+							  int type,
+							  guint16 x, guint16 y,
+							  guint16 width, guint16 height)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	struct vnc_tight_job *job = g_new0(struct vnc_tight_job, 1);
+
+	job->type = type;
+	job->x = x;
+	job->y = y;
+	job->width = width;
+	job->height = height;
+	job->filter.fmt = priv->fmt;
+
+	return job;
+}
+
+/*
+ * Read a basic rect's payload into a job for a worker to decode.
+ * Returns FALSE, having read nothing, if it is too big to buffer.
+ */
+static gboolean vnc_connection_tight_queue_basic(VncConnection *conn,
+						 struct vnc_tight_filter *filter,
+						 int stream, guint32 length,
+						 guint16 x, guint16 y,
+						 guint16 width, guint16 height)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	int bpp = filter->fmt.bits_per_pixel / 8;
+	size_t data_size = filter->rowbytes * height;
+	size_t payload_size = stream ? VNC_TIGHT_ALIGN(length) : 0;
+	size_t pixels_size = 0, rows_size = 0;
+	struct vnc_tight_job *job;
+	guint8 *buffer;
+
+	/* Palette indexes are blitted as they are, and so
+	 * is copy filter input unless it needs expanding */
+	if (filter->id == 2 || (filter->id == 0 && filter->fmt.depth == 24))
+		pixels_size = VNC_TIGHT_ALIGN(width * height * bpp);
+	if (filter->id == 2)
+		rows_size = VNC_TIGHT_FILTER_ROWS(width) * sizeof(guint16);
+
+	if (payload_size + VNC_TIGHT_ALIGN(data_size) + pixels_size + rows_size >
+	    VNC_CONNECTION_TIGHT_JOB_BYTES_MAX)
+		return FALSE;
+
+	job = vnc_connection_tight_job_new(conn, VNC_TIGHT_JOB_BASIC,
+					   x, y, width, height);
+	job->filter = *filter;
+	job->bytes = payload_size + VNC_TIGHT_ALIGN(data_size) + pixels_size + rows_size;
+	job->buffer = buffer = g_malloc(job->bytes);
+
+	job->data = buffer;
+	job->data_size = data_size;
+	buffer += VNC_TIGHT_ALIGN(data_size);
+
+	if (stream) {
+		job->payload = buffer;
+		job->payload_length = length;
+		job->strm = &priv->streams[stream];
+		buffer += payload_size;
+	} else {
+		job->payload = job->data;
+		job->payload_length = data_size;
+	}
+
+	job->pixels = pixels_size ? buffer : job->data;
+	buffer += pixels_size;
+	if (rows_size)
+		job->rows = (guint16 *)buffer;
+
+	vnc_connection_read(conn, job->payload, job->payload_length);
+
+	if (priv->has_error)
+		vnc_connection_tight_job_free(job);
+	else
+		vnc_connection_tight_queue(conn, job, stream);
+	return TRUE;
+}
+
+/*
+ * With threaded decoding, rects are read off the wire and queued
+ * for the workers, and only the ones too big to buffer are decoded
+ * here, once the queue ahead of them has drained.
+ */
+static void vnc_connection_tight_update(VncConnection *conn,
+					guint16 x, guint16 y,
+					guint16 width, guint16 height)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	gboolean threaded = priv->threaded_decode;
+	struct vnc_tight_job *job;
+	guint8 ccontrol;
+	guint8 pixel[4];
+	int i;
+
+	ccontrol = vnc_connection_read_u8(conn);
+
+	for (i = 0; i < 4; i++) {
+		if (!(ccontrol & (1 << i)))
+			continue;
+
+		if (threaded) {
+			job = vnc_connection_tight_job_new(conn, VNC_TIGHT_JOB_RESET,
+							   x, y, width, height);
+			job->strm = &priv->streams[i + 1];
+			vnc_connection_tight_queue(conn, job, i + 1);
+		} else {
+			inflateEnd(&priv->streams[i + 1]);
+			inflateInit(&priv->streams[i + 1]);
+		}
+	}
+
+	ccontrol >>= 4;
+	ccontrol &= 0x0F;
+
+	if (ccontrol <= 7) {
+		/* basic */
+		struct vnc_tight_filter filter;
+		int stream = (ccontrol & 0x03) + 1;
+		guint32 zlib_length = 0;
+
+		if (!vnc_connection_tight_read_filter(conn, ccontrol, width, &filter))
+			return;
+
+		/* small payloads are sent uncompressed */
+		if (filter.rowbytes * height >= 12)
+			zlib_length = vnc_connection_read_cint(conn);
+		else
+			stream = 0;
+
+		if (threaded &&
+		    vnc_connection_tight_queue_basic(conn, &filter, stream, zlib_length,
+						     x, y, width, height))
+			return;
+
+		/* otherwise the filter decodes as the compressed data arrives */
+		vnc_connection_tight_flush(conn);
+		if (stream)
+			vnc_connection_zstart(conn, &priv->streams[stream], zlib_length);
+		vnc_connection_tight_update_basic(conn, &filter, x, y, width, height);
+		if (stream)
+			vnc_connection_zfinish(conn);
+		vnc_connection_update(conn, x, y, width, height);
+	} else if (ccontrol == 8) {
+		/* fill */
+		if (threaded) {
+			job = vnc_connection_tight_job_new(conn, VNC_TIGHT_JOB_FILL,
+							   x, y, width, height);
+			vnc_connection_read_tpixel(conn, job->filter.palette[0]);
+			vnc_connection_tight_queue(conn, job, 0);
+		} else {
+			vnc_connection_read_tpixel(conn, pixel);
+			vnc_framebuffer_fill(priv->fb, pixel, x, y, width, height);
+			vnc_connection_update(conn, x, y, width, height);
+		}
+	} else if (ccontrol == 9) {
+		/* jpeg */
+		guint32 length;
+		guint8 *jpeg_data;
+
+		length = vnc_connection_read_cint(conn);
+
+		if (threaded && length <= VNC_CONNECTION_TIGHT_JOB_BYTES_MAX) {
+			job = vnc_connection_tight_job_new(conn, VNC_TIGHT_JOB_JPEG,
+							   x, y, width, height);
+			job->payload_length = length;
+			job->payload = job->buffer = g_malloc(length);
+			job->bytes = length;
+			vnc_connection_read(conn, job->payload, job->payload_length);
+
+			if (priv->has_error)
+				vnc_connection_tight_job_free(job);
+			else
+				vnc_connection_tight_queue(conn, job, 0);
+			return;
+		}
+
+		vnc_connection_tight_flush(conn);
+		jpeg_data = vnc_connection_scratch_alloc(conn, length);
+		vnc_connection_read(conn, jpeg_data, length);
+		vnc_connection_tight_update_jpeg(conn, x, y, width, height,
+						 jpeg_data, length);
+		vnc_connection_update(conn, x, y, width, height);
+	} else {
+		/* error */
+		VNC_DEBUG("Closing the connection: vnc_connection_tight_update() - ccontrol unknown");
+		priv->has_error = TRUE;
+	}
+}
 
 static void vnc_connection_bell(VncConnection *conn)
 {
@@ -2481,6 +4202,139 @@ static void vnc_connection_server_cut_text(VncConnection *conn,
 	g_string_free(text, TRUE);
 }
 
+static void vnc_connection_pixel_format(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	struct signal_data sigdata;
+
+        if (priv->has_error)
+                return;
+
+	vnc_connection_update_flush(conn);
+
+	sigdata.params.pixelFormat = &priv->fmt;
+	vnc_connection_emit_main_context(conn, VNC_PIXEL_FORMAT_CHANGED, &sigdata);
+}
+
+static void vnc_connection_client_fence(VncConnection *conn, guint32 flags,
+					const guint8 *data, guint8 length)
+{
+	guint8 pad[3] = {0};
+
+	vnc_connection_write_u8(conn, 248);
+	vnc_connection_write(conn, pad, 3);
+	vnc_connection_write_u32(conn, flags);
+	vnc_connection_write_u8(conn, length);
+	vnc_connection_write(conn, data, length);
+	vnc_connection_flush(conn);
+}
+
+static void vnc_connection_enable_continuous_updates(VncConnection *conn, gboolean enable)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	VNC_DEBUG("%s continuous updates for %dx%d",
+		  enable ? "Enabling" : "Disabling", priv->width, priv->height);
+
+	vnc_connection_write_u8(conn, 150);
+	vnc_connection_write_u8(conn, enable ? 1 : 0);
+	vnc_connection_write_u16(conn, 0);
+	vnc_connection_write_u16(conn, 0);
+	vnc_connection_write_u16(conn, priv->width);
+	vnc_connection_write_u16(conn, priv->height);
+	vnc_connection_flush(conn);
+
+	priv->continuous_updates = enable ?
+		VNC_CONNECTION_CONTINUOUS_ON : VNC_CONNECTION_CONTINUOUS_STOPPING;
+}
+
+/*
+ * The first EndOfContinuousUpdates announces server support.
+ * Later ones acknowledge our disabling them, or say the server
+ * stopped pushing updates of its own accord. Either way we go
+ * back to asking for updates. We only turn them back on after
+ * our own disable, if the client has since asked for them again;
+ * a server that stopped them meant to, so that waits for the
+ * client's next vnc_connection_set_encodings().
+ */
+static void vnc_connection_end_continuous_updates(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	gboolean enable = priv->want_continuous_updates;
+
+	if (!priv->has_continuous_updates) {
+		VNC_DEBUG("Server supports continuous updates");
+		priv->has_continuous_updates = TRUE;
+	} else {
+		switch (priv->continuous_updates) {
+		case VNC_CONNECTION_CONTINUOUS_STOPPING:
+			VNC_DEBUG("Server acknowledged disabling continuous updates");
+			break;
+		case VNC_CONNECTION_CONTINUOUS_ON:
+			VNC_DEBUG("Server ended continuous updates");
+			enable = FALSE;
+			break;
+		default:
+			VNC_DEBUG("Ignoring unexpected end of continuous updates");
+			return;
+		}
+
+		priv->continuous_updates = VNC_CONNECTION_CONTINUOUS_OFF;
+		vnc_connection_resend_framebuffer_update_request(conn);
+	}
+
+	if (enable)
+		vnc_connection_enable_continuous_updates(conn, TRUE);
+}
+
+static void vnc_connection_server_fence(VncConnection *conn, guint32 flags,
+					const guint8 *data, guint8 length)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	if (flags & VNC_CONNECTION_FENCE_REQUEST) {
+		/* Servers probe for support with a fence request */
+		if (!priv->has_fence) {
+			VNC_DEBUG("Server supports fences");
+			priv->has_fence = TRUE;
+		}
+
+		/* All earlier messages are processed already, so
+		 * the blocking flags are satisfied by replying now */
+		vnc_connection_client_fence(conn, flags & VNC_CONNECTION_FENCE_SUPPORTED,
+					    data, length);
+		return;
+	}
+
+	if (length != 1) {
+		VNC_DEBUG("Ignoring unexpected fence response");
+		return;
+	}
+
+	switch (data[0]) {
+	case VNC_CONNECTION_FENCE_PIXEL_FORMAT:
+		if (!priv->has_pending_fmt)
+			break;
+		VNC_DEBUG("Switching to the new pixel format");
+		memcpy(&priv->fmt, &priv->pending_fmt, sizeof(priv->fmt));
+		priv->has_pending_fmt = FALSE;
+		vnc_connection_pixel_format(conn);
+		break;
+
+	case VNC_CONNECTION_FENCE_LATENCY:
+		if (!priv->rtt_fence_sent)
+			break;
+		priv->rtt = vnc_connection_now() - priv->rtt_fence_sent;
+		priv->rtt_fence_sent = 0;
+		VNC_DEBUG("Round trip time %u us", priv->rtt);
+		break;
+
+	default:
+		VNC_DEBUG("Ignoring unknown fence response %d", data[0]);
+		break;
+	}
+}
+
 static void vnc_connection_resize(VncConnection *conn, int width, int height)
 {
 	VncConnectionPrivate *priv = conn->priv;
@@ -2489,24 +4343,18 @@ static void vnc_connection_resize(VncConnection *conn, int width, int height)
 	if (priv->has_error)
 		return;
 
+	/* Damage refers to the framebuffer about to be replaced */
+	vnc_connection_update_flush(conn);
+
 	priv->width = width;
 	priv->height = height;
 
 	sigdata.params.size.width = width;
 	sigdata.params.size.height = height;
 	vnc_connection_emit_main_context(conn, VNC_DESKTOP_RESIZE, &sigdata);
-}
-
-static void vnc_connection_pixel_format(VncConnection *conn)
-{
-	VncConnectionPrivate *priv = conn->priv;
-	struct signal_data sigdata;
 
-        if (priv->has_error)
-                return;
-
-	sigdata.params.pixelFormat = &priv->fmt;
-	vnc_connection_emit_main_context(conn, VNC_PIXEL_FORMAT_CHANGED, &sigdata);
+	if (priv->continuous_updates == VNC_CONNECTION_CONTINUOUS_ON)
+		vnc_connection_enable_continuous_updates(conn, TRUE);
 }
 
 static void vnc_connection_pointer_type_change(VncConnection *conn, gboolean absPointer)
@@ -2552,8 +4400,9 @@ static void vnc_connection_rich_cursor(VncConnection *conn, int x, int y, int wi
 		imagelen = width * height * (priv->fmt.bits_per_pixel / 8);
 		masklen = ((width + 7)/8) * height;
 
-		image = g_malloc(imagelen);
-		mask = g_malloc(masklen);
+		image = vnc_connection_scratch_alloc(conn, imagelen);
+		mask = vnc_connection_scratch_alloc(conn, masklen);
+		/* Ownership passes to the cursor, so not scratch memory */
 		pixbuf = g_malloc(width * height * 4); /* RGB-A 8bit */
 
 		vnc_connection_read(conn, image, imagelen);
@@ -2563,9 +4412,6 @@ static void vnc_connection_rich_cursor(VncConnection *conn, int x, int y, int wi
 					       width * (priv->fmt.bits_per_pixel/8),
 					       width, height);
 
-		g_free(image);
-		g_free(mask);
-
 		priv->cursor = vnc_cursor_new(pixbuf, x, y, width, height);
 	}
 
@@ -2582,61 +4428,303 @@ static void vnc_connection_xcursor(VncConnection *conn, int x, int y, int width,
 	VncConnectionPrivate *priv = conn->priv;
 	struct signal_data sigdata;
 
-	if (priv->cursor) {
-		g_object_unref(priv->cursor);
-		priv->cursor = NULL;
+	if (priv->cursor) {
+		g_object_unref(priv->cursor);
+		priv->cursor = NULL;
+	}
+
+	if (width && height) {
+		guint8 *pixbuf = NULL;
+		guint8 *data, *mask, *datap, *maskp;
+		guint32 *pixp;
+		int rowlen;
+		int x1, y1;
+		guint8 fgrgb[3], bgrgb[3];
+		guint32 fg, bg;
+		vnc_connection_read(conn, fgrgb, 3);
+		vnc_connection_read(conn, bgrgb, 3);
+		fg = (255 << 24) | (fgrgb[0] << 16) | (fgrgb[1] << 8) | fgrgb[2];
+		bg = (255 << 24) | (bgrgb[0] << 16) | (bgrgb[1] << 8) | bgrgb[2];
+
+		rowlen = ((width + 7)/8);
+		data = vnc_connection_scratch_alloc(conn, rowlen*height);
+		mask = vnc_connection_scratch_alloc(conn, rowlen*height);
+		/* Ownership passes to the cursor, so not scratch memory */
+		pixbuf = g_malloc(width * height * 4); /* RGB-A 8bit */
+
+		vnc_connection_read(conn, data, rowlen*height);
+		vnc_connection_read(conn, mask, rowlen*height);
+		datap = data;
+		maskp = mask;
+		pixp = (guint32*)pixbuf;
+		for (y1 = 0; y1 < height; y1++) {
+			for (x1 = 0; x1 < width; x1++) {
+				*pixp++ = ((maskp[x1 / 8] >> (7-(x1 % 8))) & 1) ?
+					(((datap[x1 / 8] >> (7-(x1 % 8))) & 1) ? fg : bg) : 0;
+			}
+			datap += rowlen;
+			maskp += rowlen;
+		}
+
+		priv->cursor = vnc_cursor_new(pixbuf, x, y, width, height);
+	}
+
+	if (priv->has_error)
+		return;
+
+	sigdata.params.cursor = priv->cursor;
+
+	vnc_connection_emit_main_context(conn, VNC_CURSOR_CHANGED, &sigdata);
+}
+
+static void vnc_connection_ext_key_event(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	priv->has_ext_key_event = TRUE;
+}
+
+/*
+ * Bytes of protocol data consumed so far, as opposed to
+ * received, which includes data sitting in the read buffer
+ */
+static guint64 vnc_connection_bytes_consumed(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	return priv->stats.bytes_read - (priv->read_size - priv->read_offset);
+}
+
+/*
+ * Forget everything learnt about the connection, going back
+ * to the prior estimates of each encoding's cost
+ */
+static void vnc_connection_auto_reset(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	int i;
+
+	priv->auto_current = -1;
+	priv->auto_probe = -1;
+	priv->auto_last_probe = 0;
+	priv->auto_bandwidth = 0;
+	priv->auto_window_bytes = 0;
+	priv->auto_window_wait = 0;
+	priv->auto_last_eval = 0;
+	priv->auto_last_switch = 0;
+
+	memset(priv->auto_costs, 0, sizeof(priv->auto_costs));
+	for (i = 0; i < VNC_CONNECTION_AUTO_ENCODINGS; i++) {
+		priv->auto_costs[i].ratio = vnc_connection_auto_encodings[i].ratio;
+		priv->auto_costs[i].decode = vnc_connection_auto_encodings[i].decode;
+	}
+}
+
+/*
+ * Estimated client side cost, in microseconds per pixel, of
+ * receiving and decoding updates in an encoding
+ */
+static double vnc_connection_auto_cost(VncConnection *conn, int i)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	int bpp = priv->fmt.bits_per_pixel / 8;
+
+	return (priv->auto_costs[i].ratio * bpp / priv->auto_bandwidth) +
+		priv->auto_costs[i].decode;
+}
+
+static gboolean vnc_connection_auto_candidate(VncConnection *conn, int i)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	int j;
+
+	for (j = 0; j < priv->n_encodings; j++)
+		if (priv->encodings[j] == vnc_connection_auto_encodings[i].encoding)
+			return TRUE;
+
+	return FALSE;
+}
+
+/* The candidate other than the preferred encoding that has
+ * gone longest without being measured, or -1 */
+static int vnc_connection_auto_probe_pick(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	int i, oldest = -1;
+
+	for (i = 0; i < VNC_CONNECTION_AUTO_ENCODINGS; i++) {
+		if (i == priv->auto_current || !vnc_connection_auto_candidate(conn, i))
+			continue;
+		if (oldest == -1 || priv->auto_costs[i].sampled < priv->auto_costs[oldest].sampled)
+			oldest = i;
+	}
+
+	return oldest;
+}
+
+/*
+ * Periodically fold the latest measurements into the cost
+ * estimates, and re-send the encodings if a different one
+ * now looks clearly cheaper. Cheap to decode encodings win
+ * on fast links, compact ones on slow links.
+ *
+ * Every so often one interval is spent with another encoding
+ * preferred, so that the estimates of the others don't go
+ * stale, or stay at their priors, while one is in use.
+ */
+static void vnc_connection_auto_select(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	gint64 now = vnc_connection_now();
+	int bpp = priv->fmt.bits_per_pixel / 8;
+	double costs[VNC_CONNECTION_AUTO_ENCODINGS];
+	int i, best = -1;
+	gboolean rewrite = FALSE;
+	GString *reason;
+	struct signal_data sigdata;
+
+	if (priv->auto_last_eval == 0) {
+		priv->auto_last_eval = now;
+		priv->auto_last_probe = now;
+		return;
+	}
+	if ((now - priv->auto_last_eval) < VNC_CONNECTION_AUTO_INTERVAL)
+		return;
+	priv->auto_last_eval = now;
+
+	/* Bytes over time spent blocked on the network reading rect
+	 * payloads. Waits for a rect's header are left out, as they
+	 * are mostly the server encoding it, though any pauses to
+	 * encode mid-rect still make the link look slower. A small
+	 * floor on the wait stops a fully buffered window looking
+	 * like an infinitely fast link */
+	if (priv->auto_window_bytes >= VNC_CONNECTION_AUTO_MIN_BYTES) {
+		double bandwidth = (double)priv->auto_window_bytes /
+			MAX(priv->auto_window_wait, 1000);
+
+		if (priv->auto_bandwidth)
+			priv->auto_bandwidth = (priv->auto_bandwidth + bandwidth) / 2;
+		else
+			priv->auto_bandwidth = bandwidth;
+	}
+	priv->auto_window_bytes = 0;
+	priv->auto_window_wait = 0;
+
+	for (i = 0; i < VNC_CONNECTION_AUTO_ENCODINGS; i++) {
+		struct vnc_encoding_cost *cost = &priv->auto_costs[i];
+		double ratio, decode;
+
+		if (cost->pixels < VNC_CONNECTION_AUTO_MIN_PIXELS)
+			continue;
+
+		ratio = (double)cost->bytes / (cost->pixels * bpp);
+		decode = (double)cost->decode_time / cost->pixels;
+		if (cost->measured) {
+			cost->ratio = (cost->ratio + ratio) / 2;
+			cost->decode = (cost->decode + decode) / 2;
+		} else {
+			cost->ratio = ratio;
+			cost->decode = decode;
+			cost->measured = TRUE;
+		}
+		cost->sampled = now;
+		cost->pixels = cost->bytes = cost->decode_time = 0;
+	}
+
+	/* Go back to the preferred encoding after sampling another */
+	if (priv->auto_probe != -1) {
+		priv->auto_probe = -1;
+		rewrite = TRUE;
 	}
 
-	if (width && height) {
-		guint8 *pixbuf = NULL;
-		guint8 *data, *mask, *datap, *maskp;
-		guint32 *pixp;
-		int rowlen;
-		int x1, y1;
-		guint8 fgrgb[3], bgrgb[3];
-		guint32 fg, bg;
-		vnc_connection_read(conn, fgrgb, 3);
-		vnc_connection_read(conn, bgrgb, 3);
-		fg = (255 << 24) | (fgrgb[0] << 16) | (fgrgb[1] << 8) | fgrgb[2];
-		bg = (255 << 24) | (bgrgb[0] << 16) | (bgrgb[1] << 8) | bgrgb[2];
+	if (!priv->auto_bandwidth) {
+		if (rewrite)
+			vnc_connection_write_encodings(conn);
+		return;
+	}
 
-		rowlen = ((width + 7)/8);
-		data = g_malloc(rowlen*height);
-		mask = g_malloc(rowlen*height);
-		pixbuf = g_malloc(width * height * 4); /* RGB-A 8bit */
+	reason = g_string_new(NULL);
+	g_string_append_printf(reason, "%.2f MB/s link;", priv->auto_bandwidth);
+	for (i = 0; i < VNC_CONNECTION_AUTO_ENCODINGS; i++) {
+		if (!vnc_connection_auto_candidate(conn, i))
+			continue;
 
-		vnc_connection_read(conn, data, rowlen*height);
-		vnc_connection_read(conn, mask, rowlen*height);
-		datap = data;
-		maskp = mask;
-		pixp = (guint32*)pixbuf;
-		for (y1 = 0; y1 < height; y1++) {
-			for (x1 = 0; x1 < width; x1++) {
-				*pixp++ = ((maskp[x1 / 8] >> (7-(x1 % 8))) & 1) ?
-					(((datap[x1 / 8] >> (7-(x1 % 8))) & 1) ? fg : bg) : 0;
-			}
-			datap += rowlen;
-			maskp += rowlen;
+		costs[i] = vnc_connection_auto_cost(conn, i);
+		g_string_append_printf(reason, " %s %.3f us/px%s",
+				       vnc_connection_auto_encodings[i].name, costs[i],
+				       priv->auto_costs[i].measured ? "" : " (est)");
+		if (best == -1 || costs[i] < costs[best])
+			best = i;
+	}
+
+	if (best != -1 && best != priv->auto_current &&
+	    (priv->auto_current == -1 ||
+	     ((now - priv->auto_last_switch) >= VNC_CONNECTION_AUTO_HOLDOFF &&
+	      costs[best] < (costs[priv->auto_current] * VNC_CONNECTION_AUTO_HYSTERESIS)))) {
+		VNC_DEBUG("Switching preferred encoding from %s to %s",
+			  priv->auto_current == -1 ? "none" :
+			  vnc_connection_auto_encodings[priv->auto_current].name,
+			  vnc_connection_auto_encodings[best].name);
+		priv->auto_current = best;
+		priv->auto_last_switch = now;
+		rewrite = TRUE;
+	}
+
+	if (!rewrite && priv->auto_current != -1 &&
+	    (now - priv->auto_last_probe) >= VNC_CONNECTION_AUTO_PROBE_INTERVAL) {
+		priv->auto_last_probe = now;
+		priv->auto_probe = vnc_connection_auto_probe_pick(conn);
+		if (priv->auto_probe != -1) {
+			VNC_DEBUG("Sampling %s encoding",
+				  vnc_connection_auto_encodings[priv->auto_probe].name);
+			rewrite = TRUE;
 		}
-		g_free(data);
-		g_free(mask);
-
-		priv->cursor = vnc_cursor_new(pixbuf, x, y, width, height);
 	}
 
-	if (priv->has_error)
-		return;
+	if (rewrite)
+		vnc_connection_write_encodings(conn);
 
-	sigdata.params.cursor = priv->cursor;
+	if (priv->auto_current != -1) {
+		g_string_prepend(reason, ": ");
+		g_string_prepend(reason, vnc_connection_auto_encodings[priv->auto_current].name);
+	}
 
-	vnc_connection_emit_main_context(conn, VNC_CURSOR_CHANGED, &sigdata);
+	VNC_DEBUG("Encoding choice %s", reason->str);
+	if (priv->encoding_choice && strcmp(priv->encoding_choice, reason->str) == 0) {
+		g_string_free(reason, TRUE);
+		return;
+	}
+	g_free(priv->encoding_choice);
+	priv->encoding_choice = g_string_free(reason, FALSE);
+	vnc_connection_emit_main_context(conn, VNC_ENCODING_CHOICE_NOTIFY, &sigdata);
 }
 
-static void vnc_connection_ext_key_event(VncConnection *conn)
+/*
+ * Complete all outstanding Tight jobs, charging the time spent
+ * waiting on the workers and blitting to Tight, rather than to
+ * whatever rect happens to come next
+ */
+static void vnc_connection_tight_drain(VncConnection *conn)
 {
 	VncConnectionPrivate *priv = conn->priv;
+	VncStatsEncoding *enc;
+	gint64 start, elapsed;
+	int auto_index;
 
-	priv->has_ext_key_event = TRUE;
+	if (!priv->tight_jobs || g_queue_is_empty(priv->tight_jobs))
+		return;
+
+	start = vnc_connection_now();
+	vnc_connection_tight_flush(conn);
+	elapsed = MAX(vnc_connection_now() - start, 0);
+
+	enc = vnc_stats_get_encoding(&priv->stats, VNC_CONNECTION_ENCODING_TIGHT);
+	if (enc)
+		enc->decode_time += elapsed;
+
+	auto_index = vnc_connection_auto_index(VNC_CONNECTION_ENCODING_TIGHT);
+	if (priv->auto_encoding && auto_index != -1)
+		priv->auto_costs[auto_index].decode_time += elapsed;
 }
 
 static void vnc_connection_framebuffer_update(VncConnection *conn, gint32 etype,
@@ -2644,10 +4732,30 @@ static void vnc_connection_framebuffer_update(VncConnection *conn, gint32 etype,
 					      guint16 width, guint16 height)
 {
 	VncConnectionPrivate *priv = conn->priv;
+	int auto_index = priv->auto_encoding ? vnc_connection_auto_index(etype) : -1;
+	gint64 start;
+	guint64 wait;
+	guint64 consumed;
+	guint64 inflate_time;
+	VncStatsEncoding *enc;
+	gint64 elapsed;
+	guint64 bytes;
 
 	VNC_DEBUG("FramebufferUpdate type=%d area (%dx%d) at location %d,%d",
 		   etype, width, height, x, y);
 
+	/* Threaded Tight rects complete asynchronously, so anything
+	 * else must wait for them to preserve ordering. That includes
+	 * Tight rects decoded inline after threading was turned off,
+	 * which would otherwise share zlib streams with the workers */
+	if (etype != VNC_CONNECTION_ENCODING_TIGHT || !priv->threaded_decode)
+		vnc_connection_tight_drain(conn);
+
+	start = vnc_connection_now();
+	wait = priv->stats.read_wait_time;
+	consumed = vnc_connection_bytes_consumed(conn);
+	inflate_time = priv->inflate_time;
+
 	switch (etype) {
 	case VNC_CONNECTION_ENCODING_RAW:
 		vnc_connection_raw_update(conn, x, y, width, height);
@@ -2670,8 +4778,8 @@ static void vnc_connection_framebuffer_update(VncConnection *conn, gint32 etype,
 		vnc_connection_update(conn, x, y, width, height);
 		break;
 	case VNC_CONNECTION_ENCODING_TIGHT:
+		/* Signals its own damage, since it may complete later */
 		vnc_connection_tight_update(conn, x, y, width, height);
-		vnc_connection_update(conn, x, y, width, height);
 		break;
 	case VNC_CONNECTION_ENCODING_DESKTOP_RESIZE:
 		vnc_connection_resize(conn, width, height);
@@ -2682,6 +4790,8 @@ static void vnc_connection_framebuffer_update(VncConnection *conn, gint32 etype,
 		break;
         case VNC_CONNECTION_ENCODING_WMVi:
                 vnc_connection_read_pixel_format(conn, &priv->fmt);
+                /* Already in the stream, so needs no injecting */
+                priv->record_fmt = priv->fmt;
                 vnc_connection_pixel_format(conn);
                 break;
 	case VNC_CONNECTION_ENCODING_RICH_CURSOR:
@@ -2701,6 +4811,66 @@ static void vnc_connection_framebuffer_update(VncConnection *conn, gint32 etype,
 		priv->has_error = TRUE;
 		break;
 	}
+
+	/* Time spent not waiting for the network is decode cost */
+	elapsed = vnc_connection_now() - start;
+	elapsed -= priv->stats.read_wait_time - wait;
+	elapsed = MAX(elapsed, 0);
+	bytes = vnc_connection_bytes_consumed(conn) - consumed;
+
+	inflate_time = priv->inflate_time - inflate_time;
+	priv->stats.inflate_time += inflate_time;
+
+	vnc_stats_histogram_record(&priv->stats.decode_time, elapsed);
+	enc = vnc_stats_get_encoding(&priv->stats, etype);
+	if (enc) {
+		enc->rects++;
+		enc->pixels += width * height;
+		enc->bytes += bytes;
+		enc->decode_time += elapsed;
+		enc->inflate_time += inflate_time;
+	}
+
+	if (priv->auto_encoding) {
+		priv->auto_window_bytes += bytes;
+		priv->auto_window_wait += priv->stats.read_wait_time - wait;
+	}
+
+	if (auto_index != -1) {
+		struct vnc_encoding_cost *cost = &priv->auto_costs[auto_index];
+
+		cost->pixels += width * height;
+		cost->bytes += bytes;
+		cost->decode_time += elapsed;
+	}
+}
+
+/* Time from the oldest outstanding update request to the
+ * arrival of the update that answers it */
+static void vnc_connection_update_latency(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	gint64 latency;
+
+	priv->stats.updates++;
+	if (!priv->update_request_time)
+		return;
+
+	latency = vnc_connection_now() - priv->update_request_time;
+	priv->update_request_time = 0;
+
+	vnc_stats_histogram_record(&priv->stats.update_latency, MAX(latency, 0));
+}
+
+/* The live counters are only touched by the coroutine, so other
+ * threads read a copy published once per server message */
+static void vnc_connection_publish_stats(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	g_mutex_lock(priv->stats_lock);
+	priv->stats_snapshot = priv->stats;
+	g_mutex_unlock(priv->stats_lock);
 }
 
 static gboolean vnc_connection_server_message(VncConnection *conn)
@@ -2718,6 +4888,7 @@ static gboolean vnc_connection_server_message(VncConnection *conn)
 			vnc_connection_flush(conn);
 			priv->xmit_buffer_size = 0;
 		}
+		vnc_connection_record_pixel_format(conn);
 	} while ((ret = vnc_connection_read_u8_interruptable(conn, &msg)) == -EAGAIN);
 
 	if (ret < 0) {
@@ -2729,11 +4900,20 @@ static gboolean vnc_connection_server_message(VncConnection *conn)
 	case 0: { /* FramebufferUpdate */
 		guint8 pad[1];
 		guint16 n_rects;
+		gboolean open_ended;
+		guint64 read_syscalls = priv->stats.read_syscalls;
 		int i;
 
+		vnc_connection_scratch_reset(conn);
+		vnc_connection_update_latency(conn);
+
 		vnc_connection_read(conn, pad, 1);
 		n_rects = vnc_connection_read_u16(conn);
-		for (i = 0; i < n_rects; i++) {
+		/* With LastRect, 0xFFFF means the count is unknown and
+		 * the update is terminated by a LastRect marker instead.
+		 * Otherwise it is just a count like any other */
+		open_ended = n_rects == 0xFFFF && priv->want_last_rect;
+		for (i = 0; i < n_rects || open_ended; i++) {
 			guint16 x, y, w, h;
 			gint32 etype;
 
@@ -2743,8 +4923,33 @@ static gboolean vnc_connection_server_message(VncConnection *conn)
 			h = vnc_connection_read_u16(conn);
 			etype = vnc_connection_read_s32(conn);
 
+			if (vnc_connection_has_error(conn))
+				break;
+
+			if (etype == VNC_CONNECTION_ENCODING_LAST_RECT) {
+				VNC_DEBUG("LastRect marker after %d rects", i);
+				break;
+			}
+
 			vnc_connection_framebuffer_update(conn, etype, x, y, w, h);
 		}
+
+		vnc_connection_tight_drain(conn);
+		vnc_connection_update_flush(conn);
+		vnc_connection_update_complete(conn);
+
+		if (priv->auto_encoding)
+			vnc_connection_auto_select(conn);
+
+		if (priv->has_fence && !priv->rtt_fence_sent) {
+			guint8 data = VNC_CONNECTION_FENCE_LATENCY;
+
+			priv->rtt_fence_sent = vnc_connection_now();
+			vnc_connection_client_fence(conn, VNC_CONNECTION_FENCE_REQUEST, &data, 1);
+		}
+
+		VNC_DEBUG("Framebuffer update of %d rects took %" G_GUINT64_FORMAT " read syscalls",
+			  i, priv->stats.read_syscalls - read_syscalls);
 	}	break;
 	case 1: { /* SetColorMapEntries */
 		guint16 first_color;
@@ -2805,12 +5010,35 @@ static gboolean vnc_connection_server_message(VncConnection *conn)
 		vnc_connection_server_cut_text(conn, data, n_text);
 		g_free(data);
 	}	break;
+	case 150: /* EndOfContinuousUpdates */
+		vnc_connection_end_continuous_updates(conn);
+		break;
+	case 248: { /* ServerFence */
+		guint8 pad[3];
+		guint32 flags;
+		guint8 length;
+		guint8 data[64];
+
+		vnc_connection_read(conn, pad, 3);
+		flags = vnc_connection_read_u32(conn);
+		length = vnc_connection_read_u8(conn);
+		if (length > sizeof(data)) {
+			VNC_DEBUG("Closing the connection: vnc_connection_server_message() - fence > allowed");
+			priv->has_error = TRUE;
+			break;
+		}
+		vnc_connection_read(conn, data, length);
+
+		vnc_connection_server_fence(conn, flags, data, length);
+	}	break;
 	default:
 		VNC_DEBUG("Received an unknown message: %u", msg);
 		priv->has_error = TRUE;
 		break;
 	}
 
+	vnc_connection_publish_stats(conn);
+
 	return !vnc_connection_has_error(conn);
 }
 
@@ -4095,6 +6323,9 @@ static void vnc_connection_finalize (GObject *object)
 	if (priv->fb)
 		g_object_unref(G_OBJECT(priv->fb));
 
+	if (priv->stats_lock)
+		g_mutex_free(priv->stats_lock);
+
 	G_OBJECT_CLASS(vnc_connection_parent_class)->finalize (object);
 }
 
@@ -4118,6 +6349,66 @@ static void vnc_connection_class_init(VncConnectionClass *klass)
 							    G_PARAM_STATIC_NICK |
 							    G_PARAM_STATIC_BLURB));
 
+	g_object_class_install_property(object_class,
+					PROP_BUFFER_SIZE,
+					g_param_spec_uint("buffer-size",
+							  "I/O buffer size",
+							  "Size of the read and write buffers, 0 to size adaptively",
+							  0,
+							  VNC_CONNECTION_BUFFER_MAX,
+							  0,
+							  G_PARAM_READABLE |
+							  G_PARAM_WRITABLE |
+							  G_PARAM_STATIC_NAME |
+							  G_PARAM_STATIC_NICK |
+							  G_PARAM_STATIC_BLURB));
+
+	g_object_class_install_property(object_class,
+					PROP_THREADED_DECODE,
+					g_param_spec_boolean("threaded-decode",
+							     "Threaded decode",
+							     "Decode Tight rectangles on worker threads",
+							     FALSE,
+							     G_PARAM_READABLE |
+							     G_PARAM_WRITABLE |
+							     G_PARAM_STATIC_NAME |
+							     G_PARAM_STATIC_NICK |
+							     G_PARAM_STATIC_BLURB));
+
+	g_object_class_install_property(object_class,
+					PROP_AUTO_ENCODING,
+					g_param_spec_boolean("auto-encoding",
+							     "Auto encoding",
+							     "Pick the preferred encoding from measured link and decode speed",
+							     FALSE,
+							     G_PARAM_READABLE |
+							     G_PARAM_WRITABLE |
+							     G_PARAM_STATIC_NAME |
+							     G_PARAM_STATIC_NICK |
+							     G_PARAM_STATIC_BLURB));
+
+	g_object_class_install_property(object_class,
+					PROP_ENCODING_CHOICE,
+					g_param_spec_string("encoding-choice",
+							    "Encoding choice",
+							    "The encoding picked by auto selection, and why",
+							    NULL,
+							    G_PARAM_READABLE |
+							    G_PARAM_STATIC_NAME |
+							    G_PARAM_STATIC_NICK |
+							    G_PARAM_STATIC_BLURB));
+
+	g_object_class_install_property(object_class,
+					PROP_STATS,
+					g_param_spec_boxed("stats",
+							   "Statistics",
+							   "Snapshot of the connection performance counters",
+							   VNC_TYPE_STATS,
+							   G_PARAM_READABLE |
+							   G_PARAM_STATIC_NAME |
+							   G_PARAM_STATIC_NICK |
+							   G_PARAM_STATIC_BLURB));
+
 	signals[VNC_CURSOR_CHANGED] =
 		g_signal_new ("vnc-cursor-changed",
 			      G_OBJECT_CLASS_TYPE (object_class),
@@ -4175,6 +6466,28 @@ static void vnc_connection_class_init(VncConnectionClass *klass)
 			      G_TYPE_INT,
 			      G_TYPE_INT);
 
+	signals[VNC_FRAMEBUFFER_UPDATE_REGION] =
+		g_signal_new ("vnc-framebuffer-update-region",
+			      G_OBJECT_CLASS_TYPE (object_class),
+			      G_SIGNAL_RUN_FIRST,
+			      G_STRUCT_OFFSET (VncConnectionClass, vnc_framebuffer_update_region),
+			      NULL, NULL,
+			      g_cclosure_user_marshal_VOID__POINTER_UINT,
+			      G_TYPE_NONE,
+			      2,
+			      G_TYPE_POINTER,
+			      G_TYPE_UINT);
+
+	signals[VNC_FRAMEBUFFER_UPDATE_COMPLETE] =
+		g_signal_new ("vnc-framebuffer-update-complete",
+			      G_OBJECT_CLASS_TYPE (object_class),
+			      G_SIGNAL_RUN_FIRST,
+			      G_STRUCT_OFFSET (VncConnectionClass, vnc_framebuffer_update_complete),
+			      NULL, NULL,
+			      g_cclosure_marshal_VOID__VOID,
+			      G_TYPE_NONE,
+			      0);
+
 	signals[VNC_DESKTOP_RESIZE] =
 		g_signal_new ("vnc-desktop-resize",
 			      G_OBJECT_CLASS_TYPE (object_class),
@@ -4302,6 +6615,17 @@ void vnc_connection_init(VncConnection *conn)
 	priv->fd = -1;
 	priv->auth_type = VNC_CONNECTION_AUTH_INVALID;
 	priv->auth_subtype = VNC_CONNECTION_AUTH_INVALID;
+	/* Without threads there are no other readers to lock
+	 * out, and g_mutex_lock(NULL) is a no-op */
+	if (g_thread_supported())
+		priv->stats_lock = g_mutex_new();
+
+	if (!(priv->tpixel_expand = vnc_connection_simd_tpixel_expand()))
+		priv->tpixel_expand = vnc_connection_tpixel_expand_bytes;
+	if (!(priv->gradient_predict = vnc_connection_simd_gradient_predict()))
+		priv->gradient_predict = vnc_connection_gradient_predict;
+
+	vnc_connection_auto_reset(conn);
 }
 
 
@@ -4318,6 +6642,8 @@ static void vnc_connection_close(VncConnection *conn)
 
 	VNC_DEBUG("Close VncConnection=%p", conn);
 
+	vnc_connection_record_end(conn);
+
 	if (priv->tls_session) {
 		gnutls_bye(priv->tls_session, GNUTLS_SHUT_RDWR);
 		priv->tls_session = NULL;
@@ -4344,6 +6670,17 @@ static void vnc_connection_close(VncConnection *conn)
 		priv->port = NULL;
 	}
 
+	if (priv->replay_file) {
+		fclose(priv->replay_file);
+		priv->replay_file = NULL;
+	}
+	g_free(priv->replay_filename);
+	priv->replay_filename = NULL;
+	g_free(priv->replay_block);
+	priv->replay_block = NULL;
+	priv->replay_block_size = priv->replay_block_capacity = 0;
+	priv->replay_offset = 0;
+
 	if (priv->name) {
 		g_free(priv->name);
 		priv->name = NULL;
@@ -4356,6 +6693,47 @@ static void vnc_connection_close(VncConnection *conn)
 		priv->xmit_buffer_capacity = 0;
 	}
 
+	if (priv->read_buffer) {
+		g_free(priv->read_buffer);
+		priv->read_buffer = NULL;
+		priv->read_buffer_capacity = 0;
+		priv->read_offset = priv->read_size = 0;
+	}
+
+	if (priv->write_buffer) {
+		g_free(priv->write_buffer);
+		priv->write_buffer = NULL;
+		priv->write_buffer_capacity = 0;
+		priv->write_offset = 0;
+	}
+
+	/* Workers must finish before their streams & buffers go away */
+	for (i = 0; i < 5; i++) {
+		if (priv->tight_pools[i]) {
+			g_thread_pool_free(priv->tight_pools[i], FALSE, TRUE);
+			priv->tight_pools[i] = NULL;
+		}
+	}
+	if (priv->tight_jobs) {
+		g_queue_foreach(priv->tight_jobs, (GFunc)vnc_connection_tight_job_free, NULL);
+		g_queue_free(priv->tight_jobs);
+		priv->tight_jobs = NULL;
+		priv->tight_bytes = 0;
+	}
+
+	if (priv->damage) {
+		g_array_free(priv->damage, TRUE);
+		priv->damage = NULL;
+	}
+
+	g_slist_foreach(priv->scratch_spill, (GFunc)g_free, NULL);
+	g_slist_free(priv->scratch_spill);
+	priv->scratch_spill = NULL;
+	priv->scratch_spilled = 0;
+	g_free(priv->scratch);
+	priv->scratch = NULL;
+	priv->scratch_size = priv->scratch_used = 0;
+
 	if (priv->cred_username) {
 		g_free(priv->cred_username);
 		priv->cred_username = NULL;
@@ -4385,6 +6763,23 @@ static void vnc_connection_close(VncConnection *conn)
 	for (i = 0; i < 5; i++)
 		inflateEnd(&priv->streams[i]);
 
+	priv->want_continuous_updates = FALSE;
+	priv->want_last_rect = FALSE;
+	priv->has_continuous_updates = FALSE;
+	priv->continuous_updates = VNC_CONNECTION_CONTINUOUS_OFF;
+	priv->has_fence = FALSE;
+	priv->has_pending_fmt = FALSE;
+	priv->rtt_fence_sent = 0;
+	priv->rtt = 0;
+	priv->update_request_time = 0;
+
+	g_free(priv->encodings);
+	priv->encodings = NULL;
+	priv->n_encodings = 0;
+	g_free(priv->encoding_choice);
+	priv->encoding_choice = NULL;
+	vnc_connection_auto_reset(conn);
+
 	priv->auth_type = VNC_CONNECTION_AUTH_INVALID;
 	priv->auth_subtype = VNC_CONNECTION_AUTH_INVALID;
 	priv->sharedFlag = FALSE;
@@ -4427,6 +6822,8 @@ gboolean vnc_connection_is_open(VncConnection *conn)
 		return TRUE;
 	if (priv->host)
 		return TRUE;
+	if (priv->replay_filename)
+		return TRUE;
 	return FALSE;
 }
 
@@ -4520,6 +6917,8 @@ static gboolean vnc_connection_initialize(VncConnection *conn)
 	if (vnc_connection_has_error(conn))
 		return FALSE;
 
+	vnc_connection_record_begin(conn);
+
 	memset(&priv->strm, 0, sizeof(priv->strm));
 	/* FIXME what level? */
 	for (i = 0; i < 5; i++)
@@ -4649,7 +7048,10 @@ static void *vnc_connection_coroutine(void *opaque)
 
 	VNC_DEBUG("Started background coroutine");
 
-	if (priv->fd != -1) {
+	if (priv->replay_filename) {
+		if (!vnc_connection_open_replay_internal(conn))
+			goto cleanup;
+	} else if (priv->fd != -1) {
 		if (!vnc_connection_open_fd_internal(conn))
 			goto cleanup;
 	} else {
@@ -4738,6 +7140,34 @@ gboolean vnc_connection_open_host(VncConnection *conn, const char *host, const c
 	return TRUE;
 }
 
+/*
+ * Play back an FBS recording made by vnc_connection_start_recording
+ * in place of a server. Anything the client sends is discarded. With
+ * 'realtime' the stream is paced to match the recorded timestamps,
+ * otherwise it is decoded as fast as possible
+ */
+gboolean vnc_connection_open_replay(VncConnection *conn, const char *filename,
+				    gboolean realtime)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	VNC_DEBUG("Open replay=%s realtime=%d", filename, realtime);
+
+	if (vnc_connection_is_open(conn))
+		return FALSE;
+
+	priv->fd = -1;
+	priv->host = NULL;
+	priv->port = NULL;
+	priv->replay_filename = g_strdup(filename);
+	priv->replay_realtime = realtime;
+
+	g_object_ref(G_OBJECT(conn)); /* Unref'd when co-routine exits */
+	priv->open_id = g_idle_add(do_vnc_connection_open, conn);
+
+	return TRUE;
+}
+
 
 gboolean vnc_connection_set_auth_type(VncConnection *conn, unsigned int type)
 {
@@ -4900,8 +7330,6 @@ gboolean vnc_connection_set_framebuffer(VncConnection *conn, VncFramebuffer *fb)
         if (i == 4) i = 3;
 
 	priv->rich_cursor_blt = vnc_connection_rich_cursor_blt_table[i - 1];
-	priv->tight_compute_predicted = vnc_connection_tight_compute_predicted_table[i - 1];
-	priv->tight_sum_pixel = vnc_connection_tight_sum_pixel_table[i - 1];
 
 	return !vnc_connection_has_error(conn);
 }
@@ -4949,6 +7377,177 @@ gboolean vnc_connection_get_abs_pointer(VncConnection *conn)
 	return priv->absPointer;
 }
 
+void vnc_connection_set_buffer_size(VncConnection *conn, guint size)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	VNC_DEBUG("Set buffer size %u", size);
+
+	/* Takes effect the next time each buffer is refilled
+	 * or flushed */
+	priv->buffer_size = MIN(size, VNC_CONNECTION_BUFFER_MAX);
+}
+
+guint vnc_connection_get_buffer_size(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	return priv->buffer_size;
+}
+
+gboolean vnc_connection_set_threaded_decode(VncConnection *conn, gboolean enable)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	if (enable && !g_thread_supported()) {
+		VNC_DEBUG("Threaded decode requires the GLib thread system");
+		return FALSE;
+	}
+
+	/* Takes effect from the next Tight rectangle, which waits
+	 * for any still queued when going back to inline decoding */
+	priv->threaded_decode = enable;
+
+	return TRUE;
+}
+
+gboolean vnc_connection_get_threaded_decode(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	return priv->threaded_decode;
+}
+
+void vnc_connection_set_auto_encoding(VncConnection *conn, gboolean enable)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	gboolean probing = priv->auto_probe != -1;
+	int i;
+
+	if (priv->auto_encoding == enable)
+		return;
+
+	priv->auto_encoding = enable;
+	priv->auto_probe = -1;
+	priv->auto_last_eval = 0;
+	priv->auto_window_bytes = 0;
+	priv->auto_window_wait = 0;
+	for (i = 0; i < VNC_CONNECTION_AUTO_ENCODINGS; i++) {
+		priv->auto_costs[i].pixels = 0;
+		priv->auto_costs[i].bytes = 0;
+		priv->auto_costs[i].decode_time = 0;
+	}
+
+	if (enable)
+		return;
+
+	if (priv->encoding_choice) {
+		g_free(priv->encoding_choice);
+		priv->encoding_choice = NULL;
+		g_object_notify(G_OBJECT(conn), "encoding-choice");
+	}
+
+	/* Go back to the client's own preference order */
+	if (priv->encodings) {
+		int preferred = -1;
+
+		for (i = 0; i < priv->n_encodings && preferred == -1; i++)
+			preferred = vnc_connection_auto_index(priv->encodings[i]);
+		if (probing || preferred != priv->auto_current) {
+			priv->auto_current = preferred;
+			vnc_connection_write_encodings(conn);
+		}
+	}
+}
+
+gboolean vnc_connection_get_auto_encoding(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	return priv->auto_encoding;
+}
+
+/*
+ * Returns a copy of the reason behind the current automatic
+ * encoding choice, to be released with g_free(), or NULL if
+ * there isn't one yet. Changes are announced through the
+ * "encoding-choice" property's notify signal.
+ */
+char *vnc_connection_get_encoding_choice(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	return g_strdup(priv->encoding_choice);
+}
+
+gboolean vnc_connection_get_continuous_updates(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	return priv->continuous_updates == VNC_CONNECTION_CONTINUOUS_ON;
+}
+
+/* Last measured round trip time in microseconds, or 0 if unknown */
+guint vnc_connection_get_round_trip_time(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	return priv->rtt;
+}
+
+/* Counters are cumulative over the life of the connection object.
+ * Safe to call from any thread; free the result with vnc_stats_free */
+VncStats *vnc_connection_get_stats(VncConnection *conn)
+{
+	VncConnectionPrivate *priv = conn->priv;
+	VncStats *stats;
+
+	g_mutex_lock(priv->stats_lock);
+	stats = vnc_stats_copy(&priv->stats_snapshot);
+	g_mutex_unlock(priv->stats_lock);
+
+	return stats;
+}
+
+/*
+ * Record everything the server sends to 'filename' in the FBS
+ * format. Zlib based encodings carry state across the whole
+ * session, so this must be called before the connection is
+ * initialized for the recording to replay
+ */
+gboolean vnc_connection_start_recording(VncConnection *conn,
+					const char *filename,
+					GError **error)
+{
+	VncConnectionPrivate *priv = conn->priv;
+
+	if (priv->record_file) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+			    "%s", "A recording is already in progress");
+		return FALSE;
+	}
+	if (vnc_connection_is_initialized(conn)) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+			    "%s", "Recording must start before the connection is initialized");
+		return FALSE;
+	}
+
+	if (!(priv->record_file = fopen(filename, "wb"))) {
+		int err = errno;
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+			    "Unable to open %s: %s", filename, g_strerror(err));
+		return FALSE;
+	}
+
+	VNC_DEBUG("Recording to %s", filename);
+	return TRUE;
+}
+
+void vnc_connection_stop_recording(VncConnection *conn)
+{
+	vnc_connection_record_end(conn);
+}
+
 /*
  * Local variables:
  *  c-indent-level: 8
@@ -27,6 +27,7 @@
 #include <vncframebuffer.h>
 #include <vnccursor.h>
 #include <vncutil.h>
+#include <vncstats.h>
 
 G_BEGIN_DECLS
 
@@ -41,6 +42,7 @@ G_BEGIN_DECLS
 typedef struct _VncConnection VncConnection;
 typedef struct _VncConnectionPrivate VncConnectionPrivate;
 typedef struct _VncConnectionClass VncConnectionClass;
+typedef struct _VncConnectionRect VncConnectionRect;
 
 struct _VncConnection
 {
@@ -51,6 +53,14 @@ struct _VncConnection
 	/* Do not add fields to this struct */
 };
 
+struct _VncConnectionRect
+{
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
 struct _VncConnectionClass
 {
 	GObjectClass parent_class;
@@ -71,12 +81,14 @@ struct _VncConnectionClass
 	void (*vnc_connected)(VncConnection *conn);
 	void (*vnc_initialized)(VncConnection *conn);
 	void (*vnc_disconnected)(VncConnection *conn);
+	void (*vnc_framebuffer_update_region)(VncConnection *conn, const VncConnectionRect *rects, guint nrects);
+	void (*vnc_framebuffer_update_complete)(VncConnection *conn);
 
 	/*
 	 * If adding fields to this struct, remove corresponding
 	 * amount of padding to avoid changing overall struct size
 	 */
-	gpointer _vnc_reserved[VNC_PADDING_LARGE];
+	gpointer _vnc_reserved[VNC_PADDING_LARGE - 2];
 };
 
 
@@ -103,6 +115,7 @@ typedef enum {
 
 	/* Pseudo encodings */
 	VNC_CONNECTION_ENCODING_DESKTOP_RESIZE = -223,
+	VNC_CONNECTION_ENCODING_LAST_RECT = -224,
         VNC_CONNECTION_ENCODING_WMVi = 0x574D5669,
 
 	VNC_CONNECTION_ENCODING_CURSOR_POS = -232,
@@ -111,6 +124,9 @@ typedef enum {
 
 	VNC_CONNECTION_ENCODING_POINTER_CHANGE = -257,
 	VNC_CONNECTION_ENCODING_EXT_KEY_EVENT = -258,
+
+	VNC_CONNECTION_ENCODING_FENCE = -312,
+	VNC_CONNECTION_ENCODING_CONTINUOUS_UPDATES = -313,
 } VncConnectionEncoding;
 
 typedef enum {
@@ -154,6 +170,8 @@ VncConnection *vnc_connection_new(void);
 
 gboolean vnc_connection_open_fd(VncConnection *conn, int fd);
 gboolean vnc_connection_open_host(VncConnection *conn, const char *host, const char *port);
+gboolean vnc_connection_open_replay(VncConnection *conn, const char *filename,
+				    gboolean realtime);
 gboolean vnc_connection_is_open(VncConnection *conn);
 void vnc_connection_shutdown(VncConnection *conn);
 
@@ -201,6 +219,26 @@ VncCursor *vnc_connection_get_cursor(VncConnection *conn);
 gboolean vnc_connection_get_abs_pointer(VncConnection *conn);
 gboolean vnc_connection_get_ext_key_event(VncConnection *conn);
 
+void vnc_connection_set_buffer_size(VncConnection *conn, guint size);
+guint vnc_connection_get_buffer_size(VncConnection *conn);
+
+gboolean vnc_connection_set_threaded_decode(VncConnection *conn, gboolean enable);
+gboolean vnc_connection_get_threaded_decode(VncConnection *conn);
+
+gboolean vnc_connection_get_continuous_updates(VncConnection *conn);
+guint vnc_connection_get_round_trip_time(VncConnection *conn);
+
+VncStats *vnc_connection_get_stats(VncConnection *conn);
+
+gboolean vnc_connection_start_recording(VncConnection *conn,
+					const char *filename,
+					GError **error);
+void vnc_connection_stop_recording(VncConnection *conn);
+
+void vnc_connection_set_auto_encoding(VncConnection *conn, gboolean enable);
+gboolean vnc_connection_get_auto_encoding(VncConnection *conn);
+char *vnc_connection_get_encoding_choice(VncConnection *conn);
+
 G_END_DECLS
 
 #endif /* VNC_CONNECTION_H */
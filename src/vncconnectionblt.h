@@ -25,12 +25,9 @@
 #define SPLICE_I(a, b) a ## b
 #define SPLICE(a, b) SPLICE_I(a, b)
 #define src_pixel_t SPLICE(guint, SRC)
-#define ssrc_pixel_t SPLICE(gint, SRC)
 #define dst_pixel_t SPLICE(guint, DST)
 #define SUFFIX() SPLICE(SRC,SPLICE(x,DST))
 #define RICH_CURSOR_BLIT SPLICE(vnc_connection_rich_cursor_blt_, SUFFIX())
-#define TIGHT_COMPUTE_PREDICTED SPLICE(vnc_connection_tight_compute_predicted_, SUFFIX())
-#define TIGHT_SUM_PIXEL SPLICE(vnc_connection_tight_sum_pixel_, SUFFIX())
 #define SWAP_RFB(conn, pixel) SPLICE(vnc_connection_swap_rfb_, SRC)(conn, pixel)
 #define SWAP_IMG(conn, pixel) SPLICE(vnc_connection_swap_img_, DST)(conn, pixel)
 #define COMPONENT(color, pixel) ((SWAP_RFB(conn, pixel) >> priv->fmt.SPLICE(color, _shift) & priv->fmt.SPLICE(color, _max)))
@@ -98,64 +95,15 @@ static void RICH_CURSOR_BLIT(VncConnection *conn, guint8 *pixbuf,
 }
 #endif
 
-
-#if SRC == DST
-
-static void TIGHT_COMPUTE_PREDICTED(VncConnection *conn, src_pixel_t *ppixel,
-				    src_pixel_t *lp, src_pixel_t *cp,
-				    src_pixel_t *llp)
-{
-	VncConnectionPrivate *priv = conn->priv;
-	ssrc_pixel_t red, green, blue;
-
-	red = COMPONENT(red, *lp) + COMPONENT(red, *cp) - COMPONENT(red, *llp);
-	red = MAX(red, 0);
-	red = MIN(red, priv->fmt.red_max);
-
-	green = COMPONENT(green, *lp) + COMPONENT(green, *cp) - COMPONENT(green, *llp);
-	green = MAX(green, 0);
-	green = MIN(green, priv->fmt.green_max);
-
-	blue = COMPONENT(blue, *lp) + COMPONENT(blue, *cp) - COMPONENT(blue, *llp);
-	blue = MAX(blue, 0);
-	blue = MIN(blue, priv->fmt.blue_max);
-
-	*ppixel = SWAP_RFB(conn,
-		       (red << priv->fmt.red_shift) |
-		       (green << priv->fmt.green_shift) |
-		       (blue << priv->fmt.blue_shift));
-}
-
-static void TIGHT_SUM_PIXEL(VncConnection *conn,
-			    src_pixel_t *lhs, src_pixel_t *rhs)
-{
-	VncConnectionPrivate *priv = conn->priv;
-	src_pixel_t red, green, blue;
-
-	red = COMPONENT(red, *lhs) + COMPONENT(red, *rhs);
-	green = COMPONENT(green, *lhs) + COMPONENT(green, *rhs);
-	blue = COMPONENT(blue, *lhs) + COMPONENT(blue, *rhs);
-
-	*lhs = SWAP_RFB(conn,
-		    ((red & priv->fmt.red_max) << priv->fmt.red_shift) |
-		    ((green & priv->fmt.green_max) << priv->fmt.green_shift) |
-		    ((blue & priv->fmt.blue_max) << priv->fmt.blue_shift));
-}
-
-#endif
-
 #undef SPLICE
 #undef SPLICE_T
 #undef SUFFIX
 #undef RICH_CURSOR_BLIT
-#undef TIGHT_SUM_PIXEL
-#undef TIGHT_COMPUTE_PREDICTED
 #undef SWAP_RFB
 #undef SWAP_IMG
 #undef COMPONENT
 #undef dst_pixel_t
 #undef src_pixel_t
-#undef ssrc_pixel_t
 
 
 /*
@@ -43,6 +43,12 @@
 #define VNC_DISPLAY_GET_PRIVATE(obj) \
       (G_TYPE_INSTANCE_GET_PRIVATE((obj), VNC_TYPE_DISPLAY, VncDisplayPrivate))
 
+#define VNC_DISPLAY_MAX_PENDING_UPDATES 16
+
+/* Room for the requests made on resizes and format changes,
+ * which may go beyond max-pending-updates */
+#define VNC_DISPLAY_REQUEST_TIMES (VNC_DISPLAY_MAX_PENDING_UPDATES + 4)
+
 struct _VncDisplayPrivate
 {
 	GdkPixmap *pixmap;
@@ -75,6 +81,22 @@ struct _VncDisplayPrivate
 	gboolean shared_flag;
 	gboolean force_size;
 
+	/* Update requests the server has yet to answer, and when
+	 * each was sent, oldest first from request_head */
+	guint pending_updates;
+	guint max_pending_updates;
+	gint64 request_times[VNC_DISPLAY_REQUEST_TIMES];
+	guint request_head;
+	/* Quickest any request has been answered, in microseconds */
+	gint64 min_update_latency;
+	/* Damage queued for drawing but not yet exposed */
+	gboolean paint_pending;
+	/* Source clearing paint_pending should no expose arrive */
+	guint paint_timeout;
+	/* When the oldest unpainted damage arrived, in microseconds */
+	gint64 damage_time;
+	VncStatsHistogram paint_latency;
+
 	GSList *preferable_auths;
 	GSList *preferable_vencrypt_subauths;
 	size_t keycode_maplen;
@@ -86,6 +108,10 @@ struct _VncDisplayPrivate
 
 G_DEFINE_TYPE(VncDisplay, vnc_display, GTK_TYPE_DRAWING_AREA)
 
+/* How long, in milliseconds, to wait on an expose that may never
+ * come, such as when the damage is hidden behind another window */
+#define VNC_DISPLAY_PAINT_TIMEOUT 100
+
 /* Properties */
 enum
 {
@@ -103,6 +129,9 @@ enum
   PROP_FORCE_SIZE,
   PROP_DEPTH,
   PROP_GRAB_KEYS,
+  PROP_MAX_PENDING_UPDATES,
+  PROP_AUTO_ENCODING,
+  PROP_ENCODING_CHOICE,
 };
 
 /* Signals */
@@ -199,6 +228,15 @@ vnc_display_get_property (GObject    *object,
       case PROP_GRAB_KEYS:
 	g_value_set_boxed(value, vnc->priv->vncgrabseq);
 	break;
+      case PROP_MAX_PENDING_UPDATES:
+	g_value_set_uint(value, vnc->priv->max_pending_updates);
+	break;
+      case PROP_AUTO_ENCODING:
+	g_value_set_boolean(value, vnc_display_get_auto_encoding(vnc));
+	break;
+      case PROP_ENCODING_CHOICE:
+	g_value_take_string(value, vnc_display_get_encoding_choice(vnc));
+	break;
       default:
 	G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 	break;
@@ -245,6 +283,12 @@ vnc_display_set_property (GObject      *object,
       case PROP_GRAB_KEYS:
 	vnc_display_set_grab_keys(vnc, g_value_get_boxed(value));
 	break;
+      case PROP_MAX_PENDING_UPDATES:
+	vnc_display_set_max_pending_updates(vnc, g_value_get_uint(value));
+	break;
+      case PROP_AUTO_ENCODING:
+	vnc_display_set_auto_encoding(vnc, g_value_get_boolean(value));
+	break;
       default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
         break;
@@ -276,6 +320,93 @@ static GdkCursor *create_null_cursor(void)
 	return cursor;
 }
 
+static gint64 vnc_display_now(void)
+{
+	GTimeVal now;
+
+	g_get_current_time(&now);
+	return (gint64)now.tv_sec * G_USEC_PER_SEC + now.tv_usec;
+}
+
+static gboolean vnc_display_is_drawable(GtkWidget *widget)
+{
+#if GTK_CHECK_VERSION (2, 18, 0)
+	return gtk_widget_is_drawable(widget);
+#else
+	return GTK_WIDGET_DRAWABLE(widget);
+#endif
+}
+
+static void vnc_display_request_sent(VncDisplay *obj)
+{
+	VncDisplayPrivate *priv = obj->priv;
+
+	/* Should the server never answer, forget the oldest */
+	if (priv->pending_updates == VNC_DISPLAY_REQUEST_TIMES) {
+		priv->request_head = (priv->request_head + 1) % VNC_DISPLAY_REQUEST_TIMES;
+		priv->pending_updates--;
+	}
+
+	priv->request_times[(priv->request_head + priv->pending_updates) %
+			    VNC_DISPLAY_REQUEST_TIMES] = vnc_display_now();
+	priv->pending_updates++;
+}
+
+static void vnc_display_request_answered(VncDisplay *obj)
+{
+	VncDisplayPrivate *priv = obj->priv;
+
+	priv->request_head = (priv->request_head + 1) % VNC_DISPLAY_REQUEST_TIMES;
+	priv->pending_updates--;
+}
+
+/*
+ * Top up the incremental update requests outstanding with the
+ * server, unless the previous update has yet to be painted
+ */
+static void vnc_display_request_updates(VncDisplay *obj)
+{
+	VncDisplayPrivate *priv = obj->priv;
+
+	if (!priv->conn || !vnc_connection_is_initialized(priv->conn))
+		return;
+
+	while (!priv->paint_pending &&
+	       priv->pending_updates < priv->max_pending_updates) {
+		if (!vnc_connection_framebuffer_update_request(priv->conn, 1,
+							       0, 0,
+							       vnc_connection_get_width(priv->conn),
+							       vnc_connection_get_height(priv->conn)))
+			return;
+		vnc_display_request_sent(obj);
+	}
+}
+
+static void vnc_display_cancel_paint(VncDisplay *obj)
+{
+	VncDisplayPrivate *priv = obj->priv;
+
+	priv->paint_pending = FALSE;
+	if (priv->paint_timeout) {
+		g_source_remove(priv->paint_timeout);
+		priv->paint_timeout = 0;
+	}
+}
+
+static gboolean vnc_display_paint_timeout(gpointer opaque)
+{
+	VncDisplay *obj = VNC_DISPLAY(opaque);
+	VncDisplayPrivate *priv = obj->priv;
+
+	VNC_DEBUG("No expose for queued damage, resuming updates");
+	priv->paint_timeout = 0;
+	priv->paint_pending = FALSE;
+	priv->damage_time = 0;
+	vnc_display_request_updates(obj);
+
+	return FALSE;
+}
+
 static gboolean expose_event(GtkWidget *widget, GdkEventExpose *expose)
 {
 	VncDisplay *obj = VNC_DISPLAY(widget);
@@ -348,6 +479,19 @@ static gboolean expose_event(GtkWidget *widget, GdkEventExpose *expose)
 
 	cairo_destroy(cr);
 
+	if (priv->damage_time) {
+		gint64 latency = vnc_display_now() - priv->damage_time;
+
+		vnc_stats_histogram_record(&priv->paint_latency, MAX(latency, 0));
+		priv->damage_time = 0;
+	}
+
+	/* Rendering has caught up, so allow more updates in */
+	if (priv->paint_pending) {
+		vnc_display_cancel_paint(obj);
+		vnc_display_request_updates(obj);
+	}
+
 	return TRUE;
 }
 
@@ -815,9 +959,10 @@ static gboolean focus_event(GtkWidget *widget, GdkEventFocus *focus G_GNUC_UNUSE
         return TRUE;
 }
 
-static void on_framebuffer_update(VncConnection *conn G_GNUC_UNUSED,
-				  int x, int y, int w, int h,
-				  gpointer opaque)
+static void on_framebuffer_update_region(VncConnection *conn G_GNUC_UNUSED,
+					 const VncConnectionRect *rects,
+					 guint nrects,
+					 gpointer opaque)
 {
 	GtkWidget *widget = GTK_WIDGET(opaque);
 	VncDisplay *obj = VNC_DISPLAY(widget);
@@ -826,12 +971,17 @@ static void on_framebuffer_update(VncConnection *conn G_GNUC_UNUSED,
 	int fbw, fbh;
 	cairo_surface_t *surface;
 	cairo_t *cr;
+	gboolean visible = FALSE;
+	guint i;
 
 	fbw = vnc_framebuffer_get_width(VNC_FRAMEBUFFER(priv->fb));
 	fbh = vnc_framebuffer_get_height(VNC_FRAMEBUFFER(priv->fb));
 
+	/* Copy the whole damaged region to the pixmap in one paint */
 	cr = gdk_cairo_create(priv->pixmap);
-	cairo_rectangle(cr, x, y, w, h);
+	for (i = 0; i < nrects; i++)
+		cairo_rectangle(cr, rects[i].x, rects[i].y,
+				rects[i].width, rects[i].height);
 	cairo_clip(cr);
 
 	surface = vnc_cairo_framebuffer_get_surface(priv->fb);
@@ -842,37 +992,90 @@ static void on_framebuffer_update(VncConnection *conn G_GNUC_UNUSED,
 
 	gdk_drawable_get_size(gtk_widget_get_window(widget), &ww, &wh);
 
-	if (priv->allow_scaling) {
-		double sx, sy;
+	for (i = 0; i < nrects; i++) {
+		int x = rects[i].x;
+		int y = rects[i].y;
+		int w = rects[i].width;
+		int h = rects[i].height;
 
-		/* Scale the VNC region to produce expose region */
+		if (priv->allow_scaling) {
+			double sx, sy;
 
-		sx = (double)ww / (double)fbw;
-		sy = (double)wh / (double)fbh;
-		x *= sx;
-		y *= sy;
-		w *= sx;
-		h *= sy;
-	} else {
-		int mw = 0, mh = 0;
+			/* Scale the VNC region to produce expose region */
 
-		/* Offset the VNC region to produce expose region */
+			sx = (double)ww / (double)fbw;
+			sy = (double)wh / (double)fbh;
+			x *= sx;
+			y *= sy;
+			w *= sx;
+			h *= sy;
+		} else {
+			int mw = 0, mh = 0;
 
-		if (ww > fbw)
-			mw = (ww - fbw) / 2;
-		if (wh > fbh)
-			mh = (wh - fbh) / 2;
+			/* Offset the VNC region to produce expose region */
+
+			if (ww > fbw)
+				mw = (ww - fbw) / 2;
+			if (wh > fbh)
+				mh = (wh - fbh) / 2;
+
+			x += mw;
+			y += mh;
+		}
+
+		if (x < ww && y < wh && x + w + 1 > 0 && y + h + 1 > 0)
+			visible = TRUE;
+
+		gtk_widget_queue_draw_area(widget, x, y, w + 1, h + 1);
+	}
+
+	/* Hold back further requests until this is painted, unless
+	 * none of it is visible, in which case no expose will arrive.
+	 * Nor will one if the widget is covered, so don't wait forever */
+	if (visible && vnc_display_is_drawable(widget)) {
+		priv->paint_pending = TRUE;
+		if (!priv->damage_time)
+			priv->damage_time = vnc_display_now();
+		if (!priv->paint_timeout)
+			priv->paint_timeout = g_timeout_add(VNC_DISPLAY_PAINT_TIMEOUT,
+							    vnc_display_paint_timeout,
+							    obj);
+	}
+}
+
+static void on_framebuffer_update_complete(VncConnection *conn G_GNUC_UNUSED,
+					   gpointer opaque)
+{
+	VncDisplay *obj = VNC_DISPLAY(opaque);
+	VncDisplayPrivate *priv = obj->priv;
 
-		x += mw;
-		y += mh;
+	gint64 now = vnc_display_now();
+	gint64 latency;
+
+	if (!priv->pending_updates) {
+		vnc_display_request_updates(obj);
+		return;
 	}
 
-	gtk_widget_queue_draw_area(widget, x, y, w + 1, h + 1);
+	/* Each update answers at least the oldest request */
+	latency = now - priv->request_times[priv->request_head];
+	vnc_display_request_answered(obj);
+	if (latency > 0 &&
+	    (!priv->min_update_latency || latency < priv->min_update_latency))
+		priv->min_update_latency = latency;
 
-	vnc_connection_framebuffer_update_request(priv->conn, 1,
-						  0, 0,
-						  vnc_connection_get_width(priv->conn),
-						  vnc_connection_get_height(priv->conn));
+	/* Servers typically merge all the requests they have received
+	 * into one update, so counting one answer per update would
+	 * overcount, and leave just one request really outstanding.
+	 * Anything sent longer ago than the quickest answer we've seen
+	 * must have reached the server in time, so take it as answered
+	 * too. A server that did queue its answers would just get
+	 * a few more requests than max-pending-updates */
+	while (priv->pending_updates &&
+	       now - priv->request_times[priv->request_head] >= priv->min_update_latency)
+		vnc_display_request_answered(obj);
+
+	vnc_display_request_updates(obj);
 }
 
 
@@ -930,7 +1133,8 @@ static void on_desktop_resize(VncConnection *conn G_GNUC_UNUSED,
 
 	do_framebuffer_init(opaque, remoteFormat, width, height, FALSE);
 
-	vnc_connection_framebuffer_update_request(priv->conn, 0, 0, 0, width, height);
+	if (vnc_connection_framebuffer_update_request(priv->conn, 0, 0, 0, width, height))
+		vnc_display_request_sent(obj);
 }
 
 static void on_pixel_format_changed(VncConnection *conn G_GNUC_UNUSED,
@@ -944,7 +1148,8 @@ static void on_pixel_format_changed(VncConnection *conn G_GNUC_UNUSED,
 
 	do_framebuffer_init(opaque, remoteFormat, width, height, TRUE);
 
-	vnc_connection_framebuffer_update_request(priv->conn, 0, 0, 0, width, height);
+	if (vnc_connection_framebuffer_update_request(priv->conn, 0, 0, 0, width, height))
+		vnc_display_request_sent(obj);
 }
 
 static gboolean vnc_display_set_preferred_pixel_format(VncDisplay *display)
@@ -1181,6 +1386,15 @@ static void on_bell(VncConnection *conn G_GNUC_UNUSED,
 	g_signal_emit(G_OBJECT(obj), signals[VNC_BELL], 0);
 }
 
+static void on_encoding_choice_changed(VncConnection *conn G_GNUC_UNUSED,
+				      GParamSpec *pspec G_GNUC_UNUSED,
+				      gpointer opaque)
+{
+	VncDisplay *obj = VNC_DISPLAY(opaque);
+
+	g_object_notify(G_OBJECT(obj), "encoding-choice");
+}
+
 static void on_cursor_changed(VncConnection *conn G_GNUC_UNUSED,
 			      VncCursor *cursor,
 			      gpointer opaque)
@@ -1270,10 +1484,13 @@ static void on_initialized(VncConnection *conn G_GNUC_UNUSED,
 				VNC_CONNECTION_ENCODING_TIGHT,
 				VNC_CONNECTION_ENCODING_EXT_KEY_EVENT,
 				VNC_CONNECTION_ENCODING_DESKTOP_RESIZE,
+				VNC_CONNECTION_ENCODING_LAST_RECT,
                                 VNC_CONNECTION_ENCODING_WMVi,
 				VNC_CONNECTION_ENCODING_RICH_CURSOR,
 				VNC_CONNECTION_ENCODING_XCURSOR,
 				VNC_CONNECTION_ENCODING_POINTER_CHANGE,
+				VNC_CONNECTION_ENCODING_FENCE,
+				VNC_CONNECTION_ENCODING_CONTINUOUS_UPDATES,
 				VNC_CONNECTION_ENCODING_ZRLE,
 				VNC_CONNECTION_ENCODING_HEXTILE,
 				VNC_CONNECTION_ENCODING_RRE,
@@ -1320,10 +1537,16 @@ static void on_initialized(VncConnection *conn G_GNUC_UNUSED,
 		goto error;
 
 	VNC_DEBUG("Requesting first framebuffer update");
+	priv->pending_updates = 0;
+	priv->request_head = 0;
+	priv->min_update_latency = 0;
+	vnc_display_cancel_paint(obj);
+	priv->damage_time = 0;
 	if (!vnc_connection_framebuffer_update_request(priv->conn, 0, 0, 0,
 						       vnc_connection_get_width(priv->conn),
 						       vnc_connection_get_height(priv->conn)))
 		goto error;
+	vnc_display_request_sent(obj);
 
 	g_signal_emit(G_OBJECT(obj), signals[VNC_INITIALIZED], 0);
 
@@ -1476,6 +1699,7 @@ static void vnc_display_finalize (GObject *obj)
 	VncDisplayPrivate *priv = display->priv;
 
 	VNC_DEBUG("Releasing VNC widget");
+	vnc_display_cancel_paint(display);
 	if (vnc_connection_is_open(priv->conn)) {
 		g_warning("VNC widget finalized before the connection finished shutting down\n");
 	}
@@ -1679,6 +1903,39 @@ static void vnc_display_class_init(VncDisplayClass *klass)
 							     G_PARAM_STATIC_NAME |
 							     G_PARAM_STATIC_NICK |
 							     G_PARAM_STATIC_BLURB));
+	g_object_class_install_property (object_class,
+					 PROP_MAX_PENDING_UPDATES,
+					 g_param_spec_uint   ( "max-pending-updates",
+							       "Max pending updates",
+							       "Maximum framebuffer update requests to keep outstanding",
+							       1,
+							       VNC_DISPLAY_MAX_PENDING_UPDATES,
+							       2,
+							       G_PARAM_READWRITE |
+							       G_PARAM_CONSTRUCT |
+							       G_PARAM_STATIC_NAME |
+							       G_PARAM_STATIC_NICK |
+							       G_PARAM_STATIC_BLURB));
+	g_object_class_install_property (object_class,
+					 PROP_AUTO_ENCODING,
+					 g_param_spec_boolean ( "auto-encoding",
+								"Auto encoding",
+								"Whether to pick the encoding from measured link and decode speed",
+								FALSE,
+								G_PARAM_READWRITE |
+								G_PARAM_STATIC_NAME |
+								G_PARAM_STATIC_NICK |
+								G_PARAM_STATIC_BLURB));
+	g_object_class_install_property (object_class,
+					 PROP_ENCODING_CHOICE,
+					 g_param_spec_string  ( "encoding-choice",
+								"Encoding choice",
+								"The automatically picked encoding, and why",
+								NULL,
+								G_PARAM_READABLE |
+								G_PARAM_STATIC_NAME |
+								G_PARAM_STATIC_NICK |
+								G_PARAM_STATIC_BLURB));
 
 	signals[VNC_CONNECTED] =
 		g_signal_new ("vnc-connected",
@@ -1920,8 +2177,10 @@ static void vnc_display_init(VncDisplay *display)
 			 G_CALLBACK(on_bell), display);
 	g_signal_connect(G_OBJECT(priv->conn), "vnc-server-cut-text",
 			 G_CALLBACK(on_server_cut_text), display);
-	g_signal_connect(G_OBJECT(priv->conn), "vnc-framebuffer-update",
-			 G_CALLBACK(on_framebuffer_update), display);
+	g_signal_connect(G_OBJECT(priv->conn), "vnc-framebuffer-update-region",
+			 G_CALLBACK(on_framebuffer_update_region), display);
+	g_signal_connect(G_OBJECT(priv->conn), "vnc-framebuffer-update-complete",
+			 G_CALLBACK(on_framebuffer_update_complete), display);
 	g_signal_connect(G_OBJECT(priv->conn), "vnc-desktop-resize",
 			 G_CALLBACK(on_desktop_resize), display);
 	g_signal_connect(G_OBJECT(priv->conn), "vnc-pixel-format-changed",
@@ -1942,6 +2201,8 @@ static void vnc_display_init(VncDisplay *display)
 			 G_CALLBACK(on_initialized), display);
 	g_signal_connect(G_OBJECT(priv->conn), "vnc-disconnected",
 			 G_CALLBACK(on_disconnected), display);
+	g_signal_connect(G_OBJECT(priv->conn), "notify::encoding-choice",
+			 G_CALLBACK(on_encoding_choice_changed), display);
 
 	priv->keycode_map = vnc_display_keymap_gdk2rfb_table(&priv->keycode_maplen);
 }
@@ -2131,6 +2392,66 @@ gboolean vnc_display_get_scaling(VncDisplay *obj)
 	return obj->priv->allow_scaling;
 }
 
+/*
+ * More requests in flight hide more network latency, at the
+ * cost of the server sending updates we may not yet be able
+ * to render. Clamped to 1 .. VNC_DISPLAY_MAX_PENDING_UPDATES.
+ *
+ * Servers usually merge outstanding requests into one update, so
+ * each update is taken to answer every request that could have
+ * reached the server before it was sent, not just the oldest.
+ */
+void vnc_display_set_max_pending_updates(VncDisplay *obj, guint count)
+{
+	g_return_if_fail (VNC_IS_DISPLAY (obj));
+
+	obj->priv->max_pending_updates = CLAMP(count, 1, VNC_DISPLAY_MAX_PENDING_UPDATES);
+
+	vnc_display_request_updates(obj);
+}
+
+guint vnc_display_get_max_pending_updates(VncDisplay *obj)
+{
+	g_return_val_if_fail (VNC_IS_DISPLAY (obj), 0);
+
+	return obj->priv->max_pending_updates;
+}
+
+void vnc_display_set_auto_encoding(VncDisplay *obj, gboolean enable)
+{
+	g_return_if_fail (VNC_IS_DISPLAY (obj));
+
+	vnc_connection_set_auto_encoding(obj->priv->conn, enable);
+}
+
+gboolean vnc_display_get_auto_encoding(VncDisplay *obj)
+{
+	g_return_val_if_fail (VNC_IS_DISPLAY (obj), FALSE);
+
+	return vnc_connection_get_auto_encoding(obj->priv->conn);
+}
+
+/* Returns a copy to be released with g_free(), or NULL */
+char *vnc_display_get_encoding_choice(VncDisplay *obj)
+{
+	g_return_val_if_fail (VNC_IS_DISPLAY (obj), NULL);
+
+	return vnc_connection_get_encoding_choice(obj->priv->conn);
+}
+
+/* The connection counters, plus the paint latency seen here */
+VncStats *vnc_display_get_stats(VncDisplay *obj)
+{
+	VncStats *stats;
+
+	g_return_val_if_fail (VNC_IS_DISPLAY (obj), NULL);
+
+	stats = vnc_connection_get_stats(obj->priv->conn);
+	stats->paint_latency = obj->priv->paint_latency;
+
+	return stats;
+}
+
 gboolean vnc_display_get_lossy_encoding(VncDisplay *obj)
 {
 	g_return_val_if_fail (VNC_IS_DISPLAY (obj), FALSE);
@@ -25,6 +25,7 @@
 #include <gtk/gtk.h>
 #include <glib.h>
 #include <vncgrabsequence.h>
+#include <vncstats.h>
 
 G_BEGIN_DECLS
 
@@ -130,6 +131,14 @@ gboolean	vnc_display_get_lossy_encoding(VncDisplay *obj);
 gboolean	vnc_display_set_scaling(VncDisplay *obj, gboolean enable);
 gboolean	vnc_display_get_scaling(VncDisplay *obj);
 
+void		vnc_display_set_max_pending_updates(VncDisplay *obj, guint count);
+guint		vnc_display_get_max_pending_updates(VncDisplay *obj);
+
+void		vnc_display_set_auto_encoding(VncDisplay *obj, gboolean enable);
+gboolean	vnc_display_get_auto_encoding(VncDisplay *obj);
+char *		vnc_display_get_encoding_choice(VncDisplay *obj);
+VncStats *	vnc_display_get_stats(VncDisplay *obj);
+
 void		vnc_display_set_force_size(VncDisplay *obj, gboolean enable);
 gboolean	vnc_display_get_force_size(VncDisplay *obj);
 
@@ -108,6 +108,39 @@ void vnc_framebuffer_set_color_map(VncFramebuffer *fb,
 }
 
 
+void vnc_framebuffer_blt_indexed(VncFramebuffer *fb,
+				 guint8 *palette,
+				 int palette_size,
+				 guint8 *indexes,
+				 int bits,
+				 int rowstride,
+				 guint16 x, guint16 y,
+				 guint16 width, guint16 height)
+{
+	VncFramebufferInterface *iface = VNC_FRAMEBUFFER_GET_INTERFACE(fb);
+	guint8 zero[4] = { 0, 0, 0, 0 };
+	int i, j;
+
+	if (iface->blt_indexed) {
+		iface->blt_indexed(fb, palette, palette_size, indexes, bits,
+				   rowstride, x, y, width, height);
+		return;
+	}
+
+	/* Implementations predating blt_indexed */
+	for (j = 0; j < height; j++) {
+		for (i = 0; i < width; i++) {
+			int shift = 8 - bits - ((i * bits) % 8);
+			int ind = (indexes[(i * bits) / 8] >> shift) & ((1 << bits) - 1);
+
+			iface->set_pixel_at(fb, ind < palette_size ? palette + (ind * 4) : zero,
+					    x + i, y + j);
+		}
+		indexes += rowstride;
+	}
+}
+
+
 GType
 vnc_framebuffer_get_type (void)
 {
@@ -72,8 +72,21 @@ struct _VncFramebufferInterface {
 			  guint16 width, guint16 height);
 	void (*set_color_map)(VncFramebuffer *fb,
 			      VncColorMap *map);
-
-	/* Do not add fields to this struct */
+	void (*blt_indexed)(VncFramebuffer *fb,
+			    guint8 *palette, /* Remote pixels, 4 bytes apart */
+			    int palette_size,
+			    guint8 *indexes, /* Packed 1, 2, 4 or 8 bit indexes */
+			    int bits,
+			    int rowstride,
+			    guint16 x, guint16 y,
+			    guint16 width, guint16 height);
+
+	/*
+	 * New methods may only be appended here. Implementations
+	 * built against an older header leave them NULL, so every
+	 * vnc_framebuffer_* wrapper for one must fall back on the
+	 * older methods when it is unset.
+	 */
 };
 
 GType vnc_framebuffer_get_type(void) G_GNUC_CONST;
@@ -118,6 +131,15 @@ void vnc_framebuffer_rgb24_blt(VncFramebuffer *fb,
 void vnc_framebuffer_set_color_map(VncFramebuffer *fb,
 				   VncColorMap *map);
 
+void vnc_framebuffer_blt_indexed(VncFramebuffer *fb,
+				 guint8 *palette, /* Remote pixels, 4 bytes apart */
+				 int palette_size,
+				 guint8 *indexes, /* Packed 1, 2, 4 or 8 bit indexes */
+				 int bits,
+				 int rowstride,
+				 guint16 x, guint16 y,
+				 guint16 width, guint16 height);
+
 
 G_END_DECLS
 
@@ -52,6 +52,9 @@ VncPixelFormat *vnc_pixel_format_new(void);
 VncPixelFormat *vnc_pixel_format_copy(VncPixelFormat *format);
 void vnc_pixel_format_free(VncPixelFormat *format);
 
+gboolean vnc_pixel_format_match(const VncPixelFormat *format,
+				const VncPixelFormat *other);
+
 G_END_DECLS
 
 #endif /* VNC_PIXEL_FORMAT_H */
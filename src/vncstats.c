@@ -0,0 +1,418 @@
+/*
+ * GTK VNC Widget
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <config.h>
+
+#include "vncstats.h"
+#include "vncconnection.h"
+#include "vncconnectionenums.h"
+
+#define VNC_STATS_FIELD(stats, offset) \
+	G_STRUCT_MEMBER(guint64, stats, offset)
+#define VNC_STATS_HISTOGRAM(stats, offset) \
+	((const VncStatsHistogram *)G_STRUCT_MEMBER_P(stats, offset))
+
+static const struct {
+	const char *name;
+	const char *help;
+	gboolean usecs;
+	glong offset;
+} vnc_stats_counters[] = {
+	{ "wire_bytes_read", "Bytes read from the socket", FALSE,
+	  G_STRUCT_OFFSET(VncStats, wire_bytes_read) },
+	{ "wire_bytes_written", "Bytes written to the socket", FALSE,
+	  G_STRUCT_OFFSET(VncStats, wire_bytes_written) },
+	{ "bytes_read", "Protocol bytes read, after TLS/SASL", FALSE,
+	  G_STRUCT_OFFSET(VncStats, bytes_read) },
+	{ "bytes_written", "Protocol bytes written, before TLS/SASL", FALSE,
+	  G_STRUCT_OFFSET(VncStats, bytes_written) },
+	{ "read_syscalls", "Socket read calls", FALSE,
+	  G_STRUCT_OFFSET(VncStats, read_syscalls) },
+	{ "write_syscalls", "Socket write calls", FALSE,
+	  G_STRUCT_OFFSET(VncStats, write_syscalls) },
+	{ "read_wait_time", "Time blocked waiting for data", TRUE,
+	  G_STRUCT_OFFSET(VncStats, read_wait_time) },
+	{ "compressed_bytes", "zlib input consumed", FALSE,
+	  G_STRUCT_OFFSET(VncStats, compressed_bytes) },
+	{ "decompressed_bytes", "zlib output produced", FALSE,
+	  G_STRUCT_OFFSET(VncStats, decompressed_bytes) },
+	{ "inflate_time", "Time spent in zlib inflate", TRUE,
+	  G_STRUCT_OFFSET(VncStats, inflate_time) },
+	{ "coroutine_switches", "Times the connection yielded to the main loop", FALSE,
+	  G_STRUCT_OFFSET(VncStats, coroutine_switches) },
+	{ "updates", "Framebuffer updates received", FALSE,
+	  G_STRUCT_OFFSET(VncStats, updates) },
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+	glong offset;
+} vnc_stats_histograms[] = {
+	{ "update_latency", "Time from an update request to the first rect answering it",
+	  G_STRUCT_OFFSET(VncStats, update_latency) },
+	{ "decode_time", "Time spent decoding each rect",
+	  G_STRUCT_OFFSET(VncStats, decode_time) },
+	{ "paint_latency", "Time from framebuffer damage to it being painted",
+	  G_STRUCT_OFFSET(VncStats, paint_latency) },
+};
+
+static const struct {
+	gdouble percentile;
+	const char *json;
+	const char *quantile;
+} vnc_stats_percentiles[] = {
+	{ 50.0, "p50", "0.5" },
+	{ 90.0, "p90", "0.9" },
+	{ 99.0, "p99", "0.99" },
+	{ 99.9, "p999", "0.999" },
+};
+
+GType vnc_stats_get_type(void)
+{
+	static GType stats_type = 0;
+
+	if (G_UNLIKELY(stats_type == 0)) {
+		stats_type = g_boxed_type_register_static
+			("VncStats",
+			 (GBoxedCopyFunc)vnc_stats_copy,
+			 (GBoxedFreeFunc)vnc_stats_free);
+	}
+
+	return stats_type;
+}
+
+
+VncStats *vnc_stats_new(void)
+{
+	VncStats *stats;
+
+	stats = g_slice_new0(VncStats);
+
+	return stats;
+}
+
+
+VncStats *vnc_stats_copy(VncStats *srcStats)
+{
+	VncStats *stats;
+
+	stats = g_slice_dup(VncStats, srcStats);
+
+	return stats;
+}
+
+
+void vnc_stats_free(VncStats *stats)
+{
+	g_slice_free(VncStats, stats);
+}
+
+
+/*
+ * Find the counters for an encoding, adding them if this
+ * is the first time it has been seen. Returns NULL if the
+ * table is full
+ */
+VncStatsEncoding *vnc_stats_get_encoding(VncStats *stats, gint32 encoding)
+{
+	guint i;
+
+	for (i = 0; i < stats->n_encodings; i++)
+		if (stats->encodings[i].encoding == encoding)
+			return &stats->encodings[i];
+
+	if (stats->n_encodings == VNC_STATS_MAX_ENCODINGS)
+		return NULL;
+
+	stats->encodings[stats->n_encodings].encoding = encoding;
+	return &stats->encodings[stats->n_encodings++];
+}
+
+
+static guint vnc_stats_histogram_index(guint64 value)
+{
+	guint msb;
+
+	if (value > G_MAXUINT32)
+		value = G_MAXUINT32;
+	if (value < 16)
+		return value;
+
+	msb = g_bit_storage((gulong)value) - 1;
+	return 16 + ((msb - 4) * 16) + ((value >> (msb - 4)) & 15);
+}
+
+/* The largest value which lands in a bucket */
+static guint64 vnc_stats_histogram_upper(guint index)
+{
+	guint shift, sub;
+
+	if (index < 16)
+		return index;
+
+	shift = (index - 16) / 16;
+	sub = (index - 16) % 16;
+	return ((guint64)(17 + sub) << shift) - 1;
+}
+
+void vnc_stats_histogram_record(VncStatsHistogram *hist, guint64 value)
+{
+	if (!hist->count || value < hist->min)
+		hist->min = value;
+	if (value > hist->max)
+		hist->max = value;
+	hist->count++;
+	hist->total += value;
+	hist->buckets[vnc_stats_histogram_index(value)]++;
+}
+
+/*
+ * Returns the value below which 'percentile' percent of the
+ * recorded values fall, rounded up to the top of its bucket
+ */
+guint64 vnc_stats_histogram_percentile(const VncStatsHistogram *hist,
+				       gdouble percentile)
+{
+	gdouble rank = hist->count * percentile / 100.0;
+	guint64 target, seen = 0;
+	guint i;
+
+	if (!hist->count)
+		return 0;
+
+	target = (guint64)rank;
+	if (target < rank || !target)
+		target++;
+
+	for (i = 0; i < VNC_STATS_HISTOGRAM_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target)
+			return MIN(vnc_stats_histogram_upper(i), hist->max);
+	}
+
+	return hist->max;
+}
+
+
+static void vnc_stats_append_encoding(GString *str, gint32 encoding)
+{
+	GEnumClass *klass = g_type_class_ref(VNC_TYPE_CONNECTION_ENCODING);
+	GEnumValue *value = g_enum_get_value(klass, encoding);
+
+	if (value)
+		g_string_append(str, value->value_nick);
+	else
+		g_string_append_printf(str, "%d", encoding);
+
+	g_type_class_unref(klass);
+}
+
+static void vnc_stats_format_json(VncStats *stats, GString *str)
+{
+	guint i, j;
+
+	g_string_append(str, "{\n");
+
+	for (i = 0; i < G_N_ELEMENTS(vnc_stats_counters); i++)
+		g_string_append_printf(str, "  \"%s%s\": %" G_GUINT64_FORMAT ",\n",
+				       vnc_stats_counters[i].name,
+				       vnc_stats_counters[i].usecs ? "_us" : "",
+				       VNC_STATS_FIELD(stats, vnc_stats_counters[i].offset));
+
+	for (i = 0; i < G_N_ELEMENTS(vnc_stats_histograms); i++) {
+		const VncStatsHistogram *hist =
+			VNC_STATS_HISTOGRAM(stats, vnc_stats_histograms[i].offset);
+		const char *sep = "";
+
+		g_string_append_printf(str, "  \"%s_us\": {\n", vnc_stats_histograms[i].name);
+		g_string_append_printf(str,
+				       "    \"count\": %" G_GUINT64_FORMAT
+				       ", \"total\": %" G_GUINT64_FORMAT
+				       ", \"min\": %" G_GUINT64_FORMAT
+				       ", \"max\": %" G_GUINT64_FORMAT ",\n    ",
+				       hist->count, hist->total, hist->min, hist->max);
+		for (j = 0; j < G_N_ELEMENTS(vnc_stats_percentiles); j++)
+			g_string_append_printf(str, "\"%s\": %" G_GUINT64_FORMAT ", ",
+					       vnc_stats_percentiles[j].json,
+					       vnc_stats_histogram_percentile(hist,
+									      vnc_stats_percentiles[j].percentile));
+
+		/* Only occupied buckets, as [upper bound, count] pairs */
+		g_string_append(str, "\n    \"buckets\": [");
+		for (j = 0; j < VNC_STATS_HISTOGRAM_BUCKETS; j++) {
+			if (!hist->buckets[j])
+				continue;
+			g_string_append_printf(str, "%s[%" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT "]",
+					       sep, vnc_stats_histogram_upper(j), hist->buckets[j]);
+			sep = ", ";
+		}
+		g_string_append(str, "]\n  },\n");
+	}
+
+	g_string_append(str, "  \"encodings\": [");
+	for (i = 0; i < stats->n_encodings; i++) {
+		VncStatsEncoding *enc = &stats->encodings[i];
+
+		g_string_append_printf(str, "%s\n    { \"encoding\": \"", i ? "," : "");
+		vnc_stats_append_encoding(str, enc->encoding);
+		g_string_append_printf(str,
+				       "\", \"rects\": %" G_GUINT64_FORMAT
+				       ", \"pixels\": %" G_GUINT64_FORMAT
+				       ", \"bytes\": %" G_GUINT64_FORMAT
+				       ", \"decode_time_us\": %" G_GUINT64_FORMAT
+				       ", \"inflate_time_us\": %" G_GUINT64_FORMAT " }",
+				       enc->rects, enc->pixels, enc->bytes,
+				       enc->decode_time, enc->inflate_time);
+	}
+	g_string_append(str, "\n  ]\n}\n");
+}
+
+/* Prometheus wants seconds, formatted independently of locale */
+static void vnc_stats_append_seconds(GString *str, guint64 usecs)
+{
+	gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+	g_string_append(str, g_ascii_dtostr(buf, sizeof(buf), usecs / 1000000.0));
+}
+
+static void vnc_stats_append_encoding_metric(GString *str, VncStats *stats,
+					     const char *name, const char *help,
+					     glong offset, gboolean usecs)
+{
+	guint i;
+
+	g_string_append_printf(str, "# HELP gvnc_encoding_%s %s\n", name, help);
+	g_string_append_printf(str, "# TYPE gvnc_encoding_%s counter\n", name);
+	for (i = 0; i < stats->n_encodings; i++) {
+		VncStatsEncoding *enc = &stats->encodings[i];
+		guint64 value = VNC_STATS_FIELD(enc, offset);
+
+		g_string_append_printf(str, "gvnc_encoding_%s{encoding=\"", name);
+		vnc_stats_append_encoding(str, enc->encoding);
+		g_string_append(str, "\"} ");
+		if (usecs)
+			vnc_stats_append_seconds(str, value);
+		else
+			g_string_append_printf(str, "%" G_GUINT64_FORMAT, value);
+		g_string_append_c(str, '\n');
+	}
+}
+
+static void vnc_stats_format_prometheus(VncStats *stats, GString *str)
+{
+	guint i, j;
+
+	for (i = 0; i < G_N_ELEMENTS(vnc_stats_counters); i++) {
+		const char *name = vnc_stats_counters[i].name;
+		const char *suffix = vnc_stats_counters[i].usecs ? "_seconds_total" : "_total";
+		guint64 value = VNC_STATS_FIELD(stats, vnc_stats_counters[i].offset);
+
+		g_string_append_printf(str, "# HELP gvnc_%s%s %s\n",
+				       name, suffix, vnc_stats_counters[i].help);
+		g_string_append_printf(str, "# TYPE gvnc_%s%s counter\n", name, suffix);
+		g_string_append_printf(str, "gvnc_%s%s ", name, suffix);
+		if (vnc_stats_counters[i].usecs)
+			vnc_stats_append_seconds(str, value);
+		else
+			g_string_append_printf(str, "%" G_GUINT64_FORMAT, value);
+		g_string_append_c(str, '\n');
+	}
+
+	for (i = 0; i < G_N_ELEMENTS(vnc_stats_histograms); i++) {
+		const char *name = vnc_stats_histograms[i].name;
+		const VncStatsHistogram *hist =
+			VNC_STATS_HISTOGRAM(stats, vnc_stats_histograms[i].offset);
+
+		g_string_append_printf(str, "# HELP gvnc_%s_seconds %s\n",
+				       name, vnc_stats_histograms[i].help);
+		g_string_append_printf(str, "# TYPE gvnc_%s_seconds summary\n", name);
+		for (j = 0; j < G_N_ELEMENTS(vnc_stats_percentiles); j++) {
+			g_string_append_printf(str, "gvnc_%s_seconds{quantile=\"%s\"} ",
+					       name, vnc_stats_percentiles[j].quantile);
+			vnc_stats_append_seconds(str,
+						 vnc_stats_histogram_percentile(hist,
+										vnc_stats_percentiles[j].percentile));
+			g_string_append_c(str, '\n');
+		}
+		g_string_append_printf(str, "gvnc_%s_seconds_sum ", name);
+		vnc_stats_append_seconds(str, hist->total);
+		g_string_append_printf(str, "\ngvnc_%s_seconds_count %" G_GUINT64_FORMAT "\n",
+				       name, hist->count);
+	}
+
+	vnc_stats_append_encoding_metric(str, stats, "rects_total",
+					 "Rects received per encoding",
+					 G_STRUCT_OFFSET(VncStatsEncoding, rects), FALSE);
+	vnc_stats_append_encoding_metric(str, stats, "pixels_total",
+					 "Pixels received per encoding",
+					 G_STRUCT_OFFSET(VncStatsEncoding, pixels), FALSE);
+	vnc_stats_append_encoding_metric(str, stats, "bytes_total",
+					 "Protocol bytes received per encoding",
+					 G_STRUCT_OFFSET(VncStatsEncoding, bytes), FALSE);
+	vnc_stats_append_encoding_metric(str, stats, "decode_seconds_total",
+					 "Time spent decoding per encoding",
+					 G_STRUCT_OFFSET(VncStatsEncoding, decode_time), TRUE);
+	vnc_stats_append_encoding_metric(str, stats, "inflate_seconds_total",
+					 "Time spent in zlib inflate per encoding",
+					 G_STRUCT_OFFSET(VncStatsEncoding, inflate_time), TRUE);
+}
+
+gchar *vnc_stats_format(VncStats *stats, VncStatsFormat format)
+{
+	GString *str = g_string_new(NULL);
+
+	switch (format) {
+	case VNC_STATS_FORMAT_JSON:
+		vnc_stats_format_json(stats, str);
+		break;
+	case VNC_STATS_FORMAT_PROMETHEUS:
+		vnc_stats_format_prometheus(stats, str);
+		break;
+	}
+
+	return g_string_free(str, FALSE);
+}
+
+/*
+ * The file is replaced atomically, so a scraper polling it
+ * never sees a partial write
+ */
+gboolean vnc_stats_save(VncStats *stats,
+			VncStatsFormat format,
+			const gchar *filename,
+			GError **error)
+{
+	gchar *data = vnc_stats_format(stats, format);
+	gboolean ret;
+
+	ret = g_file_set_contents(filename, data, -1, error);
+	g_free(data);
+
+	return ret;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
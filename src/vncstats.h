@@ -0,0 +1,127 @@
+/*
+ * GTK VNC Widget
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef VNC_STATS_H
+#define VNC_STATS_H
+
+#include <glib.h>
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define VNC_TYPE_STATS            (vnc_stats_get_type ())
+
+/* Maximum number of distinct encodings tracked */
+#define VNC_STATS_MAX_ENCODINGS 16
+
+/* Histogram values below 16 get a bucket each. Above that each
+ * power of two is split into 16 buckets, so a value is never more
+ * than 1/16th away from its bucket bounds, up to 2^32 - 1 */
+#define VNC_STATS_HISTOGRAM_BUCKETS 464
+
+typedef struct _VncStats VncStats;
+typedef struct _VncStatsEncoding VncStatsEncoding;
+typedef struct _VncStatsHistogram VncStatsHistogram;
+
+typedef enum {
+	VNC_STATS_FORMAT_JSON,
+	VNC_STATS_FORMAT_PROMETHEUS,
+} VncStatsFormat;
+
+struct _VncStatsHistogram {
+	guint64 count;
+	guint64 total;
+	guint64 min;
+	guint64 max;
+	guint64 buckets[VNC_STATS_HISTOGRAM_BUCKETS];
+};
+
+struct _VncStatsEncoding {
+	gint32 encoding;
+
+	guint64 rects;
+	guint64 pixels;
+	guint64 bytes;
+	guint64 decode_time;    /* microseconds */
+	guint64 inflate_time;   /* microseconds of decode_time in zlib */
+};
+
+struct _VncStats {
+	/* Bytes on the socket, and protocol bytes after TLS/SASL */
+	guint64 wire_bytes_read;
+	guint64 wire_bytes_written;
+	guint64 bytes_read;
+	guint64 bytes_written;
+
+	guint64 read_syscalls;
+	guint64 write_syscalls;
+	guint64 read_wait_time;     /* microseconds blocked reading */
+
+	/* zlib input consumed and output produced, and time taken */
+	guint64 compressed_bytes;
+	guint64 decompressed_bytes;
+	guint64 inflate_time;
+
+	/* Times the connection coroutine yielded to the main loop */
+	guint64 coroutine_switches;
+
+	guint64 updates;
+
+	/* All in microseconds. Update latency runs from an update
+	 * request to the first rect answering it, paint latency from
+	 * damage to the widget drawing it, and is only filled in by
+	 * vnc_display_get_stats */
+	VncStatsHistogram update_latency;
+	VncStatsHistogram decode_time;
+	VncStatsHistogram paint_latency;
+
+	guint n_encodings;
+	VncStatsEncoding encodings[VNC_STATS_MAX_ENCODINGS];
+};
+
+GType vnc_stats_get_type(void);
+
+VncStats *vnc_stats_new(void);
+VncStats *vnc_stats_copy(VncStats *stats);
+void vnc_stats_free(VncStats *stats);
+
+VncStatsEncoding *vnc_stats_get_encoding(VncStats *stats, gint32 encoding);
+
+void vnc_stats_histogram_record(VncStatsHistogram *hist, guint64 value);
+guint64 vnc_stats_histogram_percentile(const VncStatsHistogram *hist,
+				       gdouble percentile);
+
+gchar *vnc_stats_format(VncStats *stats, VncStatsFormat format);
+gboolean vnc_stats_save(VncStats *stats,
+			VncStatsFormat format,
+			const gchar *filename,
+			GError **error);
+
+G_END_DECLS
+
+#endif /* VNC_STATS_H */
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
@@ -0,0 +1,547 @@
+/*
+ * Vnc Decoder Benchmark
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Replays FBS recordings, as made by gvnccapture --record, through
+ * VncConnection into a VncBaseFramebuffer as fast as possible, once
+ * for each local pixel format. For every encoding in the stream it
+ * prints one JSON object per line with the throughput achieved and
+ * how the decode time splits between zlib and everything else, ie
+ * mostly pixel format conversion.
+ *
+ *   gvncbench [--local-format=NAME]... [--repeat=N] RECORDING...
+ *
+ * With --workload it instead decodes synthetic content from the
+ * benchmark server, run on a thread at the other end of a socketpair,
+ * once for each requested encoding:
+ *
+ *   gvncbench --workload=scroll [--encoding=NAME]... [--frames=N]
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <glib.h>
+#include <vncconnection.h>
+#include <vncconnectionenums.h>
+#include <vncbaseframebuffer.h>
+
+#include "vncbenchserver.h"
+
+struct GVncBenchFormat {
+	const char *name;
+	VncPixelFormat format;
+};
+
+static const struct GVncBenchFormat formats[] = {
+	{ "rgb888", { .bits_per_pixel = 32, .depth = 24, .byte_order = G_BYTE_ORDER,
+		      .true_color_flag = 1,
+		      .red_max = 255, .green_max = 255, .blue_max = 255,
+		      .red_shift = 16, .green_shift = 8, .blue_shift = 0 } },
+	{ "bgr888", { .bits_per_pixel = 32, .depth = 24, .byte_order = G_BYTE_ORDER,
+		      .true_color_flag = 1,
+		      .red_max = 255, .green_max = 255, .blue_max = 255,
+		      .red_shift = 0, .green_shift = 8, .blue_shift = 16 } },
+	{ "rgb565", { .bits_per_pixel = 16, .depth = 16, .byte_order = G_BYTE_ORDER,
+		      .true_color_flag = 1,
+		      .red_max = 31, .green_max = 63, .blue_max = 31,
+		      .red_shift = 11, .green_shift = 5, .blue_shift = 0 } },
+	{ "rgb555", { .bits_per_pixel = 16, .depth = 15, .byte_order = G_BYTE_ORDER,
+		      .true_color_flag = 1,
+		      .red_max = 31, .green_max = 31, .blue_max = 31,
+		      .red_shift = 10, .green_shift = 5, .blue_shift = 0 } },
+	{ "bgr233", { .bits_per_pixel = 8, .depth = 8, .byte_order = G_BYTE_ORDER,
+		      .true_color_flag = 1,
+		      .red_max = 7, .green_max = 7, .blue_max = 3,
+		      .red_shift = 0, .green_shift = 3, .blue_shift = 6 } },
+};
+
+static const char *encodings[] = {
+	"raw", "copy-rect", "rre", "hextile", "zrle", "tight",
+};
+
+struct GVncBench {
+	const char *recording;
+	const struct GVncBenchFormat *local;
+	gboolean threaded;
+
+	/* Synthetic content, instead of a recording */
+	VncBenchServer *server;
+	int server_fd;
+	gint32 encoding;
+	gboolean jpeg;
+	const struct GVncBenchFormat *remote_req;
+
+	VncConnection *conn;
+	GMainLoop *loop;
+	guint8 *buffer;
+	VncPixelFormat remote;
+
+	gint64 start;
+	gint64 end;
+};
+
+
+static gint64 bench_now(void)
+{
+	GTimeVal now;
+
+	g_get_current_time(&now);
+
+	return ((gint64)now.tv_sec * G_USEC_PER_SEC) + now.tv_usec;
+}
+
+static gchar *bench_format_name(const VncPixelFormat *fmt)
+{
+	guint i;
+
+	for (i = 0 ; i < G_N_ELEMENTS(formats) ; i++)
+		if (vnc_pixel_format_match(fmt, &formats[i].format))
+			return g_strdup(formats[i].name);
+
+	return g_strdup_printf("%ubpp-d%u-%s-%u.%u.%u-%u.%u.%u",
+			       fmt->bits_per_pixel, fmt->depth,
+			       fmt->byte_order == G_BIG_ENDIAN ? "be" : "le",
+			       fmt->red_max, fmt->green_max, fmt->blue_max,
+			       fmt->red_shift, fmt->green_shift, fmt->blue_shift);
+}
+
+static const char *bench_encoding_name(gint32 encoding)
+{
+	GEnumClass *klass = g_type_class_ref(VNC_TYPE_CONNECTION_ENCODING);
+	GEnumValue *value = g_enum_get_value(klass, encoding);
+
+	g_type_class_unref(klass);
+
+	return value ? value->value_nick : "unknown";
+}
+
+
+static void bench_framebuffer_init(struct GVncBench *bench,
+				   const VncPixelFormat *remote,
+				   int width, int height)
+{
+	const VncPixelFormat *local = &bench->local->format;
+	int rowstride = width * (local->bits_per_pixel / 8);
+	VncBaseFramebuffer *fb;
+
+	VNC_DEBUG("Framebuffer %dx%d", width, height);
+	g_free(bench->buffer);
+	bench->buffer = g_malloc0(rowstride * height);
+	bench->remote = *remote;
+
+	fb = vnc_base_framebuffer_new(bench->buffer, width, height, rowstride,
+				      local, remote);
+	vnc_connection_set_framebuffer(bench->conn, VNC_FRAMEBUFFER(fb));
+	g_object_unref(fb);
+}
+
+static void do_vnc_initialized(VncConnection *conn, gpointer opaque)
+{
+	struct GVncBench *bench = opaque;
+
+	if (bench->server) {
+		gint32 encs[3];
+		int n_encs = 0;
+
+		encs[n_encs++] = bench->encoding;
+		if (bench->encoding != VNC_CONNECTION_ENCODING_COPY_RECT)
+			encs[n_encs++] = VNC_CONNECTION_ENCODING_COPY_RECT;
+		if (bench->jpeg)
+			encs[n_encs++] = VNC_CONNECTION_ENCODING_TIGHT_JPEG5;
+
+		if (bench->remote_req)
+			vnc_connection_set_pixel_format(conn, &bench->remote_req->format);
+		vnc_connection_set_encodings(conn, n_encs, encs);
+		vnc_connection_framebuffer_update_request(conn, FALSE, 0, 0,
+							  vnc_connection_get_width(conn),
+							  vnc_connection_get_height(conn));
+	}
+
+	bench_framebuffer_init(bench,
+			       vnc_connection_get_pixel_format(conn),
+			       vnc_connection_get_width(conn),
+			       vnc_connection_get_height(conn));
+	bench->start = bench_now();
+}
+
+/* The server only sends a frame when asked, so keep asking */
+static void do_vnc_framebuffer_update_complete(VncConnection *conn,
+					       gpointer opaque G_GNUC_UNUSED)
+{
+	vnc_connection_framebuffer_update_request(conn, TRUE, 0, 0,
+						  vnc_connection_get_width(conn),
+						  vnc_connection_get_height(conn));
+}
+
+static void do_vnc_desktop_resize(VncConnection *conn,
+				  int width, int height,
+				  gpointer opaque)
+{
+	bench_framebuffer_init(opaque, vnc_connection_get_pixel_format(conn),
+			       width, height);
+}
+
+static void do_vnc_pixel_format_changed(VncConnection *conn,
+					VncPixelFormat *remote,
+					gpointer opaque)
+{
+	bench_framebuffer_init(opaque, remote,
+			       vnc_connection_get_width(conn),
+			       vnc_connection_get_height(conn));
+}
+
+/* Recordings always offer only the 'None' auth type */
+static void do_vnc_auth_choose_type(VncConnection *conn,
+				    GValueArray *types,
+				    gpointer opaque G_GNUC_UNUSED)
+{
+	guint i;
+
+	for (i = 0 ; i < types->n_values ; i++) {
+		GValue *type = g_value_array_get_nth(types, i);
+		if (g_value_get_enum(type) == VNC_CONNECTION_AUTH_NONE) {
+			vnc_connection_set_auth_type(conn, VNC_CONNECTION_AUTH_NONE);
+			return;
+		}
+	}
+
+	vnc_connection_shutdown(conn);
+}
+
+static void do_vnc_disconnected(VncConnection *conn G_GNUC_UNUSED,
+				gpointer opaque)
+{
+	struct GVncBench *bench = opaque;
+
+	bench->end = bench_now();
+	g_main_loop_quit(bench->loop);
+}
+
+
+static void bench_print(struct GVncBench *bench, int iteration,
+			const char *encoding, guint64 rects, guint64 pixels,
+			guint64 bytes, guint64 decode_time, guint64 inflate_time)
+{
+	gchar *remote = bench_format_name(&bench->remote);
+	double secs = decode_time / 1000000.0;
+
+	if (secs <= 0)
+		secs = 1e-6;
+
+	printf("{ \"recording\": \"%s\", \"iteration\": %d, "
+	       "\"remote_format\": \"%s\", \"local_format\": \"%s\", "
+	       "\"threaded\": %s, \"encoding\": \"%s\", "
+	       "\"rects\": %" G_GUINT64_FORMAT ", \"pixels\": %" G_GUINT64_FORMAT ", "
+	       "\"bytes\": %" G_GUINT64_FORMAT ", \"decode_us\": %" G_GUINT64_FORMAT ", "
+	       "\"inflate_us\": %" G_GUINT64_FORMAT ", \"convert_us\": %" G_GUINT64_FORMAT ", "
+	       "\"mb_per_sec\": %.3f, \"mpixels_per_sec\": %.3f, \"rects_per_sec\": %.1f }\n",
+	       bench->recording, iteration, remote, bench->local->name,
+	       bench->threaded ? "true" : "false", encoding,
+	       rects, pixels, bytes, decode_time,
+	       inflate_time, decode_time - MIN(inflate_time, decode_time),
+	       bytes / secs / (1024 * 1024), pixels / secs / 1000000, rects / secs);
+
+	g_free(remote);
+}
+
+static gpointer bench_serve(gpointer opaque)
+{
+	struct GVncBench *bench = opaque;
+	GError *error = NULL;
+
+	if (!vnc_bench_server_run(bench->server, bench->server_fd, &error)) {
+		fprintf(stderr, "Benchmark server failed: %s\n", error->message);
+		g_error_free(error);
+	}
+	close(bench->server_fd);
+
+	return NULL;
+}
+
+static gboolean bench_run(struct GVncBench *bench, int iteration)
+{
+	VncStats *stats;
+	guint64 rects = 0, pixels = 0, bytes = 0, decode = 0, inflate = 0;
+	GThread *thread = NULL;
+	guint i;
+
+	bench->conn = vnc_connection_new();
+	bench->loop = g_main_loop_new(g_main_context_default(), FALSE);
+	bench->start = bench->end = 0;
+
+	g_signal_connect(bench->conn, "vnc-initialized",
+			 G_CALLBACK(do_vnc_initialized), bench);
+	g_signal_connect(bench->conn, "vnc-desktop-resize",
+			 G_CALLBACK(do_vnc_desktop_resize), bench);
+	g_signal_connect(bench->conn, "vnc-pixel-format-changed",
+			 G_CALLBACK(do_vnc_pixel_format_changed), bench);
+	g_signal_connect(bench->conn, "vnc-auth-choose-type",
+			 G_CALLBACK(do_vnc_auth_choose_type), bench);
+	g_signal_connect(bench->conn, "vnc-disconnected",
+			 G_CALLBACK(do_vnc_disconnected), bench);
+
+	vnc_connection_set_threaded_decode(bench->conn, bench->threaded);
+	if (bench->server) {
+		int fds[2];
+
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+			fprintf(stderr, "Unable to create socketpair\n");
+			g_object_unref(bench->conn);
+			g_main_loop_unref(bench->loop);
+			return FALSE;
+		}
+
+		g_signal_connect(bench->conn, "vnc-framebuffer-update-complete",
+				 G_CALLBACK(do_vnc_framebuffer_update_complete), bench);
+		bench->server_fd = fds[1];
+		thread = g_thread_create(bench_serve, bench, TRUE, NULL);
+		vnc_connection_open_fd(bench->conn, fds[0]);
+	} else {
+		vnc_connection_open_replay(bench->conn, bench->recording, FALSE);
+	}
+
+	g_main_loop_run(bench->loop);
+
+	if (!bench->start) {
+		fprintf(stderr, "Unable to decode %s\n", bench->recording);
+		g_object_unref(bench->conn);
+		g_main_loop_unref(bench->loop);
+		if (thread)
+			g_thread_join(thread);
+		return FALSE;
+	}
+
+	/* Pseudo-encodings carry no pixel data worth measuring */
+	stats = vnc_connection_get_stats(bench->conn);
+	for (i = 0 ; i < stats->n_encodings ; i++) {
+		VncStatsEncoding *enc = &stats->encodings[i];
+
+		if (enc->encoding < 0 ||
+		    enc->encoding == VNC_CONNECTION_ENCODING_WMVi)
+			continue;
+
+		bench_print(bench, iteration, bench_encoding_name(enc->encoding),
+			    enc->rects, enc->pixels, enc->bytes,
+			    enc->decode_time, enc->inflate_time);
+		rects += enc->rects;
+		pixels += enc->pixels;
+		bytes += enc->bytes;
+		decode += enc->decode_time;
+		inflate += enc->inflate_time;
+	}
+	bench_print(bench, iteration, "all", rects, pixels, bytes, decode, inflate);
+	vnc_stats_free(stats);
+
+	g_object_unref(bench->conn);
+	g_main_loop_unref(bench->loop);
+	bench->conn = NULL;
+	bench->loop = NULL;
+
+	if (thread)
+		g_thread_join(thread);
+
+	return TRUE;
+}
+
+static gboolean bench_name_wanted(gchar **names, const char *name)
+{
+	int i;
+
+	for (i = 0 ; names[i] ; i++)
+		if (g_str_equal(names[i], name))
+			return TRUE;
+
+	return FALSE;
+}
+
+static gboolean bench_run_formats(struct GVncBench *bench,
+				  gchar **local_formats, int repeat)
+{
+	gboolean ret = TRUE;
+	guint i;
+	int k;
+
+	for (i = 0 ; i < G_N_ELEMENTS(formats) ; i++) {
+		if (local_formats &&
+		    !bench_name_wanted(local_formats, formats[i].name))
+			continue;
+
+		bench->local = &formats[i];
+		for (k = 0 ; k < repeat ; k++)
+			if (!bench_run(bench, k))
+				ret = FALSE;
+	}
+
+	return ret;
+}
+
+
+static gboolean vnc_debug_option_arg(const gchar *option_name G_GNUC_UNUSED,
+				     const gchar *value G_GNUC_UNUSED,
+				     gpointer data G_GNUC_UNUSED,
+				     GError **error G_GNUC_UNUSED)
+{
+	vnc_util_set_debug(TRUE);
+	return TRUE;
+}
+
+int main(int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	gchar **args = NULL;
+	gchar **local_formats = NULL;
+	gchar **encoding_names = NULL;
+	gchar *workload_name = NULL;
+	gchar *remote_format = NULL;
+	gboolean threaded = FALSE;
+	gboolean jpeg = FALSE;
+	int repeat = 1;
+	int frames = 100;
+	int width = 1280;
+	int height = 1024;
+	const GOptionEntry options [] = {
+		{ "debug", 'd', G_OPTION_FLAG_NO_ARG,  G_OPTION_ARG_CALLBACK,
+		  vnc_debug_option_arg, "Enables debug output", NULL },
+		{ "local-format", 'f', 0, G_OPTION_ARG_STRING_ARRAY, &local_formats,
+		  "Local pixel format, one of rgb888, bgr888, rgb565, rgb555, bgr233. "
+		  "Default is all of them", "NAME" },
+		{ "repeat", 'r', 0, G_OPTION_ARG_INT, &repeat,
+		  "Replay each recording N times per format", "N" },
+		{ "threaded", 't', 0, G_OPTION_ARG_NONE, &threaded,
+		  "Decode Tight rects on worker threads", NULL },
+		{ "workload", 'w', 0, G_OPTION_ARG_STRING, &workload_name,
+		  "Decode synthetic content, one of text, noise, fill, scroll", "NAME" },
+		{ "encoding", 'e', 0, G_OPTION_ARG_STRING_ARRAY, &encoding_names,
+		  "Encoding for synthetic content. Default is all of them", "NAME" },
+		{ "remote-format", 0, 0, G_OPTION_ARG_STRING, &remote_format,
+		  "Pixel format to ask the server for, as for --local-format", "NAME" },
+		{ "frames", 'n', 0, G_OPTION_ARG_INT, &frames,
+		  "Number of synthetic frames to decode", "N" },
+		{ "width", 0, 0, G_OPTION_ARG_INT, &width,
+		  "Synthetic desktop width", "PIXELS" },
+		{ "height", 0, 0, G_OPTION_ARG_INT, &height,
+		  "Synthetic desktop height", "PIXELS" },
+		{ "jpeg", 'j', 0, G_OPTION_ARG_NONE, &jpeg,
+		  "Let Tight use JPEG for synthetic content", NULL },
+		{ G_OPTION_REMAINING, '\0', 0, G_OPTION_ARG_FILENAME_ARRAY, &args,
+		  NULL, "RECORDING..." },
+		{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, 0 }
+	};
+	struct GVncBench bench;
+	VncBenchWorkload workload;
+	int ret = 0;
+	guint i;
+
+	g_type_init();
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	context = g_option_context_new("- Vnc Decoder Benchmark");
+	g_option_context_add_main_entries(context, options, NULL);
+	g_option_context_parse(context, &argc, &argv, &error);
+	if (error) {
+		fprintf(stderr, "%s\n", error->message);
+		g_error_free(error);
+		return 1;
+	}
+	if (!workload_name && (!args || !args[0])) {
+		fprintf(stderr, "Usage: %s [OPTION]... RECORDING...\n", argv[0]);
+		return 1;
+	}
+	if (workload_name &&
+	    !vnc_bench_workload_from_name(workload_name, &workload)) {
+		fprintf(stderr, "Unknown workload %s\n", workload_name);
+		return 1;
+	}
+	if (width < VNC_BENCH_SERVER_MIN_SIZE || width > VNC_BENCH_SERVER_MAX_SIZE ||
+	    height < VNC_BENCH_SERVER_MIN_SIZE || height > VNC_BENCH_SERVER_MAX_SIZE) {
+		fprintf(stderr, "Desktop size %dx%d out of range\n", width, height);
+		return 1;
+	}
+
+	memset(&bench, 0, sizeof(bench));
+	bench.threaded = threaded;
+	bench.jpeg = jpeg;
+
+	if (remote_format) {
+		for (i = 0 ; i < G_N_ELEMENTS(formats) ; i++)
+			if (g_str_equal(formats[i].name, remote_format))
+				bench.remote_req = &formats[i];
+		if (!bench.remote_req) {
+			fprintf(stderr, "Unknown pixel format %s\n", remote_format);
+			return 1;
+		}
+	}
+
+	for (i = 0 ; args && args[i] ; i++) {
+		bench.recording = args[i];
+		if (!bench_run_formats(&bench, local_formats, repeat))
+			ret = 1;
+	}
+
+	for (i = 0 ; workload_name && i < G_N_ELEMENTS(encodings) ; i++) {
+		gchar *label;
+
+		if (encoding_names &&
+		    !bench_name_wanted(encoding_names, encodings[i]))
+			continue;
+
+		vnc_bench_encoding_from_name(encodings[i], &bench.encoding);
+		bench.server = vnc_bench_server_new(workload, bench.encoding, width, height);
+		vnc_bench_server_set_frames(bench.server, frames);
+		vnc_bench_server_set_jpeg(bench.server, jpeg);
+
+		label = g_strdup_printf("%s:%s", workload_name, encodings[i]);
+		bench.recording = label;
+		if (!bench_run_formats(&bench, local_formats, repeat))
+			ret = 1;
+
+		vnc_bench_server_free(bench.server);
+		bench.server = NULL;
+		g_free(label);
+	}
+
+	/* Let the connections finish tearing down */
+	while (g_main_context_iteration(NULL, FALSE))
+		;
+
+	g_free(bench.buffer);
+	g_strfreev(local_formats);
+	g_strfreev(encoding_names);
+	g_free(workload_name);
+	g_free(remote_format);
+	g_strfreev(args);
+
+	return ret;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
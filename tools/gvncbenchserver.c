@@ -0,0 +1,148 @@
+/*
+ * Vnc Benchmark Server
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Listens on a TCP port and serves synthetic screen content to one
+ * VNC client at a time, for load testing clients such as gvncviewer
+ * without a real desktop:
+ *
+ *   gvncbenchserver --workload=scroll --encoding=zrle --port=5901
+ *   gvncviewer localhost:1
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <gio/gio.h>
+#include <vncconnection.h>
+
+#include "vncbenchserver.h"
+
+int main(int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	GSocketListener *listener;
+	VncBenchServer *server;
+	VncBenchWorkload workload;
+	gint32 encoding;
+	gchar *workload_name = NULL;
+	gchar *encoding_name = NULL;
+	int port = 5901;
+	int width = 1280;
+	int height = 1024;
+	int frames = 0;
+	int seed = 1;
+	gboolean jpeg = FALSE;
+	gboolean once = FALSE;
+	const GOptionEntry options [] = {
+		{ "workload", 'w', 0, G_OPTION_ARG_STRING, &workload_name,
+		  "Content to generate, one of text, noise, fill, scroll", "NAME" },
+		{ "encoding", 'e', 0, G_OPTION_ARG_STRING, &encoding_name,
+		  "Encoding for pixel data, one of raw, copy-rect, rre, hextile, zrle, tight",
+		  "NAME" },
+		{ "port", 'p', 0, G_OPTION_ARG_INT, &port,
+		  "TCP port to listen on", "PORT" },
+		{ "width", 0, 0, G_OPTION_ARG_INT, &width,
+		  "Desktop width", "PIXELS" },
+		{ "height", 0, 0, G_OPTION_ARG_INT, &height,
+		  "Desktop height", "PIXELS" },
+		{ "frames", 'f', 0, G_OPTION_ARG_INT, &frames,
+		  "Disconnect each client after this many updates", "N" },
+		{ "seed", 's', 0, G_OPTION_ARG_INT, &seed,
+		  "Random seed for the generated content", "N" },
+		{ "jpeg", 'j', 0, G_OPTION_ARG_NONE, &jpeg,
+		  "Allow JPEG in Tight when the client asks for a quality level", NULL },
+		{ "once", 'o', 0, G_OPTION_ARG_NONE, &once,
+		  "Exit after serving one client", NULL },
+		{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, 0 }
+	};
+
+	g_type_init();
+
+	context = g_option_context_new("- Vnc Benchmark Server");
+	g_option_context_add_main_entries(context, options, NULL);
+	g_option_context_parse(context, &argc, &argv, &error);
+	if (error) {
+		fprintf(stderr, "%s\n", error->message);
+		g_error_free(error);
+		return 1;
+	}
+
+	if (!vnc_bench_workload_from_name(workload_name ? workload_name : "text", &workload)) {
+		fprintf(stderr, "Unknown workload %s\n", workload_name);
+		return 1;
+	}
+	if (!vnc_bench_encoding_from_name(encoding_name ? encoding_name : "raw", &encoding)) {
+		fprintf(stderr, "Unknown encoding %s\n", encoding_name);
+		return 1;
+	}
+	if (width < VNC_BENCH_SERVER_MIN_SIZE || width > VNC_BENCH_SERVER_MAX_SIZE ||
+	    height < VNC_BENCH_SERVER_MIN_SIZE || height > VNC_BENCH_SERVER_MAX_SIZE) {
+		fprintf(stderr, "Desktop size %dx%d out of range\n", width, height);
+		return 1;
+	}
+
+	server = vnc_bench_server_new(workload, encoding, width, height);
+	vnc_bench_server_set_frames(server, frames);
+	vnc_bench_server_set_jpeg(server, jpeg);
+	vnc_bench_server_set_seed(server, seed);
+
+	listener = g_socket_listener_new();
+	if (!g_socket_listener_add_inet_port(listener, port, NULL, &error)) {
+		fprintf(stderr, "Unable to listen on port %d: %s\n", port, error->message);
+		g_error_free(error);
+		return 1;
+	}
+
+	do {
+		GSocket *sock = g_socket_listener_accept_socket(listener, NULL, NULL, &error);
+
+		if (!sock) {
+			fprintf(stderr, "Unable to accept client: %s\n", error->message);
+			g_clear_error(&error);
+			continue;
+		}
+
+		g_socket_set_blocking(sock, TRUE);
+		VNC_DEBUG("Serving client on fd %d", g_socket_get_fd(sock));
+		if (!vnc_bench_server_run(server, g_socket_get_fd(sock), &error)) {
+			fprintf(stderr, "Client failed: %s\n", error->message);
+			g_clear_error(&error);
+		}
+		g_object_unref(sock);
+	} while (!once);
+
+	g_object_unref(listener);
+	vnc_bench_server_free(server);
+	g_free(workload_name);
+	g_free(encoding_name);
+
+	return 0;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
@@ -0,0 +1,520 @@
+/*
+ * Vnc Framebuffer Blit Benchmark
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * Times the VncBaseFramebuffer pixel conversion kernels for every
+ * pairing of remote and local pixel format, covering each SRC x DST
+ * instantiation of vncbaseframebufferblt.h in both byte orders, the
+ * colour map variants and the perfect match fast paths. For every
+ * operation and rect size it prints one JSON object per line with
+ * the time taken per pixel.
+ *
+ * With --verify it instead checks that the kernels picked normally,
+ * and those picked without SIMD, produce exactly the same pixels as
+ * the generic ones, over random pixels and awkward widths.
+ *
+ *   gvncblitbench [--remote-format=NAME]... [--local-format=NAME]...
+ *                 [--op=NAME]... [--size=WxH]... [--min-time=MS]
+ *                 [--verify]
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <glib.h>
+#include <vncbaseframebuffer.h>
+#include <vnccolormap.h>
+#include <vncutil.h>
+
+#define BLIT_BENCH_WIDTH 1920
+#define BLIT_BENCH_HEIGHT 1080
+
+#define BLIT_BENCH_SWAPPED (G_BYTE_ORDER == G_BIG_ENDIAN ? G_LITTLE_ENDIAN : G_BIG_ENDIAN)
+
+struct GVncBlitBenchFormat {
+	const char *name;
+	gboolean local; /* Usable as a local format */
+	VncPixelFormat format;
+};
+
+static const struct GVncBlitBenchFormat formats[] = {
+	{ "rgb888", TRUE,
+	  { .bits_per_pixel = 32, .depth = 24, .byte_order = G_BYTE_ORDER,
+	    .true_color_flag = 1,
+	    .red_max = 255, .green_max = 255, .blue_max = 255,
+	    .red_shift = 16, .green_shift = 8, .blue_shift = 0 } },
+	{ "rgb888-swapped", TRUE,
+	  { .bits_per_pixel = 32, .depth = 24, .byte_order = BLIT_BENCH_SWAPPED,
+	    .true_color_flag = 1,
+	    .red_max = 255, .green_max = 255, .blue_max = 255,
+	    .red_shift = 16, .green_shift = 8, .blue_shift = 0 } },
+	{ "bgr888", FALSE,
+	  { .bits_per_pixel = 32, .depth = 24, .byte_order = G_BYTE_ORDER,
+	    .true_color_flag = 1,
+	    .red_max = 255, .green_max = 255, .blue_max = 255,
+	    .red_shift = 0, .green_shift = 8, .blue_shift = 16 } },
+	{ "rgb565", TRUE,
+	  { .bits_per_pixel = 16, .depth = 16, .byte_order = G_BYTE_ORDER,
+	    .true_color_flag = 1,
+	    .red_max = 31, .green_max = 63, .blue_max = 31,
+	    .red_shift = 11, .green_shift = 5, .blue_shift = 0 } },
+	{ "rgb565-swapped", TRUE,
+	  { .bits_per_pixel = 16, .depth = 16, .byte_order = BLIT_BENCH_SWAPPED,
+	    .true_color_flag = 1,
+	    .red_max = 31, .green_max = 63, .blue_max = 31,
+	    .red_shift = 11, .green_shift = 5, .blue_shift = 0 } },
+	{ "bgr233", TRUE,
+	  { .bits_per_pixel = 8, .depth = 8, .byte_order = G_BYTE_ORDER,
+	    .true_color_flag = 1,
+	    .red_max = 7, .green_max = 7, .blue_max = 3,
+	    .red_shift = 0, .green_shift = 3, .blue_shift = 6 } },
+	{ "cmap8", FALSE,
+	  { .bits_per_pixel = 8, .depth = 8, .byte_order = G_BYTE_ORDER,
+	    .true_color_flag = 0 } },
+	{ "cmap16", FALSE,
+	  { .bits_per_pixel = 16, .depth = 16, .byte_order = G_BYTE_ORDER,
+	    .true_color_flag = 0 } },
+};
+
+/* Entries in the 16-bit colour map, which source indexes are masked to */
+#define BLIT_BENCH_CMAP16_SIZE 4096
+
+static const struct {
+	guint16 width;
+	guint16 height;
+} sizes[] = {
+	{ 1, 1 },
+	{ 8, 8 },
+	{ 16, 16 },
+	{ 64, 64 },
+	{ 256, 256 },
+	{ 1024, 768 },
+	{ 1920, 16 },
+};
+
+enum {
+	BLIT_BENCH_SET_PIXEL_AT,
+	BLIT_BENCH_FILL,
+	BLIT_BENCH_BLT,
+	BLIT_BENCH_RGB24_BLT,
+	BLIT_BENCH_COPYRECT,
+	BLIT_BENCH_BLT_MONO,
+	BLIT_BENCH_BLT_INDEXED,
+};
+
+static const char *ops[] = {
+	"set-pixel-at", "fill", "blt", "rgb24-blt", "copyrect",
+	"blt-mono", "blt-indexed",
+};
+
+static const char *kernels[] = {
+	"fastest", "portable", "generic",
+};
+
+/* Widths either side of every vector size, to cover the tails */
+static const guint16 verify_widths[] = {
+	1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 65, 127, 129,
+};
+
+#define BLIT_BENCH_VERIFY_WIDTH 256
+#define BLIT_BENCH_VERIFY_HEIGHT 8
+
+struct GVncBlitBench {
+	double min_time;
+
+	guint8 *src;   /* Remote format pixels, BLIT_BENCH_WIDTH wide */
+	guint8 *rgb24; /* Packed RGB, BLIT_BENCH_WIDTH wide, doubling as palette indexes */
+	guint8 palette[256 * 4]; /* Remote format pixels, 4 bytes apart */
+	guint8 *buffer;
+};
+
+
+static gboolean blit_bench_name_wanted(gchar **names, const char *name)
+{
+	int i;
+
+	if (!names)
+		return TRUE;
+
+	for (i = 0 ; names[i] ; i++)
+		if (g_str_equal(names[i], name))
+			return TRUE;
+
+	return FALSE;
+}
+
+/* Random pixel data, valid for the remote format */
+static void blit_bench_source_init(struct GVncBlitBench *bench,
+				   const VncPixelFormat *remote)
+{
+	int bpp = remote->bits_per_pixel / 8;
+	int i;
+
+	for (i = 0 ; i < BLIT_BENCH_WIDTH * BLIT_BENCH_HEIGHT ; i++) {
+		guint32 val = g_random_int();
+
+		if (!remote->true_color_flag && bpp == 2) {
+			guint16 idx = val % BLIT_BENCH_CMAP16_SIZE;
+			memcpy(bench->src + (i * bpp), &idx, 2);
+		} else {
+			memcpy(bench->src + (i * bpp), &val, bpp);
+		}
+	}
+
+	for (i = 0 ; i < 256 ; i++)
+		memcpy(bench->palette + (i * 4), bench->src + (i * bpp), bpp);
+}
+
+static VncColorMap *blit_bench_color_map_new(const VncPixelFormat *remote)
+{
+	guint16 n = remote->bits_per_pixel == 8 ? 256 : BLIT_BENCH_CMAP16_SIZE;
+	VncColorMap *map = vnc_color_map_new(0, n);
+	guint16 i;
+
+	for (i = 0 ; i < n ; i++)
+		vnc_color_map_set(map, i,
+				  g_random_int() & 0xffff,
+				  g_random_int() & 0xffff,
+				  g_random_int() & 0xffff);
+
+	return map;
+}
+
+static void blit_bench_op(VncFramebuffer *fb, struct GVncBlitBench *bench,
+			  int op, guint16 width, guint16 height,
+			  guint16 x, guint16 y)
+{
+	const VncPixelFormat *remote = vnc_framebuffer_get_remote_format(fb);
+	int bpp = remote->bits_per_pixel / 8;
+	int i, j;
+
+	switch (op) {
+	case BLIT_BENCH_SET_PIXEL_AT:
+		for (j = 0 ; j < height ; j++) {
+			guint8 *src = bench->src + (j * BLIT_BENCH_WIDTH * bpp);
+
+			for (i = 0 ; i < width ; i++)
+				vnc_framebuffer_set_pixel_at(fb, src + (i * bpp), x + i, y + j);
+		}
+		break;
+	case BLIT_BENCH_FILL:
+		vnc_framebuffer_fill(fb, bench->src + (y * bpp), x, y, width, height);
+		break;
+	case BLIT_BENCH_BLT:
+		vnc_framebuffer_blt(fb, bench->src, BLIT_BENCH_WIDTH * bpp,
+				    x, y, width, height);
+		break;
+	case BLIT_BENCH_RGB24_BLT:
+		vnc_framebuffer_rgb24_blt(fb, bench->rgb24, BLIT_BENCH_WIDTH * 3,
+					  x, y, width, height);
+		break;
+	case BLIT_BENCH_COPYRECT:
+		/* Scrolling up by a line, the common case */
+		vnc_framebuffer_copyrect(fb, 0, 1, 0, 0, width, height);
+		break;
+	case BLIT_BENCH_BLT_MONO:
+		/* Tight's two colour palette, as used for text */
+		vnc_framebuffer_blt_indexed(fb, bench->palette, 2, bench->rgb24, 1,
+					    BLIT_BENCH_WIDTH, x, y, width, height);
+		break;
+	case BLIT_BENCH_BLT_INDEXED:
+		vnc_framebuffer_blt_indexed(fb, bench->palette, 256, bench->rgb24, 8,
+					    BLIT_BENCH_WIDTH, x, y, width, height);
+		break;
+	}
+}
+
+static void blit_bench_run(struct GVncBlitBench *bench,
+			   const struct GVncBlitBenchFormat *remote,
+			   const struct GVncBlitBenchFormat *local,
+			   int op, guint16 width, guint16 height)
+{
+	int rowstride = BLIT_BENCH_WIDTH * (local->format.bits_per_pixel / 8);
+	VncBaseFramebuffer *fb;
+	VncColorMap *map = NULL;
+	GTimer *timer;
+	guint64 iterations = 0;
+	guint64 batch = 1;
+	double elapsed;
+	guint16 x = 0, y = 0;
+
+	fb = vnc_base_framebuffer_new(bench->buffer, BLIT_BENCH_WIDTH, BLIT_BENCH_HEIGHT,
+				      rowstride, &local->format, &remote->format);
+	if (!remote->format.true_color_flag) {
+		map = blit_bench_color_map_new(&remote->format);
+		vnc_framebuffer_set_color_map(VNC_FRAMEBUFFER(fb), map);
+	}
+
+	/* Once untimed, to pick the kernels and warm the caches */
+	blit_bench_op(VNC_FRAMEBUFFER(fb), bench, op, width, height, 0, 0);
+
+	/* Small rects step across the framebuffer, so every call
+	 * does not hit the same few cache lines */
+	timer = g_timer_new();
+	do {
+		guint64 n;
+
+		for (n = 0 ; n < batch ; n++) {
+			blit_bench_op(VNC_FRAMEBUFFER(fb), bench, op, width, height, x, y);
+			x += width;
+			if (x + width > BLIT_BENCH_WIDTH) {
+				x = 0;
+				y += height;
+				if (y + height > BLIT_BENCH_HEIGHT - 1)
+					y = 0;
+			}
+		}
+		iterations += batch;
+		batch *= 2;
+		elapsed = g_timer_elapsed(timer, NULL);
+	} while (elapsed < bench->min_time);
+	g_timer_destroy(timer);
+
+	printf("{ \"op\": \"%s\", \"remote_format\": \"%s\", \"local_format\": \"%s\", "
+	       "\"width\": %u, \"height\": %u, \"iterations\": %" G_GUINT64_FORMAT ", "
+	       "\"ns_per_pixel\": %.3f, \"mpixels_per_sec\": %.3f }\n",
+	       ops[op], remote->name, local->name, width, height, iterations,
+	       (elapsed * 1e9) / ((double)iterations * width * height),
+	       ((double)iterations * width * height) / elapsed / 1e6);
+	fflush(stdout);
+
+	if (map)
+		vnc_color_map_free(map);
+	g_object_unref(fb);
+}
+
+static VncBaseFramebuffer *blit_bench_verify_fb(guint8 *buffer,
+						const struct GVncBlitBenchFormat *remote,
+						const struct GVncBlitBenchFormat *local,
+						VncColorMap *map,
+						int kernel)
+{
+	int rowstride = BLIT_BENCH_VERIFY_WIDTH * (local->format.bits_per_pixel / 8);
+	VncBaseFramebuffer *fb;
+
+	fb = vnc_base_framebuffer_new(buffer, BLIT_BENCH_VERIFY_WIDTH, BLIT_BENCH_VERIFY_HEIGHT,
+				      rowstride, &local->format, &remote->format);
+	g_object_set(fb, "kernels", kernel, NULL);
+	if (map)
+		vnc_framebuffer_set_color_map(VNC_FRAMEBUFFER(fb), map);
+
+	return fb;
+}
+
+/*
+ * Runs an operation through the given kernels and the generic
+ * ones, at each width and both even and odd offsets, comparing
+ * the whole framebuffer afterwards
+ */
+static gboolean blit_bench_verify(struct GVncBlitBench *bench,
+				  const struct GVncBlitBenchFormat *remote,
+				  const struct GVncBlitBenchFormat *local,
+				  int op, int kernel)
+{
+	size_t size = BLIT_BENCH_VERIFY_WIDTH * BLIT_BENCH_VERIFY_HEIGHT *
+		(local->format.bits_per_pixel / 8);
+	guint8 *want = g_malloc(size);
+	guint8 *got = g_malloc(size);
+	VncColorMap *map = NULL;
+	VncBaseFramebuffer *ref, *fb;
+	guint cases = 0, failures = 0;
+	guint w, x;
+	size_t k;
+
+	if (!remote->format.true_color_flag)
+		map = blit_bench_color_map_new(&remote->format);
+
+	ref = blit_bench_verify_fb(want, remote, local, map,
+				   VNC_BASE_FRAMEBUFFER_KERNELS_GENERIC);
+	fb = blit_bench_verify_fb(got, remote, local, map, kernel);
+
+	for (w = 0 ; w < G_N_ELEMENTS(verify_widths) ; w++) {
+		for (x = 0 ; x < 2 ; x++) {
+			for (k = 0 ; k < size ; k++)
+				want[k] = g_random_int();
+			memcpy(got, want, size);
+
+			blit_bench_op(VNC_FRAMEBUFFER(ref), bench, op, verify_widths[w],
+				      BLIT_BENCH_VERIFY_HEIGHT - 2, x + 1, 1);
+			blit_bench_op(VNC_FRAMEBUFFER(fb), bench, op, verify_widths[w],
+				      BLIT_BENCH_VERIFY_HEIGHT - 2, x + 1, 1);
+
+			cases++;
+			if (memcmp(want, got, size) != 0) {
+				fprintf(stderr, "%s from %s to %s with %s kernels differs at width %u offset %u\n",
+					ops[op], remote->name, local->name, kernels[kernel],
+					verify_widths[w], x + 1);
+				failures++;
+			}
+		}
+	}
+
+	printf("{ \"op\": \"%s\", \"remote_format\": \"%s\", \"local_format\": \"%s\", "
+	       "\"kernels\": \"%s\", \"cases\": %u, \"failures\": %u }\n",
+	       ops[op], remote->name, local->name, kernels[kernel], cases, failures);
+	fflush(stdout);
+
+	g_object_unref(fb);
+	g_object_unref(ref);
+	if (map)
+		vnc_color_map_free(map);
+	g_free(want);
+	g_free(got);
+
+	return failures == 0;
+}
+
+
+static gboolean vnc_debug_option_arg(const gchar *option_name G_GNUC_UNUSED,
+				     const gchar *value G_GNUC_UNUSED,
+				     gpointer data G_GNUC_UNUSED,
+				     GError **error G_GNUC_UNUSED)
+{
+	vnc_util_set_debug(TRUE);
+	return TRUE;
+}
+
+int main(int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	gchar **remote_formats = NULL;
+	gchar **local_formats = NULL;
+	gchar **op_names = NULL;
+	gchar **size_names = NULL;
+	int min_time = 50;
+	gboolean verify = FALSE;
+	const GOptionEntry options [] = {
+		{ "debug", 'd', G_OPTION_FLAG_NO_ARG,  G_OPTION_ARG_CALLBACK,
+		  vnc_debug_option_arg, "Enables debug output", NULL },
+		{ "remote-format", 'r', 0, G_OPTION_ARG_STRING_ARRAY, &remote_formats,
+		  "Remote pixel format, one of rgb888, rgb888-swapped, bgr888, rgb565, "
+		  "rgb565-swapped, bgr233, cmap8, cmap16. Default is all of them", "NAME" },
+		{ "local-format", 'l', 0, G_OPTION_ARG_STRING_ARRAY, &local_formats,
+		  "Local pixel format, one of rgb888, rgb888-swapped, rgb565, "
+		  "rgb565-swapped, bgr233. Default is all of them", "NAME" },
+		{ "op", 'o', 0, G_OPTION_ARG_STRING_ARRAY, &op_names,
+		  "Operation, one of set-pixel-at, fill, blt, rgb24-blt, copyrect, "
+		  "blt-mono, blt-indexed. Default is all of them", "NAME" },
+		{ "size", 's', 0, G_OPTION_ARG_STRING_ARRAY, &size_names,
+		  "Rect size, as WIDTHxHEIGHT. Default is a range from 1x1 to 1024x768",
+		  "SIZE" },
+		{ "min-time", 't', 0, G_OPTION_ARG_INT, &min_time,
+		  "Minimum time to run each case for", "MS" },
+		{ "verify", 'v', 0, G_OPTION_ARG_NONE, &verify,
+		  "Check the kernels against the generic ones instead of timing them", NULL },
+		{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, 0 }
+	};
+	struct GVncBlitBench bench;
+	guint r, l, o, s;
+	int ret = 0;
+
+	g_type_init();
+
+	context = g_option_context_new("- Vnc Framebuffer Blit Benchmark");
+	g_option_context_add_main_entries(context, options, NULL);
+	g_option_context_parse(context, &argc, &argv, &error);
+	if (error) {
+		fprintf(stderr, "%s\n", error->message);
+		g_error_free(error);
+		return 1;
+	}
+
+	memset(&bench, 0, sizeof(bench));
+	bench.min_time = min_time / 1000.0;
+	bench.src = g_malloc(BLIT_BENCH_WIDTH * BLIT_BENCH_HEIGHT * 4);
+	bench.rgb24 = g_malloc(BLIT_BENCH_WIDTH * BLIT_BENCH_HEIGHT * 3);
+	bench.buffer = g_malloc0(BLIT_BENCH_WIDTH * BLIT_BENCH_HEIGHT * 4);
+
+	for (s = 0 ; s < BLIT_BENCH_WIDTH * BLIT_BENCH_HEIGHT * 3 ; s++)
+		bench.rgb24[s] = g_random_int();
+
+	for (r = 0 ; r < G_N_ELEMENTS(formats) ; r++) {
+		if (!blit_bench_name_wanted(remote_formats, formats[r].name))
+			continue;
+
+		blit_bench_source_init(&bench, &formats[r].format);
+
+		for (l = 0 ; l < G_N_ELEMENTS(formats) ; l++) {
+			if (!formats[l].local ||
+			    !blit_bench_name_wanted(local_formats, formats[l].name))
+				continue;
+
+			for (o = 0 ; o < G_N_ELEMENTS(ops) ; o++) {
+				if (!blit_bench_name_wanted(op_names, ops[o]))
+					continue;
+
+				/* Only depends on the local format */
+				if (o == BLIT_BENCH_COPYRECT && r != l)
+					continue;
+				/* Only used for Tight JPEG, which needs true colour */
+				if (o == BLIT_BENCH_RGB24_BLT &&
+				    !formats[r].format.true_color_flag)
+					continue;
+
+				if (verify) {
+					if (!blit_bench_verify(&bench, &formats[r], &formats[l], o,
+							       VNC_BASE_FRAMEBUFFER_KERNELS_FASTEST))
+						ret = 1;
+					if (!blit_bench_verify(&bench, &formats[r], &formats[l], o,
+							       VNC_BASE_FRAMEBUFFER_KERNELS_PORTABLE))
+						ret = 1;
+				} else if (size_names) {
+					for (s = 0 ; size_names[s] ; s++) {
+						guint width, height;
+
+						if (sscanf(size_names[s], "%ux%u", &width, &height) != 2 ||
+						    width < 1 || width > BLIT_BENCH_WIDTH ||
+						    height < 1 || height > BLIT_BENCH_HEIGHT - 1) {
+							fprintf(stderr, "Invalid size %s\n", size_names[s]);
+							return 1;
+						}
+						blit_bench_run(&bench, &formats[r], &formats[l],
+							       o, width, height);
+					}
+				} else {
+					for (s = 0 ; s < G_N_ELEMENTS(sizes) ; s++)
+						blit_bench_run(&bench, &formats[r], &formats[l],
+							       o, sizes[s].width, sizes[s].height);
+				}
+			}
+		}
+	}
+
+	g_free(bench.src);
+	g_free(bench.rgb24);
+	g_free(bench.buffer);
+	g_strfreev(remote_formats);
+	g_strfreev(local_formats);
+	g_strfreev(op_names);
+	g_strfreev(size_names);
+
+	return ret;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
@@ -50,6 +50,17 @@ with the exception of any password prompt.
 
 Display verbose debugging information on the console
 
+=item --stats-file=FILE
+
+Save connection performance statistics to FILE when the capture
+completes. If FILE ends in ".json" they are saved as JSON, otherwise
+in the Prometheus text format.
+
+=item --record=FILE
+
+Record everything the server sends to FILE in the FBS format, for
+later replay without the server.
+
 =back
 
 =head1 EXIT STATUS
@@ -275,6 +286,7 @@ static void do_vnc_initialized(VncConnection *conn,
 {
 	struct GVncCapture *capture = opaque;
 	gint32 encodings[] = {  VNC_CONNECTION_ENCODING_DESKTOP_RESIZE,
+				VNC_CONNECTION_ENCODING_LAST_RECT,
                                 VNC_CONNECTION_ENCODING_ZRLE,
 				VNC_CONNECTION_ENCODING_HEXTILE,
 				VNC_CONNECTION_ENCODING_RRE,
@@ -441,11 +453,17 @@ int main(int argc, char **argv)
 	gchar **args = NULL;
 	int ret;
 	gboolean quiet = FALSE;
+	gchar *stats_file = NULL;
+	gchar *record_file = NULL;
 	const GOptionEntry options [] = {
 		{ "debug", 'd', G_OPTION_FLAG_NO_ARG,  G_OPTION_ARG_CALLBACK,
 		  vnc_debug_option_arg, "Enables debug output", NULL },
 		{ "quiet", 'q', 0, G_OPTION_ARG_NONE,
 		  &quiet, "Don't print any status to console", NULL },
+		{ "stats-file", '\0', 0, G_OPTION_ARG_FILENAME,
+		  &stats_file, "Save performance statistics to FILE", "FILE" },
+		{ "record", '\0', 0, G_OPTION_ARG_FILENAME,
+		  &record_file, "Record the server stream to FILE", "FILE" },
 		{ G_OPTION_REMAINING, '\0', 0, G_OPTION_ARG_STRING_ARRAY, &args,
 		  NULL, "HOSTNAME[:DISPLAY] FILENAME" },
 		{ NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, 0 }
@@ -505,6 +523,13 @@ int main(int argc, char **argv)
 	g_signal_connect(capture->conn, "vnc-framebuffer-update",
 			 G_CALLBACK(do_vnc_framebuffer_update), capture);
 
+	if (record_file &&
+	    !vnc_connection_start_recording(capture->conn, record_file, &error)) {
+		g_print("%s\n", error->message);
+		g_error_free(error);
+		return 1;
+	}
+
 	vnc_connection_open_host(capture->conn, capture->host, port);
 
 	capture->loop = g_main_loop_new(g_main_context_default(), FALSE);
@@ -512,6 +537,20 @@ int main(int argc, char **argv)
 	g_main_loop_run(capture->loop);
 
 	vnc_connection_shutdown(capture->conn);
+
+	if (stats_file) {
+		VncStats *stats = vnc_connection_get_stats(capture->conn);
+		VncStatsFormat format = g_str_has_suffix(stats_file, ".json") ?
+			VNC_STATS_FORMAT_JSON : VNC_STATS_FORMAT_PROMETHEUS;
+
+		if (!vnc_stats_save(stats, format, stats_file, &error)) {
+			g_print("Unable to save statistics to %s: %s\n",
+				stats_file, error->message);
+			g_error_free(error);
+		}
+		vnc_stats_free(stats);
+	}
+
 	g_object_unref(capture->conn);
 	if (capture->pixbuf)
 		gdk_pixbuf_unref(capture->pixbuf);
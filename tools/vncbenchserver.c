@@ -0,0 +1,1651 @@
+/*
+ * Vnc Benchmark Server
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * A minimal RFB 3.8 server generating synthetic screen content, so
+ * the client can be load tested without a real desktop. It serves a
+ * single client on a blocking file descriptor, offering only the
+ * 'None' auth type, and answers every FramebufferUpdateRequest by
+ * advancing the workload by one frame and sending what changed in
+ * the configured encoding.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <glib.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include <vncconnection.h>
+#include <vncconnectionenums.h>
+
+#include "vncbenchserver.h"
+
+#define VNC_BENCH_SERVER_LINE_HEIGHT 16
+#define VNC_BENCH_SERVER_GLYPH_WIDTH 8
+
+#define VNC_BENCH_SERVER_TEXT_BG 0x1c1c1c
+#define VNC_BENCH_SERVER_DESKTOP_BG 0x3a6ea5
+
+/* Tight limits the data in a rect before compression */
+#define VNC_BENCH_SERVER_TIGHT_MAX_PIXELS 65536
+
+struct VncBenchServerDamage {
+	gboolean copy;
+	guint16 x, y, width, height;
+	guint16 src_x, src_y;
+};
+
+struct _VncBenchServer {
+	VncBenchWorkload workload;
+	gint32 encoding;
+	guint16 width;
+	guint16 height;
+	guint frames;
+	gboolean jpeg;
+	guint32 seed;
+
+	/* Per client state, reset by vnc_bench_server_run */
+	int fd;
+	guint32 *scene; /* 0xRRGGBB, width * height */
+	guint32 rand;
+	guint frame;
+
+	VncPixelFormat fmt;
+	gint32 use_encoding;
+	gboolean has_copyrect;
+	int jpeg_quality;
+
+	z_stream zrle;
+	z_stream tight[4];
+
+	guint32 *pixels; /* scene converted to the client format */
+	gsize n_pixels;
+	GByteArray *body;
+	GByteArray *work;
+	GByteArray *zbuf;
+	guint16 n_rects;
+};
+
+
+static const struct {
+	VncBenchWorkload workload;
+	const char *name;
+} workloads[] = {
+	{ VNC_BENCH_WORKLOAD_TEXT, "text" },
+	{ VNC_BENCH_WORKLOAD_NOISE, "noise" },
+	{ VNC_BENCH_WORKLOAD_FILL, "fill" },
+	{ VNC_BENCH_WORKLOAD_SCROLL, "scroll" },
+};
+
+gboolean vnc_bench_workload_from_name(const char *name, VncBenchWorkload *workload)
+{
+	guint i;
+
+	for (i = 0 ; i < G_N_ELEMENTS(workloads) ; i++) {
+		if (g_str_equal(workloads[i].name, name)) {
+			*workload = workloads[i].workload;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+const char *vnc_bench_workload_name(VncBenchWorkload workload)
+{
+	guint i;
+
+	for (i = 0 ; i < G_N_ELEMENTS(workloads) ; i++)
+		if (workloads[i].workload == workload)
+			return workloads[i].name;
+
+	return "unknown";
+}
+
+gboolean vnc_bench_encoding_from_name(const char *name, gint32 *encoding)
+{
+	GEnumClass *klass = g_type_class_ref(VNC_TYPE_CONNECTION_ENCODING);
+	GEnumValue *value = g_enum_get_value_by_nick(klass, name);
+
+	g_type_class_unref(klass);
+
+	if (!value)
+		return FALSE;
+
+	switch (value->value) {
+	case VNC_CONNECTION_ENCODING_RAW:
+	case VNC_CONNECTION_ENCODING_COPY_RECT:
+	case VNC_CONNECTION_ENCODING_RRE:
+	case VNC_CONNECTION_ENCODING_HEXTILE:
+	case VNC_CONNECTION_ENCODING_ZRLE:
+	case VNC_CONNECTION_ENCODING_TIGHT:
+		*encoding = value->value;
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+
+VncBenchServer *vnc_bench_server_new(VncBenchWorkload workload,
+				     gint32 encoding,
+				     guint16 width,
+				     guint16 height)
+{
+	VncBenchServer *server = g_new0(VncBenchServer, 1);
+
+	server->workload = workload;
+	server->encoding = encoding;
+	server->width = width;
+	server->height = height;
+	server->seed = 1;
+	server->fd = -1;
+
+	return server;
+}
+
+void vnc_bench_server_free(VncBenchServer *server)
+{
+	if (!server)
+		return;
+
+	g_free(server);
+}
+
+/* Number of updates to send before returning, or 0 for no limit */
+void vnc_bench_server_set_frames(VncBenchServer *server, guint frames)
+{
+	server->frames = frames;
+}
+
+/* Whether Tight may use JPEG, if the client also asks for a quality level */
+void vnc_bench_server_set_jpeg(VncBenchServer *server, gboolean enable)
+{
+	server->jpeg = enable;
+}
+
+void vnc_bench_server_set_seed(VncBenchServer *server, guint32 seed)
+{
+	server->seed = seed ? seed : 1;
+}
+
+
+static guint32 vnc_bench_server_random(VncBenchServer *server)
+{
+	guint32 x = server->rand;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return server->rand = x;
+}
+
+static guint32 vnc_bench_server_hash(guint32 v)
+{
+	v ^= v >> 16;
+	v *= 0x7feb352d;
+	v ^= v >> 15;
+	v *= 0x846ca68b;
+	v ^= v >> 16;
+
+	return v;
+}
+
+
+/*
+ * Scene generation. Everything is drawn into an 0xRRGGBB image
+ * the size of the desktop, and each step of a workload reports
+ * the areas it changed
+ */
+
+static void vnc_bench_server_fill(VncBenchServer *server,
+				  int x, int y, int width, int height,
+				  guint32 color)
+{
+	int i, j;
+
+	for (j = y ; j < y + height ; j++) {
+		guint32 *row = server->scene + (j * server->width);
+
+		for (i = x ; i < x + width ; i++)
+			row[i] = color;
+	}
+}
+
+/* Draws a ragged line of pseudo-random 'words' at row y */
+static void vnc_bench_server_draw_line(VncBenchServer *server, int y)
+{
+	int cols = server->width / VNC_BENCH_SERVER_GLYPH_WIDTH;
+	int len = vnc_bench_server_random(server) % (cols + 1);
+	int word = 0;
+	guint32 color = 0;
+	int col;
+
+	vnc_bench_server_fill(server, 0, y, server->width,
+			      VNC_BENCH_SERVER_LINE_HEIGHT,
+			      VNC_BENCH_SERVER_TEXT_BG);
+
+	for (col = 0 ; col < len ; col++) {
+		guint32 c;
+		int r;
+
+		if (word == 0) {
+			guint32 pick = vnc_bench_server_random(server);
+
+			word = 2 + (pick % 9);
+			switch ((pick >> 8) % 8) {
+			case 0: color = 0x5fd75f; break;
+			case 1: color = 0x5f87ff; break;
+			default: color = 0xc0c0c0; break;
+			}
+			continue;
+		}
+		word--;
+
+		c = 33 + (vnc_bench_server_random(server) % 94);
+		for (r = 0 ; r < 9 ; r++) {
+			guint32 bits = vnc_bench_server_hash((c << 4) | r) & 0x1f;
+			guint32 *row = server->scene +
+				((y + 3 + r) * server->width) +
+				(col * VNC_BENCH_SERVER_GLYPH_WIDTH) + 1;
+			int b;
+
+			for (b = 0 ; b < 5 ; b++)
+				if (bits & (1 << (4 - b)))
+					row[b] = color;
+		}
+	}
+}
+
+static void vnc_bench_server_draw_video(VncBenchServer *server,
+					int x, int y, int width, int height)
+{
+	int i, j;
+
+	for (j = 0 ; j < height ; j++) {
+		guint32 *row = server->scene + ((y + j) * server->width) + x;
+
+		for (i = 0 ; i < width ; i++) {
+			guint32 noise = vnc_bench_server_random(server);
+			int r = ((i + server->frame * 4) & 0xff) + (int)(noise & 0x3f) - 0x20;
+			int g = ((j + server->frame * 2) & 0xff) + (int)((noise >> 8) & 0x3f) - 0x20;
+			int b = (((i + j) / 2 + server->frame) & 0xff) + (int)((noise >> 16) & 0x3f) - 0x20;
+
+			r = CLAMP(r, 0, 255);
+			g = CLAMP(g, 0, 255);
+			b = CLAMP(b, 0, 255);
+			row[i] = (r << 16) | (g << 8) | b;
+		}
+	}
+}
+
+static void vnc_bench_server_video_area(VncBenchServer *server,
+					struct VncBenchServerDamage *damage)
+{
+	damage->copy = FALSE;
+	damage->x = server->width / 8;
+	damage->y = server->height / 8;
+	damage->width = (server->width * 3) / 4;
+	damage->height = (server->height * 3) / 4;
+}
+
+static int vnc_bench_server_text_height(VncBenchServer *server)
+{
+	return server->height - (server->height % VNC_BENCH_SERVER_LINE_HEIGHT);
+}
+
+static void vnc_bench_server_scene_init(VncBenchServer *server)
+{
+	struct VncBenchServerDamage video;
+	int y;
+
+	switch (server->workload) {
+	case VNC_BENCH_WORKLOAD_TEXT:
+	case VNC_BENCH_WORKLOAD_SCROLL:
+		vnc_bench_server_fill(server, 0, 0, server->width, server->height,
+				      VNC_BENCH_SERVER_TEXT_BG);
+		for (y = 0 ; y < vnc_bench_server_text_height(server) ;
+		     y += VNC_BENCH_SERVER_LINE_HEIGHT)
+			vnc_bench_server_draw_line(server, y);
+		break;
+
+	case VNC_BENCH_WORKLOAD_NOISE:
+		vnc_bench_server_fill(server, 0, 0, server->width, server->height,
+				      VNC_BENCH_SERVER_DESKTOP_BG);
+		vnc_bench_server_video_area(server, &video);
+		vnc_bench_server_draw_video(server, video.x, video.y,
+					    video.width, video.height);
+		break;
+
+	case VNC_BENCH_WORKLOAD_FILL:
+	default:
+		vnc_bench_server_fill(server, 0, 0, server->width, server->height,
+				      VNC_BENCH_SERVER_DESKTOP_BG);
+		break;
+	}
+}
+
+/* Advances the workload by one frame, returning the damage it caused */
+static int vnc_bench_server_scene_step(VncBenchServer *server,
+				       struct VncBenchServerDamage *damage)
+{
+	int text_height = vnc_bench_server_text_height(server);
+	int n = 0;
+	int i;
+
+	switch (server->workload) {
+	case VNC_BENCH_WORKLOAD_TEXT:
+	case VNC_BENCH_WORKLOAD_SCROLL:
+		if (text_height < 2 * VNC_BENCH_SERVER_LINE_HEIGHT)
+			break;
+
+		memmove(server->scene,
+			server->scene + (VNC_BENCH_SERVER_LINE_HEIGHT * server->width),
+			(text_height - VNC_BENCH_SERVER_LINE_HEIGHT) * server->width *
+			sizeof(guint32));
+		vnc_bench_server_draw_line(server, text_height - VNC_BENCH_SERVER_LINE_HEIGHT);
+
+		if (server->workload == VNC_BENCH_WORKLOAD_SCROLL &&
+		    server->has_copyrect) {
+			damage[n].copy = TRUE;
+			damage[n].x = 0;
+			damage[n].y = 0;
+			damage[n].width = server->width;
+			damage[n].height = text_height - VNC_BENCH_SERVER_LINE_HEIGHT;
+			damage[n].src_x = 0;
+			damage[n].src_y = VNC_BENCH_SERVER_LINE_HEIGHT;
+			n++;
+
+			damage[n].copy = FALSE;
+			damage[n].x = 0;
+			damage[n].y = text_height - VNC_BENCH_SERVER_LINE_HEIGHT;
+			damage[n].width = server->width;
+			damage[n].height = VNC_BENCH_SERVER_LINE_HEIGHT;
+			n++;
+		} else {
+			damage[n].copy = FALSE;
+			damage[n].x = 0;
+			damage[n].y = 0;
+			damage[n].width = server->width;
+			damage[n].height = text_height;
+			n++;
+		}
+		break;
+
+	case VNC_BENCH_WORKLOAD_NOISE:
+		vnc_bench_server_video_area(server, &damage[n]);
+		vnc_bench_server_draw_video(server, damage[n].x, damage[n].y,
+					    damage[n].width, damage[n].height);
+		n++;
+		break;
+
+	case VNC_BENCH_WORKLOAD_FILL:
+	default:
+		for (i = 0 ; i < 4 ; i++) {
+			int w = (server->width / 4) +
+				(vnc_bench_server_random(server) % (server->width / 4 + 1));
+			int h = (server->height / 4) +
+				(vnc_bench_server_random(server) % (server->height / 4 + 1));
+
+			damage[n].copy = FALSE;
+			damage[n].width = MAX(w, 1);
+			damage[n].height = MAX(h, 1);
+			damage[n].x = vnc_bench_server_random(server) %
+				(server->width - damage[n].width + 1);
+			damage[n].y = vnc_bench_server_random(server) %
+				(server->height - damage[n].height + 1);
+			vnc_bench_server_fill(server, damage[n].x, damage[n].y,
+					      damage[n].width, damage[n].height,
+					      vnc_bench_server_random(server) & 0xffffff);
+			n++;
+		}
+		break;
+	}
+
+	return n;
+}
+
+
+/*
+ * Pixel output in the client's format
+ */
+
+static int vnc_bench_server_pixel_size(VncBenchServer *server)
+{
+	return server->fmt.bits_per_pixel / 8;
+}
+
+static guint32 vnc_bench_server_component(guint32 value, guint16 max)
+{
+	return ((value * max) + 127) / 255;
+}
+
+static guint32 vnc_bench_server_pixel(VncBenchServer *server, guint32 rgb)
+{
+	const VncPixelFormat *fmt = &server->fmt;
+
+	return (vnc_bench_server_component((rgb >> 16) & 0xff, fmt->red_max) << fmt->red_shift) |
+		(vnc_bench_server_component((rgb >> 8) & 0xff, fmt->green_max) << fmt->green_shift) |
+		(vnc_bench_server_component(rgb & 0xff, fmt->blue_max) << fmt->blue_shift);
+}
+
+static void vnc_bench_server_pixel_bytes(VncBenchServer *server, guint32 pixel,
+					 guint8 *bytes)
+{
+	int bpp = vnc_bench_server_pixel_size(server);
+	int i;
+
+	for (i = 0 ; i < bpp ; i++) {
+		if (server->fmt.byte_order == G_BIG_ENDIAN)
+			bytes[i] = pixel >> (8 * (bpp - 1 - i));
+		else
+			bytes[i] = pixel >> (8 * i);
+	}
+}
+
+static guint8 *vnc_bench_server_reserve(GByteArray *buf, gsize len)
+{
+	gsize offset = buf->len;
+
+	g_byte_array_set_size(buf, offset + len);
+
+	return buf->data + offset;
+}
+
+static void vnc_bench_server_put_u8(GByteArray *buf, guint8 value)
+{
+	g_byte_array_append(buf, &value, 1);
+}
+
+static void vnc_bench_server_put_u16(GByteArray *buf, guint16 value)
+{
+	guint8 *p = vnc_bench_server_reserve(buf, 2);
+
+	p[0] = value >> 8;
+	p[1] = value;
+}
+
+static void vnc_bench_server_put_u32(GByteArray *buf, guint32 value)
+{
+	guint8 *p = vnc_bench_server_reserve(buf, 4);
+
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+static void vnc_bench_server_put_pixel(VncBenchServer *server, GByteArray *buf,
+				       guint32 pixel)
+{
+	vnc_bench_server_pixel_bytes(server, pixel,
+				     vnc_bench_server_reserve(buf, vnc_bench_server_pixel_size(server)));
+}
+
+/* Must agree with vnc_connection_cpixel_size() */
+static int vnc_bench_server_cpixel_size(VncBenchServer *server, int *offset)
+{
+	const VncPixelFormat *fmt = &server->fmt;
+	int bpp = vnc_bench_server_pixel_size(server);
+
+	*offset = 0;
+	if (bpp == 4 && fmt->true_color_flag) {
+		gboolean msb = fmt->red_shift > 7 && fmt->green_shift > 7 && fmt->blue_shift > 7;
+		gboolean lsb = (fmt->red_max << fmt->red_shift) < (1 << 24) &&
+			(fmt->green_max << fmt->green_shift) < (1 << 24) &&
+			(fmt->blue_max << fmt->blue_shift) < (1 << 24);
+
+		if (msb || lsb) {
+			bpp = 3;
+			if (fmt->depth == 24 && fmt->byte_order == G_BIG_ENDIAN)
+				*offset = 1;
+		}
+	}
+
+	return bpp;
+}
+
+static void vnc_bench_server_put_cpixel(VncBenchServer *server, GByteArray *buf,
+					guint32 pixel)
+{
+	guint8 bytes[4];
+	int offset;
+	int cbpp = vnc_bench_server_cpixel_size(server, &offset);
+
+	vnc_bench_server_pixel_bytes(server, pixel, bytes);
+	g_byte_array_append(buf, bytes + offset, cbpp);
+}
+
+/* Must agree with vnc_connection_tpixel_size() */
+static int vnc_bench_server_tpixel_size(VncBenchServer *server)
+{
+	if (server->fmt.depth == 24)
+		return 3;
+	return vnc_bench_server_pixel_size(server);
+}
+
+static void vnc_bench_server_put_tpixel(VncBenchServer *server, GByteArray *buf,
+					guint32 pixel)
+{
+	const VncPixelFormat *fmt = &server->fmt;
+
+	if (fmt->depth == 24) {
+		guint8 *p = vnc_bench_server_reserve(buf, 3);
+
+		p[0] = (pixel >> fmt->red_shift) & fmt->red_max;
+		p[1] = (pixel >> fmt->green_shift) & fmt->green_max;
+		p[2] = (pixel >> fmt->blue_shift) & fmt->blue_max;
+	} else {
+		vnc_bench_server_put_pixel(server, buf, pixel);
+	}
+}
+
+/* Converts an area of the scene into client pixel values */
+static guint32 *vnc_bench_server_convert(VncBenchServer *server,
+					 int x, int y, int width, int height)
+{
+	int i, j;
+
+	if (server->n_pixels < (gsize)(width * height)) {
+		server->n_pixels = width * height;
+		server->pixels = g_renew(guint32, server->pixels, server->n_pixels);
+	}
+
+	for (j = 0 ; j < height ; j++) {
+		guint32 *src = server->scene + ((y + j) * server->width) + x;
+		guint32 *dst = server->pixels + (j * width);
+
+		for (i = 0 ; i < width ; i++)
+			dst[i] = vnc_bench_server_pixel(server, src[i]);
+	}
+
+	return server->pixels;
+}
+
+static gboolean vnc_bench_server_deflate(z_stream *strm,
+					 const guint8 *data, gsize len,
+					 GByteArray *out)
+{
+	guint8 chunk[16384];
+
+	strm->next_in = (Bytef *)data;
+	strm->avail_in = len;
+
+	do {
+		int ret;
+
+		strm->next_out = chunk;
+		strm->avail_out = sizeof(chunk);
+
+		ret = deflate(strm, Z_SYNC_FLUSH);
+		if (ret != Z_OK && ret != Z_BUF_ERROR)
+			return FALSE;
+
+		g_byte_array_append(out, chunk, sizeof(chunk) - strm->avail_out);
+	} while (strm->avail_out == 0);
+
+	return TRUE;
+}
+
+
+/*
+ * Encoders. Each appends one or more rects to the update body
+ */
+
+static void vnc_bench_server_rect_header(VncBenchServer *server,
+					 int x, int y, int width, int height,
+					 gint32 encoding)
+{
+	vnc_bench_server_put_u16(server->body, x);
+	vnc_bench_server_put_u16(server->body, y);
+	vnc_bench_server_put_u16(server->body, width);
+	vnc_bench_server_put_u16(server->body, height);
+	vnc_bench_server_put_u32(server->body, encoding);
+	server->n_rects++;
+}
+
+static void vnc_bench_server_encode_raw(VncBenchServer *server,
+					int x, int y, int width, int height)
+{
+	guint32 *pixels = vnc_bench_server_convert(server, x, y, width, height);
+	int bpp = vnc_bench_server_pixel_size(server);
+	guint8 *dst;
+	int i;
+
+	vnc_bench_server_rect_header(server, x, y, width, height,
+				     VNC_CONNECTION_ENCODING_RAW);
+
+	dst = vnc_bench_server_reserve(server->body, width * height * bpp);
+	for (i = 0 ; i < width * height ; i++, dst += bpp)
+		vnc_bench_server_pixel_bytes(server, pixels[i], dst);
+}
+
+static void vnc_bench_server_encode_copyrect(VncBenchServer *server,
+					     const struct VncBenchServerDamage *damage)
+{
+	vnc_bench_server_rect_header(server, damage->x, damage->y,
+				     damage->width, damage->height,
+				     VNC_CONNECTION_ENCODING_COPY_RECT);
+	vnc_bench_server_put_u16(server->body, damage->src_x);
+	vnc_bench_server_put_u16(server->body, damage->src_y);
+}
+
+/* The first pixel is the background, other colours are sent as
+ * one subrect per horizontal run */
+static void vnc_bench_server_encode_rre(VncBenchServer *server,
+					int x, int y, int width, int height)
+{
+	guint32 *pixels = vnc_bench_server_convert(server, x, y, width, height);
+	guint32 bg = pixels[0];
+	guint32 n_subrects = 0;
+	gsize count;
+	int i, j;
+
+	vnc_bench_server_rect_header(server, x, y, width, height,
+				     VNC_CONNECTION_ENCODING_RRE);
+
+	count = server->body->len;
+	vnc_bench_server_put_u32(server->body, 0);
+	vnc_bench_server_put_pixel(server, server->body, bg);
+
+	for (j = 0 ; j < height ; j++) {
+		guint32 *row = pixels + (j * width);
+
+		for (i = 0 ; i < width ; ) {
+			int start = i;
+
+			if (row[i] == bg) {
+				i++;
+				continue;
+			}
+			while (i < width && row[i] == row[start])
+				i++;
+
+			vnc_bench_server_put_pixel(server, server->body, row[start]);
+			vnc_bench_server_put_u16(server->body, start);
+			vnc_bench_server_put_u16(server->body, j);
+			vnc_bench_server_put_u16(server->body, i - start);
+			vnc_bench_server_put_u16(server->body, 1);
+			n_subrects++;
+		}
+	}
+
+	server->body->data[count + 0] = n_subrects >> 24;
+	server->body->data[count + 1] = n_subrects >> 16;
+	server->body->data[count + 2] = n_subrects >> 8;
+	server->body->data[count + 3] = n_subrects;
+}
+
+/* Counts the horizontal runs which are not the background colour */
+static int vnc_bench_server_count_runs(const guint32 *pixels, int stride,
+				       int width, int height,
+				       guint32 bg, int *n_colors, guint32 *fg)
+{
+	int runs = 0;
+	int i, j;
+
+	*n_colors = 1;
+	for (j = 0 ; j < height ; j++) {
+		const guint32 *row = pixels + (j * stride);
+
+		for (i = 0 ; i < width ; ) {
+			int start = i;
+
+			if (row[i] == bg) {
+				i++;
+				continue;
+			}
+			if (*n_colors == 1) {
+				*fg = row[i];
+				*n_colors = 2;
+			} else if (row[i] != *fg) {
+				*n_colors = 3;
+			}
+			while (i < width && row[i] == row[start])
+				i++;
+			runs++;
+		}
+	}
+
+	return runs;
+}
+
+static void vnc_bench_server_encode_hextile(VncBenchServer *server,
+					    int x, int y, int width, int height)
+{
+	guint32 *pixels = vnc_bench_server_convert(server, x, y, width, height);
+	int bpp = vnc_bench_server_pixel_size(server);
+	gboolean bg_valid = FALSE, fg_valid = FALSE;
+	guint32 bg = 0, fg = 0;
+	int tx, ty;
+
+	vnc_bench_server_rect_header(server, x, y, width, height,
+				     VNC_CONNECTION_ENCODING_HEXTILE);
+
+	for (ty = 0 ; ty < height ; ty += 16) {
+		for (tx = 0 ; tx < width ; tx += 16) {
+			guint32 *tile = pixels + (ty * width) + tx;
+			int w = MIN(16, width - tx);
+			int h = MIN(16, height - ty);
+			guint32 tile_bg = tile[0];
+			guint32 tile_fg = 0;
+			int n_colors;
+			int runs = vnc_bench_server_count_runs(tile, width, w, h, tile_bg,
+							       &n_colors, &tile_fg);
+			int subrect_size = n_colors == 2 ? 2 : bpp + 2;
+			guint8 flags = 0;
+			int i, j;
+
+			if (runs > 255 || (runs * subrect_size) >= (w * h * bpp)) {
+				/* Raw, after which the client's colours are undefined */
+				vnc_bench_server_put_u8(server->body, 0x01);
+				for (j = 0 ; j < h ; j++)
+					for (i = 0 ; i < w ; i++)
+						vnc_bench_server_put_pixel(server, server->body,
+									   tile[(j * width) + i]);
+				bg_valid = fg_valid = FALSE;
+				continue;
+			}
+
+			if (!bg_valid || tile_bg != bg)
+				flags |= 0x02;
+			if (runs) {
+				flags |= 0x08;
+				if (n_colors == 2) {
+					if (!fg_valid || tile_fg != fg)
+						flags |= 0x04;
+				} else {
+					flags |= 0x10;
+				}
+			}
+
+			vnc_bench_server_put_u8(server->body, flags);
+			if (flags & 0x02)
+				vnc_bench_server_put_pixel(server, server->body, tile_bg);
+			if (flags & 0x04)
+				vnc_bench_server_put_pixel(server, server->body, tile_fg);
+			bg = tile_bg;
+			bg_valid = TRUE;
+			if (flags & 0x04) {
+				fg = tile_fg;
+				fg_valid = TRUE;
+			}
+			if (!runs)
+				continue;
+
+			vnc_bench_server_put_u8(server->body, runs);
+			for (j = 0 ; j < h ; j++) {
+				guint32 *row = tile + (j * width);
+
+				for (i = 0 ; i < w ; ) {
+					int start = i;
+
+					if (row[i] == tile_bg) {
+						i++;
+						continue;
+					}
+					while (i < w && row[i] == row[start])
+						i++;
+
+					if (flags & 0x10)
+						vnc_bench_server_put_pixel(server, server->body, row[start]);
+					vnc_bench_server_put_u8(server->body, (start << 4) | j);
+					vnc_bench_server_put_u8(server->body, ((i - start - 1) << 4));
+				}
+			}
+
+			/* The client keeps the last subrect colour as foreground */
+			if (flags & 0x10)
+				fg_valid = FALSE;
+		}
+	}
+}
+
+static int vnc_bench_server_rl_size(int rl)
+{
+	return ((rl - 1) / 255) + 1;
+}
+
+static void vnc_bench_server_put_rl(GByteArray *buf, int rl)
+{
+	rl -= 1;
+	while (rl >= 255) {
+		vnc_bench_server_put_u8(buf, 255);
+		rl -= 255;
+	}
+	vnc_bench_server_put_u8(buf, rl);
+}
+
+static int vnc_bench_server_palette_index(guint32 *palette, int n_palette, guint32 pixel)
+{
+	int i;
+
+	for (i = 0 ; i < n_palette ; i++)
+		if (palette[i] == pixel)
+			return i;
+
+	return -1;
+}
+
+/*
+ * Builds the palette of a tile, giving up once it has more than
+ * max entries, in which case max + 1 is returned
+ */
+static int vnc_bench_server_palette(const guint32 *pixels, int stride,
+				    int width, int height,
+				    guint32 *palette, int max)
+{
+	int n = 0, last = -1;
+	int i, j;
+
+	for (j = 0 ; j < height ; j++) {
+		const guint32 *row = pixels + (j * stride);
+
+		for (i = 0 ; i < width ; i++) {
+			if (last >= 0 && palette[last] == row[i])
+				continue;
+			last = vnc_bench_server_palette_index(palette, n, row[i]);
+			if (last >= 0)
+				continue;
+			if (n == max)
+				return max + 1;
+			last = n;
+			palette[n++] = row[i];
+		}
+	}
+
+	return n;
+}
+
+static void vnc_bench_server_zrle_tile(VncBenchServer *server, GByteArray *buf,
+				       const guint32 *tile, int stride,
+				       int width, int height)
+{
+	guint32 palette[127];
+	int offset;
+	int cbpp = vnc_bench_server_cpixel_size(server, &offset);
+	int n = vnc_bench_server_palette(tile, stride, width, height, palette, 127);
+	int raw_size = width * height * cbpp;
+	int packed_size = G_MAXINT, prle_size = G_MAXINT, rle_size = 0;
+	int bits = n == 2 ? 1 : n <= 4 ? 2 : 4;
+	int i, j, rl;
+	guint32 run;
+
+	if (n == 1) {
+		vnc_bench_server_put_u8(buf, 1);
+		vnc_bench_server_put_cpixel(server, buf, tile[0]);
+		return;
+	}
+
+	/* Runs continue from the end of one row onto the next */
+	if (n <= 127)
+		prle_size = n * cbpp;
+	run = tile[0];
+	rl = 0;
+	for (j = 0 ; j < height ; j++) {
+		for (i = 0 ; i < width ; i++) {
+			guint32 pixel = tile[(j * stride) + i];
+
+			if (rl && pixel == run) {
+				rl++;
+				continue;
+			}
+			if (rl) {
+				rle_size += cbpp + vnc_bench_server_rl_size(rl);
+				if (n <= 127)
+					prle_size += 1 + (rl > 1 ? vnc_bench_server_rl_size(rl) : 0);
+			}
+			run = pixel;
+			rl = 1;
+		}
+	}
+	rle_size += cbpp + vnc_bench_server_rl_size(rl);
+	if (n <= 127)
+		prle_size += 1 + (rl > 1 ? vnc_bench_server_rl_size(rl) : 0);
+	if (n <= 16)
+		packed_size = (n * cbpp) + ((((width * bits) + 7) / 8) * height);
+
+	if (packed_size <= prle_size && packed_size <= rle_size && packed_size < raw_size) {
+		vnc_bench_server_put_u8(buf, n);
+		for (i = 0 ; i < n ; i++)
+			vnc_bench_server_put_cpixel(server, buf, palette[i]);
+
+		for (j = 0 ; j < height ; j++) {
+			guint8 byte = 0;
+			int used = 0;
+
+			for (i = 0 ; i < width ; i++) {
+				int ind = vnc_bench_server_palette_index(palette, n,
+									 tile[(j * stride) + i]);
+
+				byte |= ind << (8 - bits - used);
+				used += bits;
+				if (used == 8) {
+					vnc_bench_server_put_u8(buf, byte);
+					byte = 0;
+					used = 0;
+				}
+			}
+			if (used)
+				vnc_bench_server_put_u8(buf, byte);
+		}
+	} else if (prle_size <= rle_size && prle_size < raw_size) {
+		vnc_bench_server_put_u8(buf, 128 + n);
+		for (i = 0 ; i < n ; i++)
+			vnc_bench_server_put_cpixel(server, buf, palette[i]);
+
+		rl = 0;
+		for (j = 0 ; j <= height ; j++) {
+			for (i = 0 ; i < width ; i++) {
+				guint32 pixel = j < height ? tile[(j * stride) + i] : ~run;
+
+				if (rl && pixel == run) {
+					rl++;
+					continue;
+				}
+				if (rl) {
+					int ind = vnc_bench_server_palette_index(palette, n, run);
+
+					if (rl > 1) {
+						vnc_bench_server_put_u8(buf, ind | 0x80);
+						vnc_bench_server_put_rl(buf, rl);
+					} else {
+						vnc_bench_server_put_u8(buf, ind);
+					}
+				}
+				if (j == height)
+					break;
+				run = pixel;
+				rl = 1;
+			}
+		}
+	} else if (rle_size < raw_size) {
+		vnc_bench_server_put_u8(buf, 128);
+
+		rl = 0;
+		for (j = 0 ; j <= height ; j++) {
+			for (i = 0 ; i < width ; i++) {
+				guint32 pixel = j < height ? tile[(j * stride) + i] : ~run;
+
+				if (rl && pixel == run) {
+					rl++;
+					continue;
+				}
+				if (rl) {
+					vnc_bench_server_put_cpixel(server, buf, run);
+					vnc_bench_server_put_rl(buf, rl);
+				}
+				if (j == height)
+					break;
+				run = pixel;
+				rl = 1;
+			}
+		}
+	} else {
+		vnc_bench_server_put_u8(buf, 0);
+		for (j = 0 ; j < height ; j++)
+			for (i = 0 ; i < width ; i++)
+				vnc_bench_server_put_cpixel(server, buf, tile[(j * stride) + i]);
+	}
+}
+
+static gboolean vnc_bench_server_encode_zrle(VncBenchServer *server,
+					     int x, int y, int width, int height)
+{
+	guint32 *pixels = vnc_bench_server_convert(server, x, y, width, height);
+	int tx, ty;
+
+	g_byte_array_set_size(server->work, 0);
+	for (ty = 0 ; ty < height ; ty += 64)
+		for (tx = 0 ; tx < width ; tx += 64)
+			vnc_bench_server_zrle_tile(server, server->work,
+						   pixels + (ty * width) + tx, width,
+						   MIN(64, width - tx), MIN(64, height - ty));
+
+	g_byte_array_set_size(server->zbuf, 0);
+	if (!vnc_bench_server_deflate(&server->zrle, server->work->data,
+				      server->work->len, server->zbuf))
+		return FALSE;
+
+	vnc_bench_server_rect_header(server, x, y, width, height,
+				     VNC_CONNECTION_ENCODING_ZRLE);
+	vnc_bench_server_put_u32(server->body, server->zbuf->len);
+	g_byte_array_append(server->body, server->zbuf->data, server->zbuf->len);
+
+	return TRUE;
+}
+
+static void vnc_bench_server_put_cint(GByteArray *buf, guint32 value)
+{
+	if (value <= 0x7f) {
+		vnc_bench_server_put_u8(buf, value);
+	} else if (value <= 0x3fff) {
+		vnc_bench_server_put_u8(buf, (value & 0x7f) | 0x80);
+		vnc_bench_server_put_u8(buf, value >> 7);
+	} else {
+		vnc_bench_server_put_u8(buf, (value & 0x7f) | 0x80);
+		vnc_bench_server_put_u8(buf, ((value >> 7) & 0x7f) | 0x80);
+		vnc_bench_server_put_u8(buf, value >> 14);
+	}
+}
+
+/* Small payloads are sent as is, anything else through a zlib stream */
+static gboolean vnc_bench_server_tight_data(VncBenchServer *server, int stream)
+{
+	if (server->work->len < 12) {
+		g_byte_array_append(server->body, server->work->data, server->work->len);
+		return TRUE;
+	}
+
+	g_byte_array_set_size(server->zbuf, 0);
+	if (!vnc_bench_server_deflate(&server->tight[stream], server->work->data,
+				      server->work->len, server->zbuf))
+		return FALSE;
+
+	vnc_bench_server_put_cint(server->body, server->zbuf->len);
+	g_byte_array_append(server->body, server->zbuf->data, server->zbuf->len);
+
+	return TRUE;
+}
+
+/* Matches the tight 'gradient' filter prediction in the client */
+static guint32 vnc_bench_server_gradient_diff(VncBenchServer *server,
+					      guint32 pixel, guint32 left,
+					      guint32 up, guint32 upleft)
+{
+	const VncPixelFormat *fmt = &server->fmt;
+	guint32 diff = 0;
+	int c;
+
+	for (c = 0 ; c < 3 ; c++) {
+		int shift = c == 0 ? fmt->red_shift : c == 1 ? fmt->green_shift : fmt->blue_shift;
+		int max = c == 0 ? fmt->red_max : c == 1 ? fmt->green_max : fmt->blue_max;
+		int predicted = (int)((left >> shift) & max) + (int)((up >> shift) & max) -
+			(int)((upleft >> shift) & max);
+
+		predicted = CLAMP(predicted, 0, max);
+		diff |= ((((pixel >> shift) & max) - predicted) & max) << shift;
+	}
+
+	return diff;
+}
+
+static gboolean vnc_bench_server_tight_jpeg(VncBenchServer *server,
+					    int x, int y, int width, int height)
+{
+	static const int quality[] = { 5, 10, 15, 25, 37, 50, 60, 70, 75, 80 };
+	GdkPixbuf *pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+	guint8 *dst = gdk_pixbuf_get_pixels(pixbuf);
+	int rowstride = gdk_pixbuf_get_rowstride(pixbuf);
+	gchar *data = NULL;
+	gsize len;
+	gchar *level;
+	gboolean ret;
+	int i, j;
+
+	for (j = 0 ; j < height ; j++) {
+		guint32 *src = server->scene + ((y + j) * server->width) + x;
+		guint8 *row = dst + (j * rowstride);
+
+		for (i = 0 ; i < width ; i++) {
+			row[(i * 3) + 0] = src[i] >> 16;
+			row[(i * 3) + 1] = src[i] >> 8;
+			row[(i * 3) + 2] = src[i];
+		}
+	}
+
+	level = g_strdup_printf("%d", quality[server->jpeg_quality]);
+	ret = gdk_pixbuf_save_to_buffer(pixbuf, &data, &len, "jpeg", NULL,
+					"quality", level, NULL);
+	g_free(level);
+	g_object_unref(pixbuf);
+	if (!ret)
+		return FALSE;
+
+	vnc_bench_server_rect_header(server, x, y, width, height,
+				     VNC_CONNECTION_ENCODING_TIGHT);
+	vnc_bench_server_put_u8(server->body, 0x90);
+	vnc_bench_server_put_cint(server->body, len);
+	g_byte_array_append(server->body, (guint8 *)data, len);
+	g_free(data);
+
+	return TRUE;
+}
+
+/*
+ * Solid areas become fills, up to 256 colours use the palette
+ * filter and anything busier is JPEG when allowed, otherwise the
+ * gradient filter at 24-bit depth and plain copy for the rest
+ */
+static gboolean vnc_bench_server_tight_band(VncBenchServer *server,
+					    int x, int y, int width, int height)
+{
+	guint32 *pixels = vnc_bench_server_convert(server, x, y, width, height);
+	guint32 palette[256];
+	int n = vnc_bench_server_palette(pixels, width, width, height, palette, 256);
+	int i, j;
+
+	if (n == 1) {
+		vnc_bench_server_rect_header(server, x, y, width, height,
+					     VNC_CONNECTION_ENCODING_TIGHT);
+		vnc_bench_server_put_u8(server->body, 0x80);
+		vnc_bench_server_put_tpixel(server, server->body, pixels[0]);
+		return TRUE;
+	}
+
+	if (n > 256 && server->jpeg && server->jpeg_quality >= 0 &&
+	    server->fmt.bits_per_pixel >= 16)
+		return vnc_bench_server_tight_jpeg(server, x, y, width, height);
+
+	vnc_bench_server_rect_header(server, x, y, width, height,
+				     VNC_CONNECTION_ENCODING_TIGHT);
+	g_byte_array_set_size(server->work, 0);
+
+	if (n <= 256) {
+		int stream = n == 2 ? 1 : 2;
+
+		vnc_bench_server_put_u8(server->body, (stream | 0x04) << 4);
+		vnc_bench_server_put_u8(server->body, 1);
+		vnc_bench_server_put_u8(server->body, n - 1);
+		for (i = 0 ; i < n ; i++)
+			vnc_bench_server_put_tpixel(server, server->body, palette[i]);
+
+		for (j = 0 ; j < height ; j++) {
+			guint32 *row = pixels + (j * width);
+			guint8 byte = 0;
+
+			for (i = 0 ; i < width ; i++) {
+				int ind = vnc_bench_server_palette_index(palette, n, row[i]);
+
+				if (n > 2) {
+					vnc_bench_server_put_u8(server->work, ind);
+					continue;
+				}
+				byte |= ind << (7 - (i % 8));
+				if ((i % 8) == 7) {
+					vnc_bench_server_put_u8(server->work, byte);
+					byte = 0;
+				}
+			}
+			if (n == 2 && (width % 8))
+				vnc_bench_server_put_u8(server->work, byte);
+		}
+
+		return vnc_bench_server_tight_data(server, stream);
+	}
+
+	if (server->fmt.depth == 24) {
+		vnc_bench_server_put_u8(server->body, (3 | 0x04) << 4);
+		vnc_bench_server_put_u8(server->body, 2);
+
+		for (j = 0 ; j < height ; j++) {
+			guint32 *row = pixels + (j * width);
+			guint32 *last = j ? row - width : NULL;
+
+			for (i = 0 ; i < width ; i++) {
+				guint32 left = i ? row[i - 1] : 0;
+				guint32 up = last ? last[i] : 0;
+				guint32 upleft = (i && last) ? last[i - 1] : 0;
+
+				vnc_bench_server_put_tpixel(server, server->work,
+							    vnc_bench_server_gradient_diff(server, row[i],
+											   left, up, upleft));
+			}
+		}
+
+		return vnc_bench_server_tight_data(server, 3);
+	}
+
+	vnc_bench_server_put_u8(server->body, 0x00);
+	for (i = 0 ; i < width * height ; i++)
+		vnc_bench_server_put_tpixel(server, server->work, pixels[i]);
+
+	return vnc_bench_server_tight_data(server, 0);
+}
+
+static gboolean vnc_bench_server_encode_tight(VncBenchServer *server,
+					      int x, int y, int width, int height)
+{
+	int rows = MAX(1, VNC_BENCH_SERVER_TIGHT_MAX_PIXELS / width);
+	int j;
+
+	for (j = 0 ; j < height ; j += rows)
+		if (!vnc_bench_server_tight_band(server, x, y + j, width,
+						 MIN(rows, height - j)))
+			return FALSE;
+
+	return TRUE;
+}
+
+static gboolean vnc_bench_server_encode(VncBenchServer *server,
+					const struct VncBenchServerDamage *damage)
+{
+	if (!damage->width || !damage->height)
+		return TRUE;
+
+	if (damage->copy) {
+		vnc_bench_server_encode_copyrect(server, damage);
+		return TRUE;
+	}
+
+	switch (server->use_encoding) {
+	case VNC_CONNECTION_ENCODING_RRE:
+		vnc_bench_server_encode_rre(server, damage->x, damage->y,
+					    damage->width, damage->height);
+		return TRUE;
+	case VNC_CONNECTION_ENCODING_HEXTILE:
+		vnc_bench_server_encode_hextile(server, damage->x, damage->y,
+						damage->width, damage->height);
+		return TRUE;
+	case VNC_CONNECTION_ENCODING_ZRLE:
+		return vnc_bench_server_encode_zrle(server, damage->x, damage->y,
+						    damage->width, damage->height);
+	case VNC_CONNECTION_ENCODING_TIGHT:
+		return vnc_bench_server_encode_tight(server, damage->x, damage->y,
+						     damage->width, damage->height);
+	case VNC_CONNECTION_ENCODING_RAW:
+	default:
+		vnc_bench_server_encode_raw(server, damage->x, damage->y,
+					    damage->width, damage->height);
+		return TRUE;
+	}
+}
+
+
+/*
+ * Protocol
+ */
+
+static gboolean vnc_bench_server_read(VncBenchServer *server, void *data, gsize len,
+				      gboolean *eof, GError **error)
+{
+	guint8 *p = data;
+
+	while (len) {
+		ssize_t ret = read(server->fd, p, len);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+				    "Unable to read from client: %s", g_strerror(errno));
+			return FALSE;
+		}
+		if (ret == 0) {
+			if (eof)
+				*eof = TRUE;
+			else
+				g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+					    "Client closed the connection");
+			return FALSE;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return TRUE;
+}
+
+static gboolean vnc_bench_server_write(VncBenchServer *server, const void *data, gsize len,
+				       GError **error)
+{
+	const guint8 *p = data;
+
+	while (len) {
+		ssize_t ret = write(server->fd, p, len);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+				    "Unable to write to client: %s", g_strerror(errno));
+			return FALSE;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return TRUE;
+}
+
+static gboolean vnc_bench_server_skip(VncBenchServer *server, gsize len, GError **error)
+{
+	guint8 buf[256];
+
+	while (len) {
+		gsize want = MIN(len, sizeof(buf));
+
+		if (!vnc_bench_server_read(server, buf, want, NULL, error))
+			return FALSE;
+		len -= want;
+	}
+
+	return TRUE;
+}
+
+static void vnc_bench_server_put_pixel_format(GByteArray *buf, const VncPixelFormat *fmt)
+{
+	vnc_bench_server_put_u8(buf, fmt->bits_per_pixel);
+	vnc_bench_server_put_u8(buf, fmt->depth);
+	vnc_bench_server_put_u8(buf, fmt->byte_order == G_BIG_ENDIAN ? 1 : 0);
+	vnc_bench_server_put_u8(buf, fmt->true_color_flag);
+	vnc_bench_server_put_u16(buf, fmt->red_max);
+	vnc_bench_server_put_u16(buf, fmt->green_max);
+	vnc_bench_server_put_u16(buf, fmt->blue_max);
+	vnc_bench_server_put_u8(buf, fmt->red_shift);
+	vnc_bench_server_put_u8(buf, fmt->green_shift);
+	vnc_bench_server_put_u8(buf, fmt->blue_shift);
+	vnc_bench_server_put_u8(buf, 0);
+	vnc_bench_server_put_u8(buf, 0);
+	vnc_bench_server_put_u8(buf, 0);
+}
+
+static gboolean vnc_bench_server_handshake(VncBenchServer *server, GError **error)
+{
+	GByteArray *buf = server->body;
+	char version[13];
+	int major, minor;
+	guint8 choice, shared;
+	gchar *name;
+
+	if (!vnc_bench_server_write(server, "RFB 003.008\n", 12, error) ||
+	    !vnc_bench_server_read(server, version, 12, NULL, error))
+		return FALSE;
+
+	version[12] = '\0';
+	if (sscanf(version, "RFB %03d.%03d\n", &major, &minor) != 2 ||
+	    major != 3 || minor < 3) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+			    "Unsupported client version '%s'", version);
+		return FALSE;
+	}
+
+	g_byte_array_set_size(buf, 0);
+	if (minor >= 7) {
+		vnc_bench_server_put_u8(buf, 1);
+		vnc_bench_server_put_u8(buf, VNC_CONNECTION_AUTH_NONE);
+		if (!vnc_bench_server_write(server, buf->data, buf->len, error) ||
+		    !vnc_bench_server_read(server, &choice, 1, NULL, error))
+			return FALSE;
+		if (choice != VNC_CONNECTION_AUTH_NONE) {
+			g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+				    "Client chose unsupported auth %d", choice);
+			return FALSE;
+		}
+		g_byte_array_set_size(buf, 0);
+		if (minor >= 8)
+			vnc_bench_server_put_u32(buf, 0);
+	} else {
+		vnc_bench_server_put_u32(buf, VNC_CONNECTION_AUTH_NONE);
+	}
+	if (buf->len &&
+	    !vnc_bench_server_write(server, buf->data, buf->len, error))
+		return FALSE;
+
+	if (!vnc_bench_server_read(server, &shared, 1, NULL, error))
+		return FALSE;
+
+	name = g_strdup_printf("gvncbenchserver %s", vnc_bench_workload_name(server->workload));
+	g_byte_array_set_size(buf, 0);
+	vnc_bench_server_put_u16(buf, server->width);
+	vnc_bench_server_put_u16(buf, server->height);
+	vnc_bench_server_put_pixel_format(buf, &server->fmt);
+	vnc_bench_server_put_u32(buf, strlen(name));
+	g_byte_array_append(buf, (guint8 *)name, strlen(name));
+	g_free(name);
+
+	return vnc_bench_server_write(server, buf->data, buf->len, error);
+}
+
+static gboolean vnc_bench_server_set_pixel_format(VncBenchServer *server, GError **error)
+{
+	guint8 msg[19];
+	VncPixelFormat fmt;
+
+	if (!vnc_bench_server_read(server, msg, sizeof(msg), NULL, error))
+		return FALSE;
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.bits_per_pixel = msg[3];
+	fmt.depth = msg[4];
+	fmt.byte_order = msg[5] ? G_BIG_ENDIAN : G_LITTLE_ENDIAN;
+	fmt.true_color_flag = msg[6];
+	fmt.red_max = (msg[7] << 8) | msg[8];
+	fmt.green_max = (msg[9] << 8) | msg[10];
+	fmt.blue_max = (msg[11] << 8) | msg[12];
+	fmt.red_shift = msg[13];
+	fmt.green_shift = msg[14];
+	fmt.blue_shift = msg[15];
+
+	if (!fmt.true_color_flag ||
+	    (fmt.bits_per_pixel != 8 && fmt.bits_per_pixel != 16 &&
+	     fmt.bits_per_pixel != 32)) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+			    "Unsupported client pixel format %d bpp, true colour %d",
+			    fmt.bits_per_pixel, fmt.true_color_flag);
+		return FALSE;
+	}
+
+	server->fmt = fmt;
+	return TRUE;
+}
+
+static gboolean vnc_bench_server_set_encodings(VncBenchServer *server, GError **error)
+{
+	guint8 msg[3];
+	guint16 n, i;
+
+	if (!vnc_bench_server_read(server, msg, sizeof(msg), NULL, error))
+		return FALSE;
+
+	n = (msg[1] << 8) | msg[2];
+	server->use_encoding = VNC_CONNECTION_ENCODING_RAW;
+	server->has_copyrect = FALSE;
+	server->jpeg_quality = -1;
+
+	for (i = 0 ; i < n ; i++) {
+		guint8 enc[4];
+		gint32 encoding;
+
+		if (!vnc_bench_server_read(server, enc, sizeof(enc), NULL, error))
+			return FALSE;
+		encoding = (enc[0] << 24) | (enc[1] << 16) | (enc[2] << 8) | enc[3];
+
+		if (encoding == server->encoding &&
+		    encoding != VNC_CONNECTION_ENCODING_COPY_RECT)
+			server->use_encoding = encoding;
+		if (encoding == VNC_CONNECTION_ENCODING_COPY_RECT)
+			server->has_copyrect = TRUE;
+		if (encoding >= VNC_CONNECTION_ENCODING_TIGHT_JPEG0 &&
+		    encoding <= VNC_CONNECTION_ENCODING_TIGHT_JPEG9)
+			server->jpeg_quality = encoding - VNC_CONNECTION_ENCODING_TIGHT_JPEG0;
+	}
+
+	return TRUE;
+}
+
+static gboolean vnc_bench_server_update(VncBenchServer *server,
+					GError **error)
+{
+	guint8 msg[9];
+	guint8 header[4];
+	struct VncBenchServerDamage damage[8];
+	int n = 0, i;
+
+	if (!vnc_bench_server_read(server, msg, sizeof(msg), NULL, error))
+		return FALSE;
+
+	if (msg[0]) {
+		n = vnc_bench_server_scene_step(server, damage);
+	} else {
+		damage[0].copy = FALSE;
+		damage[0].x = 0;
+		damage[0].y = 0;
+		damage[0].width = server->width;
+		damage[0].height = server->height;
+		n = 1;
+	}
+
+	g_byte_array_set_size(server->body, 0);
+	server->n_rects = 0;
+	for (i = 0 ; i < n ; i++) {
+		if (!vnc_bench_server_encode(server, &damage[i])) {
+			g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+				    "Unable to encode frame %u", server->frame);
+			return FALSE;
+		}
+	}
+
+	header[0] = 0;
+	header[1] = 0;
+	header[2] = server->n_rects >> 8;
+	header[3] = server->n_rects;
+
+	server->frame++;
+
+	return vnc_bench_server_write(server, header, sizeof(header), error) &&
+		vnc_bench_server_write(server, server->body->data, server->body->len, error);
+}
+
+static gboolean vnc_bench_server_message(VncBenchServer *server,
+					 gboolean *eof, GError **error)
+{
+	guint8 type;
+	guint8 msg[11];
+	guint32 len;
+
+	if (!vnc_bench_server_read(server, &type, 1, eof, error))
+		return FALSE;
+
+	switch (type) {
+	case 0: /* SetPixelFormat */
+		return vnc_bench_server_set_pixel_format(server, error);
+	case 2: /* SetEncodings */
+		return vnc_bench_server_set_encodings(server, error);
+	case 3: /* FramebufferUpdateRequest */
+		return vnc_bench_server_update(server, error);
+	case 4: /* KeyEvent */
+		return vnc_bench_server_skip(server, 7, error);
+	case 5: /* PointerEvent */
+		return vnc_bench_server_skip(server, 5, error);
+	case 6: /* ClientCutText */
+		if (!vnc_bench_server_read(server, msg, 7, NULL, error))
+			return FALSE;
+		len = (msg[3] << 24) | (msg[4] << 16) | (msg[5] << 8) | msg[6];
+		return vnc_bench_server_skip(server, len, error);
+	case 255: /* QEMU extended key event */
+		if (!vnc_bench_server_read(server, msg, 11, NULL, error))
+			return FALSE;
+		if (msg[0] == 0)
+			return TRUE;
+		/* fallthrough */
+	default:
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+			    "Unsupported client message %d", type);
+		return FALSE;
+	}
+}
+
+/*
+ * Serves one client on fd until it disconnects or the frame limit
+ * is reached. The caller owns fd and closes it afterwards, which
+ * the client sees as the end of the session.
+ */
+gboolean vnc_bench_server_run(VncBenchServer *server, int fd, GError **error)
+{
+	gboolean eof = FALSE;
+	gboolean ret = TRUE;
+	int i;
+
+	server->fd = fd;
+	server->rand = server->seed;
+	server->frame = 0;
+	server->use_encoding = VNC_CONNECTION_ENCODING_RAW;
+	server->has_copyrect = FALSE;
+	server->jpeg_quality = -1;
+
+	memset(&server->fmt, 0, sizeof(server->fmt));
+	server->fmt.bits_per_pixel = 32;
+	server->fmt.depth = 24;
+	server->fmt.byte_order = G_LITTLE_ENDIAN;
+	server->fmt.true_color_flag = 1;
+	server->fmt.red_max = 255;
+	server->fmt.green_max = 255;
+	server->fmt.blue_max = 255;
+	server->fmt.red_shift = 16;
+	server->fmt.green_shift = 8;
+	server->fmt.blue_shift = 0;
+
+	memset(&server->zrle, 0, sizeof(server->zrle));
+	deflateInit(&server->zrle, Z_DEFAULT_COMPRESSION);
+	for (i = 0 ; i < 4 ; i++) {
+		memset(&server->tight[i], 0, sizeof(server->tight[i]));
+		deflateInit(&server->tight[i], Z_DEFAULT_COMPRESSION);
+	}
+
+	server->scene = g_new(guint32, server->width * server->height);
+	server->body = g_byte_array_new();
+	server->work = g_byte_array_new();
+	server->zbuf = g_byte_array_new();
+
+	vnc_bench_server_scene_init(server);
+
+	if (!vnc_bench_server_handshake(server, error))
+		ret = FALSE;
+
+	while (ret && (!server->frames || server->frame < server->frames)) {
+		if (!vnc_bench_server_message(server, &eof, error)) {
+			ret = eof;
+			break;
+		}
+	}
+
+	deflateEnd(&server->zrle);
+	for (i = 0 ; i < 4 ; i++)
+		deflateEnd(&server->tight[i]);
+
+	g_free(server->scene);
+	g_free(server->pixels);
+	g_byte_array_free(server->body, TRUE);
+	g_byte_array_free(server->work, TRUE);
+	g_byte_array_free(server->zbuf, TRUE);
+	server->scene = NULL;
+	server->pixels = NULL;
+	server->n_pixels = 0;
+	server->body = server->work = server->zbuf = NULL;
+	server->fd = -1;
+
+	return ret;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
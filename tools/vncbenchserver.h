@@ -0,0 +1,69 @@
+/*
+ * Vnc Benchmark Server
+ *
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef VNC_BENCH_SERVER_H
+#define VNC_BENCH_SERVER_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _VncBenchServer VncBenchServer;
+
+typedef enum {
+	VNC_BENCH_WORKLOAD_TEXT,   /* Terminal style text scrolling up a line at a time */
+	VNC_BENCH_WORKLOAD_NOISE,  /* Video-like random pixels over most of the screen */
+	VNC_BENCH_WORKLOAD_FILL,   /* Large solid coloured rectangles */
+	VNC_BENCH_WORKLOAD_SCROLL, /* Text scrolled with CopyRect, plus the new line */
+} VncBenchWorkload;
+
+/* Range of desktop sizes the tools accept */
+#define VNC_BENCH_SERVER_MIN_SIZE 16
+#define VNC_BENCH_SERVER_MAX_SIZE 8192
+
+VncBenchServer *vnc_bench_server_new(VncBenchWorkload workload,
+				     gint32 encoding,
+				     guint16 width,
+				     guint16 height);
+void vnc_bench_server_free(VncBenchServer *server);
+
+void vnc_bench_server_set_frames(VncBenchServer *server, guint frames);
+void vnc_bench_server_set_jpeg(VncBenchServer *server, gboolean enable);
+void vnc_bench_server_set_seed(VncBenchServer *server, guint32 seed);
+
+gboolean vnc_bench_server_run(VncBenchServer *server, int fd, GError **error);
+
+gboolean vnc_bench_workload_from_name(const char *name, VncBenchWorkload *workload);
+const char *vnc_bench_workload_name(VncBenchWorkload workload);
+
+gboolean vnc_bench_encoding_from_name(const char *name, gint32 *encoding);
+
+
+G_END_DECLS
+
+#endif /* VNC_BENCH_SERVER_H */
+
+/*
+ * Local variables:
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */